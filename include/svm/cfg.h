@@ -0,0 +1,39 @@
+#ifndef HDR_SVM_CFG_H
+#define HDR_SVM_CFG_H
+
+#include "svm/instructions.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A run of instructions that is only entered at start and only left after end - 1.
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+
+  // Blocks that control can continue to. Calls and spawns count the target as well as the return continuation.
+  uint64_t succ[2];
+  uint64_t num_succ;
+
+  bool reachable;
+} svm_block_t;
+
+typedef struct {
+  svm_block_t *blocks;
+  uint64_t num_blocks;
+  // Index of the block containing each instruction.
+  uint64_t *block_of;
+} svm_cfg_t;
+
+bool svm_instruction_type_ends_block(svm_instruction_type_t inst_type);
+bool svm_instruction_type_falls_through(svm_instruction_type_t inst_type);
+
+// Split program into basic blocks and mark every block that can be reached from the first instruction.
+void svm_cfg_build(svm_cfg_t *cfg, const svm_instruction_t *program, uint64_t size);
+void svm_cfg_free(svm_cfg_t *cfg);
+
+// Remove every instruction i for which keep[i] is false and point jumps, calls and spawns at the new addresses. A
+// target that was removed is moved to the next instruction that is kept. Returns the new program size.
+uint64_t svm_program_compact(svm_instruction_t *program, uint64_t size, const bool *keep);
+
+#endif // HDR_SVM_CFG_H
@@ -0,0 +1,79 @@
+#ifndef HDR_SVM_CHAN_H
+#define HDR_SVM_CHAN_H
+
+#include "svm/svm.h"
+#include "svm/value.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * A bounded queue of values that any number of threads can send to and receive from without taking a lock. Each cell
+ * carries a sequence number that says whether it is free for the sender at a position or full for the receiver at a
+ * position. Threads only sleep, on a mutex and condition variable, when the channel stays full or empty for a while.
+ *
+ * Programs refer to channels by their index in the channel table of the VM (shared by all fibers and parfor calls of
+ * a program). The host can create channels and bind the same channel into the tables of several VMs before running
+ * them, to connect VMs that run on different threads.
+ *
+ * Fibers don't block their worker thread on a channel. A send or recv that can't go ahead parks the fiber on the
+ * channel, and the next send or receive that succeeds, from any thread, puts it back in the scheduler's ready queue to
+ * try again.
+ */
+
+typedef struct {
+  _Atomic uint64_t seq;
+  svm_value_t value;
+} svm_chan_cell_t;
+
+typedef struct svm_chan {
+  _Atomic uint64_t refs;
+  svm_chan_cell_t *cells;
+  // Capacity - 1. The capacity is a power of two.
+  uint64_t mask;
+
+  // Next position to send to and receive from, on separate cache lines so senders and receivers don't fight.
+  _Alignas(64) _Atomic uint64_t send_pos;
+  _Alignas(64) _Atomic uint64_t recv_pos;
+
+  _Alignas(64) pthread_mutex_t lock;
+  pthread_cond_t changed;
+  // Threads sleeping and fibers parked until something is sent or received.
+  _Atomic uint32_t sleeping;
+  // Number of sends and receives that went ahead, to tell whether the channel changed since a fiber tried it.
+  _Atomic uint64_t changes;
+  // Fibers parked on the channel, linked through next_waiter. Guarded by lock.
+  struct svm_fiber *waiters;
+} svm_chan_t;
+
+// Create a channel with room for at least capacity values. The caller holds the only reference. Returns NULL if
+// capacity is over SVM_MAX_CHANNEL_CAPACITY or the memory can't be allocated.
+svm_chan_t *svm_chan_new(uint64_t capacity);
+void svm_chan_retain(svm_chan_t *chan);
+void svm_chan_release(svm_chan_t *chan);
+
+bool svm_chan_try_send(svm_chan_t *chan, svm_value_t value);
+bool svm_chan_try_recv(svm_chan_t *chan, svm_value_t *value);
+// Block until there is room, or a value.
+void svm_chan_send(svm_chan_t *chan, svm_value_t value);
+svm_value_t svm_chan_recv(svm_chan_t *chan);
+
+// Read the number of changes before a try_send or try_recv that may fail, to pass to svm_chan_park.
+uint64_t svm_chan_changes(svm_chan_t *chan);
+// Park fiber on chan until the next send or receive, which wakes it with svm_sched_wake. Returns false, without
+// parking the fiber, if the channel changed after svm_chan_changes returned changes.
+bool svm_chan_park(svm_chan_t *chan, struct svm_fiber *fiber, uint64_t changes);
+// Take fiber off chan if it is still parked there.
+void svm_chan_unpark(svm_chan_t *chan, struct svm_fiber *fiber);
+
+// Put chan in slot index of the channel table of svm, releasing whatever was there. Returns false if index is out of
+// range.
+bool svm_chan_bind(svm_t *svm, uint64_t index, svm_chan_t *chan);
+// Put chan in the first free slot of the channel table of svm. Returns false if the table is full.
+bool svm_chan_bind_free(svm_t *svm, svm_chan_t *chan, uint64_t *index);
+// Release every channel in the channel table of svm.
+void svm_chan_unbind_all(svm_t *svm);
+
+#endif // HDR_SVM_CHAN_H
@@ -0,0 +1,77 @@
+#ifndef HDR_SVM_DEBUG_H
+#define HDR_SVM_DEBUG_H
+
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/value.h"
+#include "svm/instructions.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A breakpoint replaces the type of its instruction with SVM_INST_BREAK, so the interpreter runs at full speed until
+ * it gets there. Stepping over a breakpoint puts the original instruction back for one instruction. Watchpoints need
+ * the value checked after every instruction, so the program is single stepped while there are any.
+ */
+
+#define SVM_DEBUG_MAX_BREAKPOINTS 64
+#define SVM_DEBUG_MAX_WATCHPOINTS 16
+
+typedef struct {
+  uint64_t addr;
+  // Type of the instruction under the breakpoint. Kept up to date when quickening changes it.
+  svm_instruction_type_t saved;
+} svm_breakpoint_t;
+
+typedef enum {
+  SVM_WATCH_STACK,
+  SVM_WATCH_HEAP,
+} svm_watch_kind_t;
+
+typedef struct {
+  svm_watch_kind_t kind;
+  // Stack slot counted from the bottom of the stack, or an address returned by alloc.
+  uint64_t slot;
+  void *addr;
+
+  // Whether the slot is on the stack or the address is allocated, and the value it had the last time it was checked.
+  bool valid;
+  svm_value_t value;
+} svm_watchpoint_t;
+
+typedef struct {
+  svm_t *svm;
+
+  svm_breakpoint_t breakpoints[SVM_DEBUG_MAX_BREAKPOINTS];
+  uint64_t num_breakpoints;
+  svm_watchpoint_t watchpoints[SVM_DEBUG_MAX_WATCHPOINTS];
+  uint64_t num_watchpoints;
+} svm_debugger_t;
+
+void svm_debug_init(svm_debugger_t *dbg, svm_t *svm);
+
+bool svm_debug_set_breakpoint(svm_debugger_t *dbg, uint64_t addr);
+bool svm_debug_clear_breakpoint(svm_debugger_t *dbg, uint64_t addr);
+bool svm_debug_watch_stack(svm_debugger_t *dbg, uint64_t slot);
+bool svm_debug_watch_heap(svm_debugger_t *dbg, void *addr);
+bool svm_debug_unwatch(svm_debugger_t *dbg, uint64_t index);
+
+// The instruction at addr as the program sees it, without any breakpoint on it.
+svm_instruction_t svm_debug_instruction(const svm_debugger_t *dbg, uint64_t addr);
+
+// Run one instruction, even if it has a breakpoint. Returns SVM_ERR_WATCHPOINT, with the index of the watchpoint in
+// *watch, if it changed a watched value.
+svm_err_t svm_debug_step(svm_debugger_t *dbg, uint64_t *watch);
+// Run until the program halts, fails, reaches a breakpoint (SVM_ERR_BREAKPOINT) or changes a watched value.
+svm_err_t svm_debug_continue(svm_debugger_t *dbg, uint64_t *watch);
+
+void svm_debug_print_instruction(const svm_debugger_t *dbg, uint64_t addr, FILE *out);
+void svm_debug_print_backtrace(const svm_debugger_t *dbg, FILE *out);
+
+// Read debugger commands from in until the user quits or in runs out. Returns the error the program stopped with, if
+// it failed.
+svm_err_t svm_debug_repl(svm_debugger_t *dbg, FILE *in, FILE *out);
+
+#endif // HDR_SVM_DEBUG_H
@@ -15,6 +15,28 @@ typedef enum {
 
   SVM_ERR_ADDR_LIST_FULL,
   SVM_ERR_ILLEGAL_ADDR,
+
+  SVM_ERR_NO_SCHEDULER,
+  SVM_ERR_ILLEGAL_FIBER,
+  SVM_ERR_DEADLOCK,
+
+  SVM_ERR_ILLEGAL_CHANNEL,
+  SVM_ERR_CHANNEL_LIST_FULL,
+
+  // Not a failure: svm_run_for used up its instruction budget and can be called again to continue.
+  SVM_ERR_OUT_OF_FUEL,
+  // Not failures either: execution stopped at a breakpoint, or a value the debugger watches changed.
+  SVM_ERR_BREAKPOINT,
+  SVM_ERR_WATCHPOINT,
+
+  // An I/O instruction ran on a VM without svm->io (see svm/io.h).
+  SVM_ERR_NO_IO,
+
+  // chan_new asked for more than SVM_MAX_CHANNEL_CAPACITY values, or there wasn't the memory for them.
+  SVM_ERR_CHANNEL_TOO_LARGE,
+
+  // Integer division or remainder by 0, or of INT64_MIN by -1.
+  SVM_ERR_ILLEGAL_DIVISION,
 } svm_err_t;
 
 const char *svm_err_to_string(svm_err_t err);
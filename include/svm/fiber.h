@@ -0,0 +1,66 @@
+#ifndef HDR_SVM_FIBER_H
+#define HDR_SVM_FIBER_H
+
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/value.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SVM_FIBER_STACK_SIZE 64
+#define SVM_FIBER_CALL_STACK_SIZE 64
+// Number of instructions a fiber may run before it is put back in the ready queue.
+#define SVM_FIBER_SLICE 4096
+#define SVM_SCHED_MAX_WORKERS 64
+
+typedef enum {
+  SVM_FIBER_READY,
+  SVM_FIBER_BLOCKED,
+  SVM_FIBER_DONE,
+} svm_fiber_state_t;
+
+typedef struct svm_fiber {
+  uint64_t id;
+  svm_fiber_state_t state;
+  // Index of the worker that last ran this fiber.
+  uint32_t worker;
+  struct svm_sched *sched;
+
+  /* Saved execution state. The root fiber points these at the stacks of the VM passed to svm_sched_run. */
+  svm_value_t *stack;
+  uint64_t stack_size;
+  uint64_t stack_ptr;
+
+  uint64_t *call_stack;
+  uint64_t call_stack_size;
+  uint64_t call_stack_ptr;
+
+  uint64_t ip;
+
+  // Top of the stack when the fiber halted, or 0 if the stack was empty.
+  svm_value_t result;
+  // Fibers blocked in a join on this fiber.
+  struct svm_fiber *waiters;
+  struct svm_fiber *next_waiter;
+
+  // Set by a send or recv that parks the fiber: the channel, its changes before the instruction tried it, and whether
+  // the host bound it, in which case threads outside the program may wake the fiber.
+  struct svm_chan *chan;
+  uint64_t chan_changes;
+  bool chan_external;
+} svm_fiber_t;
+
+typedef struct svm_sched svm_sched_t;
+
+// Run the program loaded in svm as the root fiber, spreading any fibers it spawns over num_workers threads (0 means
+// one per online CPU). All fibers share the heap of svm. The run ends when the root fiber halts, or with
+// SVM_ERR_DEADLOCK once every fiber is blocked in a join or on a channel that only the program uses.
+svm_err_t svm_sched_run(svm_t *svm, uint32_t num_workers);
+
+svm_err_t svm_sched_spawn(svm_sched_t *sched, svm_fiber_t *parent, uint64_t entry, svm_value_t arg, uint64_t *id);
+svm_err_t svm_sched_try_join(svm_sched_t *sched, uint64_t id, bool *done, svm_value_t *result);
+// Make a fiber that was parked on a channel ready again. Can be called from any thread.
+void svm_sched_wake(svm_fiber_t *fiber);
+
+#endif // HDR_SVM_FIBER_H
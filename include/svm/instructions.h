@@ -7,75 +7,240 @@
 #include <stdbool.h>
 
 typedef enum {
-  /* Misc. */
-  SVM_INST_NOP = 0,
-  SVM_INST_HALT,
+  SVM_OPERAND_NONE,
+  // An i64, or a u64 or f64 with a 'u' or 'f' suffix.
+  SVM_OPERAND_VALUE,
+  // An f64, with or without the 'f'.
+  SVM_OPERAND_F64,
+  // The address of a label.
+  SVM_OPERAND_LABEL,
+} svm_operand_kind_t;
 
-  /* Stack ops. */
-  SVM_INST_PUSH,
-  SVM_INST_POP,
-  SVM_INST_COPY,
-  SVM_INST_SWAP,
+// Stack effect of instructions whose effect depends on their operand or on the rest of the program.
+#define SVM_STACK_VARIES (-1)
 
-  /* Arithmetic. */
-  // i64.
-  SVM_INST_ADD_I,
-  SVM_INST_SUB_I,
-  SVM_INST_MULT_I,
-  SVM_INST_DIV_I,
-  // u64.
-  SVM_INST_ADD_U,
-  SVM_INST_SUB_U,
-  SVM_INST_MULT_U,
-  SVM_INST_DIV_U,
-  // f64.
-  SVM_INST_ADD_F,
-  SVM_INST_SUB_F,
-  SVM_INST_MULT_F,
-  SVM_INST_DIV_F,
+/*
+ * Every instruction type, in opcode order, as X(name, mnemonic, operand, pops, pushes):
+ *   name      SVM_INST_<name>.
+ *   mnemonic  What svmasm calls it, or NULL if it never appears in assembly.
+ *   operand   The kind of operand it has in object files, SVM_OPERAND_<operand>.
+ *   pops      The number of values it takes off the stack, or SVM_STACK_VARIES.
+ *   pushes    The number of values it leaves on the stack in their place, or SVM_STACK_VARIES.
+ *
+ * The opcodes are part of the object format, so new instructions go at the end.
+ */
+#define SVM_INSTRUCTIONS(X) \
+  /* Misc. */ \
+  X(NOP,       "nop",       NONE,  0, 0) \
+  X(HALT,      "halt",      NONE,  0, 0) \
+  \
+  /* Stack ops. */ \
+  X(PUSH,      "push",      VALUE, 0, 1) \
+  X(POP,       "pop",       NONE,  1, 0) \
+  X(COPY,      "copy",      VALUE, SVM_STACK_VARIES, SVM_STACK_VARIES) \
+  X(SWAP,      "swap",      VALUE, SVM_STACK_VARIES, SVM_STACK_VARIES) \
+  \
+  /* Arithmetic. */ \
+  /* i64. */ \
+  X(ADD_I,     "addi",      NONE,  2, 1) \
+  X(SUB_I,     "subi",      NONE,  2, 1) \
+  X(MULT_I,    "multi",     NONE,  2, 1) \
+  X(DIV_I,     "divi",      NONE,  2, 1) \
+  /* u64. */ \
+  X(ADD_U,     "addu",      NONE,  2, 1) \
+  X(SUB_U,     "subu",      NONE,  2, 1) \
+  X(MULT_U,    "multu",     NONE,  2, 1) \
+  X(DIV_U,     "divu",      NONE,  2, 1) \
+  /* f64. */ \
+  X(ADD_F,     "addf",      NONE,  2, 1) \
+  X(SUB_F,     "subf",      NONE,  2, 1) \
+  X(MULT_F,    "multf",     NONE,  2, 1) \
+  X(DIV_F,     "divf",      NONE,  2, 1) \
+  \
+  /* Comparison */ \
+  /* Don't need an eq/not eq for each type. Just interpret both values as the same type. */ \
+  X(EQ,        "eq",        NONE,  2, 1) \
+  X(NOT_EQ,    "neq",       NONE,  2, 1) \
+  /* i64. */ \
+  X(GT_I,      "gti",       NONE,  2, 1) \
+  X(GT_EQ_I,   "gtei",      NONE,  2, 1) \
+  X(LT_I,      "lti",       NONE,  2, 1) \
+  X(LT_EQ_I,   "ltei",      NONE,  2, 1) \
+  /* u64. */ \
+  X(GT_U,      "gtu",       NONE,  2, 1) \
+  X(GT_EQ_U,   "gteu",      NONE,  2, 1) \
+  X(LT_U,      "ltu",       NONE,  2, 1) \
+  X(LT_EQ_U,   "lteu",      NONE,  2, 1) \
+  /* f64. */ \
+  X(GT_F,      "gtf",       NONE,  2, 1) \
+  X(GT_EQ_F,   "gtef",      NONE,  2, 1) \
+  X(LT_F,      "ltf",       NONE,  2, 1) \
+  X(LT_EQ_F,   "ltef",      NONE,  2, 1) \
+  \
+  /* Jumps */ \
+  X(JMP,       "jmp",       LABEL, 0, 0) \
+  X(JNZ,       "jnz",       LABEL, 1, 0) \
+  \
+  /* Function stuff */ \
+  X(CALL,      "call",      LABEL, SVM_STACK_VARIES, SVM_STACK_VARIES) \
+  X(RET,       "ret",       NONE,  SVM_STACK_VARIES, SVM_STACK_VARIES) \
+  \
+  /* Heap stuff */ \
+  X(ALLOC,     "alloc",     VALUE, 0, 1) \
+  X(FREE,      "free",      NONE,  1, 0) \
+  X(READ,      "read",      NONE,  1, 1) \
+  X(WRITE,     "write",     NONE,  2, 0) \
+  \
+  /* Fibers */ \
+  X(SPAWN,     "spawn",     LABEL, 1, 1) \
+  X(YIELD,     "yield",     NONE,  0, 0) \
+  X(JOIN,      "join",      NONE,  1, 1) \
+  \
+  /* Quickened forms. These never appear in object files, the VM swaps them in for the generic instructions at run \
+   * time and swaps the generic instruction back in if the assumption they were made under no longer holds. */ \
+  /* copy 1 and swap 1. */ \
+  X(COPY_1,    NULL,        NONE,  1, 2) \
+  X(SWAP_1,    NULL,        NONE,  2, 2) \
+  /* jnz that usually is or isn't taken. */ \
+  X(JNZ_TAKEN, NULL,        NONE,  1, 0) \
+  X(JNZ_NOT_TAKEN, NULL,    NONE,  1, 0) \
+  /* read whose operand is the index in the heap address list where the address was found last time. */ \
+  X(READ_CACHED, NULL,      NONE,  1, 1) \
+  \
+  /* Immediate forms of the arithmetic and comparison instructions. The right hand side comes from the operand \
+   * instead of the stack. */ \
+  /* i64. */ \
+  X(ADD_I_IMM, NULL,        VALUE, 1, 1) \
+  X(SUB_I_IMM, NULL,        VALUE, 1, 1) \
+  X(MULT_I_IMM, NULL,       VALUE, 1, 1) \
+  X(DIV_I_IMM, NULL,        VALUE, 1, 1) \
+  /* u64. */ \
+  X(ADD_U_IMM, NULL,        VALUE, 1, 1) \
+  X(SUB_U_IMM, NULL,        VALUE, 1, 1) \
+  X(MULT_U_IMM, NULL,       VALUE, 1, 1) \
+  X(DIV_U_IMM, NULL,        VALUE, 1, 1) \
+  /* f64. */ \
+  X(ADD_F_IMM, NULL,        F64,   1, 1) \
+  X(SUB_F_IMM, NULL,        F64,   1, 1) \
+  X(MULT_F_IMM, NULL,       F64,   1, 1) \
+  X(DIV_F_IMM, NULL,        F64,   1, 1) \
+  /* Comparison. */ \
+  X(EQ_IMM,    NULL,        VALUE, 1, 1) \
+  X(NOT_EQ_IMM, NULL,       VALUE, 1, 1) \
+  X(GT_I_IMM,  NULL,        VALUE, 1, 1) \
+  X(GT_EQ_I_IMM, NULL,      VALUE, 1, 1) \
+  X(LT_I_IMM,  NULL,        VALUE, 1, 1) \
+  X(LT_EQ_I_IMM, NULL,      VALUE, 1, 1) \
+  X(GT_U_IMM,  NULL,        VALUE, 1, 1) \
+  X(GT_EQ_U_IMM, NULL,      VALUE, 1, 1) \
+  X(LT_U_IMM,  NULL,        VALUE, 1, 1) \
+  X(LT_EQ_U_IMM, NULL,      VALUE, 1, 1) \
+  X(GT_F_IMM,  NULL,        F64,   1, 1) \
+  X(GT_EQ_F_IMM, NULL,      F64,   1, 1) \
+  X(LT_F_IMM,  NULL,        F64,   1, 1) \
+  X(LT_EQ_F_IMM, NULL,      F64,   1, 1) \
+  \
+  /* Reserved for the debugger, which patches it over instructions that have a breakpoint. */ \
+  X(BREAK,     NULL,        NONE,  SVM_STACK_VARIES, SVM_STACK_VARIES) \
+  \
+  /* Parallel loops. */ \
+  X(PARFOR,    "parfor",    LABEL, 1, 0) \
+  /* Atomic heap ops. */ \
+  X(CAS,       "cas",       NONE,  3, 1) \
+  X(FETCH_ADD, "fetch_add", NONE,  2, 1) \
+  \
+  /* Channels. */ \
+  X(CHAN_NEW,  "chan_new",  VALUE, 0, 1) \
+  X(SEND,      "send",      NONE,  2, 0) \
+  X(RECV,      "recv",      NONE,  1, 1) \
+  \
+  /* Bitwise ops on u64. Shift counts are taken modulo 64. */ \
+  X(AND,       "and",       NONE,  2, 1) \
+  X(OR,        "or",        NONE,  2, 1) \
+  X(XOR,       "xor",       NONE,  2, 1) \
+  X(NOT,       "not",       NONE,  1, 1) \
+  X(SHL,       "shl",       NONE,  2, 1) \
+  X(SHR,       "shr",       NONE,  2, 1) \
+  /* Shift right keeping the sign. */ \
+  X(SAR,       "sar",       NONE,  2, 1) \
+  /* Remainder. */ \
+  X(MOD_I,     "modi",      NONE,  2, 1) \
+  X(MOD_U,     "modu",      NONE,  2, 1) \
+  /* High 64 bits of the 128 bit product. */ \
+  X(MULH_I,    "mulhi",     NONE,  2, 1) \
+  X(MULH_U,    "mulhu",     NONE,  2, 1) \
+  /* Immediate forms. */ \
+  X(AND_IMM,   NULL,        VALUE, 1, 1) \
+  X(OR_IMM,    NULL,        VALUE, 1, 1) \
+  X(XOR_IMM,   NULL,        VALUE, 1, 1) \
+  X(SHL_IMM,   NULL,        VALUE, 1, 1) \
+  X(SHR_IMM,   NULL,        VALUE, 1, 1) \
+  X(SAR_IMM,   NULL,        VALUE, 1, 1) \
+  X(MOD_I_IMM, NULL,        VALUE, 1, 1) \
+  X(MOD_U_IMM, NULL,        VALUE, 1, 1) \
+  X(MULH_I_IMM, NULL,       VALUE, 1, 1) \
+  X(MULH_U_IMM, NULL,       VALUE, 1, 1) \
+  \
+  /* Jump tables. jtab n is followed by n + 1 entries: the default target, then the target for each index. */ \
+  X(JTAB,      "jtab",      VALUE, 1, 0) \
+  /* Never executed, only read by the jtab in front of it. */ \
+  X(JTAB_ENTRY, NULL,       LABEL, 0, 0) \
+  \
+  /* Memoization. memo n, the first instruction of a function, caches its results keyed by its n arguments. */ \
+  X(MEMO,      "memo",      VALUE, SVM_STACK_VARIES, SVM_STACK_VARIES) \
+  \
+  /* Vectors of SVM_VEC_LANES values in consecutive stack slots, lane 0 deepest (see svm/vec.h). */ \
+  X(VLOAD,     "vload",     NONE,  2, 4) \
+  X(VSTORE,    "vstore",    NONE,  6, 0) \
+  X(VSPLAT,    "vsplat",    NONE,  1, 4) \
+  X(VADD_F,    "vaddf",     NONE,  8, 4) \
+  X(VMUL_F,    "vmulf",     NONE,  8, 4) \
+  X(VFMA,      "vfma",      NONE, 12, 4) \
+  X(VADD_I,    "vaddi",     NONE,  8, 4) \
+  X(VREDUCE_F, "vreduce",   NONE,  4, 1) \
+  X(VREDUCE_I, "vreducei",  NONE,  4, 1) \
+  \
+  /* Like alloc, but the block comes from the frame storage of the VM and is released when the function returns. */ \
+  X(FALLOC,    "falloc",    VALUE, 0, 1) \
+  \
+  /* I/O on files through heap buffers (see svm/io.h). */ \
+  X(IO_OPEN,   "io_open",   VALUE, 1, 1) \
+  X(IO_CLOSE,  "io_close",  NONE,  1, 1) \
+  X(IO_READ,   "io_read",   NONE,  3, 1) \
+  X(IO_WRITE,  "io_write",  NONE,  3, 1) \
+  X(IO_FLUSH,  "io_flush",  NONE,  1, 1) \
+  X(IO_SUBMIT, "io_submit", VALUE, 3, 1) \
+  X(IO_WAIT,   "io_wait",   NONE,  1, 1)
 
-  /* Comparison */
-  // Don't need an eq/not eq for each type. Just interpret both values as the same type.
-  SVM_INST_EQ,
-  SVM_INST_NOT_EQ,
-  // i64.
-  SVM_INST_GT_I,
-  SVM_INST_GT_EQ_I,
-  SVM_INST_LT_I,
-  SVM_INST_LT_EQ_I,
-  // u64.
-  SVM_INST_GT_U,
-  SVM_INST_GT_EQ_U,
-  SVM_INST_LT_U,
-  SVM_INST_LT_EQ_U,
-  // f64.
-  SVM_INST_GT_F,
-  SVM_INST_GT_EQ_F,
-  SVM_INST_LT_F,
-  SVM_INST_LT_EQ_F,
-
-  /* Jumps */
-  SVM_INST_JMP,
-  SVM_INST_JNZ,
-
-  /* Function stuff */
-  SVM_INST_CALL,
-  SVM_INST_RET,
-
-  /* Heap stuff */
-  SVM_INST_ALLOC,
-  SVM_INST_FREE,
-  SVM_INST_READ,
-  SVM_INST_WRITE,
+#define SVM_INST_ENUM_ENTRY(name, mnemonic, operand, pops, pushes) SVM_INST_##name,
+typedef enum {
+  SVM_INSTRUCTIONS(SVM_INST_ENUM_ENTRY)
 } svm_instruction_type_t;
+#undef SVM_INST_ENUM_ENTRY
+
+// One past the last instruction type.
+#define SVM_INST_COUNT_ENTRY(name, mnemonic, operand, pops, pushes) + 1
+#define SVM_INST_TYPE_COUNT (0 SVM_INSTRUCTIONS(SVM_INST_COUNT_ENTRY))
 
 const char *svm_instruction_type_to_string(svm_instruction_type_t inst_type);
+// What svmasm calls inst_type, or NULL if it never appears in assembly.
+const char *svm_instruction_type_mnemonic(svm_instruction_type_t inst_type);
 
+svm_operand_kind_t svm_instruction_type_operand(svm_instruction_type_t inst_type);
 bool svm_instruction_type_needs_operand(svm_instruction_type_t inst_type);
 bool svm_instruction_type_needs_label_operand(svm_instruction_type_t inst_type);
 
+// The number of values inst_type takes off the stack and leaves in their place. Returns false if that depends on its
+// operand or on the rest of the program.
+bool svm_instruction_type_stack_effect(svm_instruction_type_t inst_type, uint64_t *pops, uint64_t *pushes);
+
+// Look up the instruction svmasm calls str. Immediate and quickened forms have no names of their own.
 bool svm_instruction_type_from_string(const char *str, svm_instruction_type_t *inst_type);
 
+// Map an arithmetic or comparison instruction to the version that takes its right hand side as an operand, and back.
+bool svm_instruction_type_to_immediate(svm_instruction_type_t inst_type, svm_instruction_type_t *imm_type);
+bool svm_instruction_type_from_immediate(svm_instruction_type_t imm_type, svm_instruction_type_t *inst_type);
+
 typedef struct {
   svm_instruction_type_t type;
   svm_value_t operand;
@@ -0,0 +1,115 @@
+#ifndef HDR_SVM_IO_H
+#define HDR_SVM_IO_H
+
+#include "svm/svm.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Files for the I/O instructions of a VM, which only work while svm->io is set. Programs refer to files by handle:
+ * 0, 1 and 2 are stdin, stdout and stderr, and io_open hands out the others. Every instruction pushes a result
+ * instead of failing, which is what the system call returned, with -errno for errors, so the program can decide what
+ * to do about them.
+ *
+ * io_write copies the data into a buffer of SVM_IO_BUFFER_SIZE bytes per file, which only goes to the file when it
+ * is full, on io_flush or io_close, and when the I/O is freed, so writing a value at a time costs no system calls.
+ * io_read reads straight into the heap.
+ *
+ * io_submit starts a read or write into a heap buffer and returns right away with a request id, and io_wait waits for
+ * the request and pushes its result, so the program can compute while the kernel works. The requests go through
+ * io_uring where the kernel has it (5.6 and up), and are done on the spot by io_submit otherwise, so io_wait only
+ * picks up the result. Requests in flight at once on the same file may be done in any order, and their buffers must
+ * stay allocated until io_wait: free waits for every request in flight, as it can't tell which buffers are in the
+ * block.
+ *
+ * The I/O isn't thread safe. Fibers share the I/O of the VM that runs them, and each I/O instruction holds the heap
+ * lock while it uses it, which also serializes it with free. parfor calls run on VMs of their own, where the I/O
+ * instructions fail with SVM_ERR_NO_IO.
+ */
+
+#define SVM_IO_MAX_FILES 64
+#define SVM_IO_MAX_REQUESTS 64
+#define SVM_IO_BUFFER_SIZE 65536
+
+// The operand of io_open.
+typedef enum {
+  SVM_IO_OPEN_READ,
+  // Create the file, or truncate it if it exists.
+  SVM_IO_OPEN_WRITE,
+  // Create the file, or write at its end if it exists.
+  SVM_IO_OPEN_APPEND,
+} svm_io_open_mode_t;
+
+// The operand of io_submit.
+typedef enum {
+  SVM_IO_OP_READ,
+  SVM_IO_OP_WRITE,
+} svm_io_op_t;
+
+typedef struct {
+  // -1 if the handle isn't open.
+  int fd;
+  // Allocated on the first io_write.
+  uint8_t *buffer;
+  uint64_t buffered;
+} svm_io_file_t;
+
+typedef struct {
+  bool used;
+  bool done;
+  svm_io_op_t op;
+  int64_t result;
+} svm_io_request_t;
+
+typedef struct svm_io {
+  svm_io_file_t files[SVM_IO_MAX_FILES];
+  svm_io_request_t requests[SVM_IO_MAX_REQUESTS];
+  uint64_t in_flight;
+
+  // The io_uring, or -1 if requests are done by io_submit.
+  int ring_fd;
+  void *ring;
+  uint64_t ring_size;
+  void *sqes;
+  uint64_t sqes_size;
+  // Requests put in the submission queue that the kernel hasn't taken yet.
+  uint32_t unsubmitted;
+  uint32_t *sq_tail;
+  uint32_t *sq_mask;
+  uint32_t *sq_array;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t *cq_mask;
+  void *cqes;
+
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t syscalls;
+} svm_io_t;
+
+// Set up the I/O of svm, with stdin, stdout and stderr open. If uring is false, or the kernel has no io_uring, the
+// requests are done by io_submit.
+void svm_io_init(svm_io_t *io, svm_t *svm, bool uring);
+// Wait for the requests in flight, flush the buffers and close the files the program opened. The counts can still be
+// read and printed afterwards.
+void svm_io_free(svm_io_t *io);
+bool svm_io_uses_uring(const svm_io_t *io);
+void svm_io_print(const svm_io_t *io, FILE *out);
+
+// What the I/O instructions push. Only the first max_path bytes of path are read, and it must be NUL terminated
+// within them and within PATH_MAX bytes.
+int64_t svm_io_open(svm_io_t *io, const char *path, uint64_t max_path, uint64_t mode);
+int64_t svm_io_close(svm_io_t *io, uint64_t handle);
+int64_t svm_io_read(svm_io_t *io, uint64_t handle, void *buf, uint64_t size);
+int64_t svm_io_write(svm_io_t *io, uint64_t handle, const void *buf, uint64_t size);
+int64_t svm_io_flush(svm_io_t *io, uint64_t handle);
+int64_t svm_io_submit(svm_io_t *io, uint64_t op, uint64_t handle, void *buf, uint64_t size);
+int64_t svm_io_wait(svm_io_t *io, uint64_t id);
+// Wait for every request in flight.
+void svm_io_drain(svm_io_t *io);
+// Wait for every request in flight and forget the requests that weren't waited for, to run the program again.
+void svm_io_reset(svm_io_t *io);
+
+#endif // HDR_SVM_IO_H
@@ -0,0 +1,74 @@
+#ifndef HDR_SVM_MEMO_H
+#define HDR_SVM_MEMO_H
+
+#include "svm/svm.h"
+#include "svm/value.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Cache of the results of pure functions. A function opts in with memo n as its first instruction, n being the number
+ * of stack slots it takes as arguments. When a call reaches the memo instruction with arguments that are in the
+ * cache, the arguments are replaced with the cached results and the function returns right away. Otherwise the
+ * function runs, and whatever it leaves in place of its arguments when it returns is cached.
+ *
+ * The cache is split into sets of SVM_MEMO_WAYS entries, picked by a hash of the function and its arguments, and a
+ * full set evicts with the clock algorithm: every hit marks its entry, and the hand of the set skips (and unmarks)
+ * marked entries when it looks for one to replace.
+ *
+ * A cache belongs to a single VM at a time. Fibers and parfor calls run on VMs of their own, where memo does nothing.
+ */
+
+#define SVM_MEMO_WAYS 4
+#define SVM_MEMO_MAX_ARGS 4
+#define SVM_MEMO_MAX_RESULTS 4
+
+typedef struct {
+  bool used;
+  // Hit since the clock hand last passed.
+  bool referenced;
+  uint8_t num_args;
+  uint8_t num_results;
+  uint64_t entry;
+  svm_value_t args[SVM_MEMO_MAX_ARGS];
+  svm_value_t results[SVM_MEMO_MAX_RESULTS];
+} svm_memo_entry_t;
+
+// A call that missed and whose results are stored when it returns.
+typedef struct {
+  // call_stack_ptr inside the call.
+  uint64_t depth;
+  // stack_ptr below the arguments.
+  uint64_t base;
+  uint64_t entry;
+  uint8_t num_args;
+  svm_value_t args[SVM_MEMO_MAX_ARGS];
+} svm_memo_call_t;
+
+typedef struct svm_memo {
+  svm_memo_entry_t *entries;
+  uint64_t num_sets;
+  uint8_t *hands;
+
+  svm_memo_call_t *pending;
+  uint64_t num_pending;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} svm_memo_t;
+
+// Create a cache with room for at least capacity results.
+bool svm_memo_init(svm_memo_t *memo, uint64_t capacity);
+void svm_memo_free(svm_memo_t *memo);
+void svm_memo_print(const svm_memo_t *memo, FILE *out);
+
+// Run by the memo instruction at entry in a function taking num_args slots. Returns true if the results were in the
+// cache, in which case they have been put on the stack and the function has returned.
+bool svm_memo_enter(svm_memo_t *memo, svm_t *svm, uint64_t entry, uint64_t num_args);
+// Run by ret before it returns, to store the results of a call that missed.
+void svm_memo_leave(svm_memo_t *memo, svm_t *svm);
+
+#endif // HDR_SVM_MEMO_H
@@ -0,0 +1,24 @@
+#ifndef HDR_SVM_OBJECT_H
+#define HDR_SVM_OBJECT_H
+
+#include "svm/instructions.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Takes the place of an instruction type to mark the start of the symbol section (see svm/symbols.h), which ends the
+// program. "svmsyms" in ASCII.
+#define SVM_OBJECT_SYMBOLS_MAGIC 0x736d79736d7673ull
+
+// Read at most max_size instructions from an svm object file into program.
+bool svm_object_read(const char *file_name, svm_instruction_t *program, uint64_t max_size, uint64_t *size);
+// Decode an svm object held in memory. Fails if the data ends in the middle of an instruction or holds more than
+// max_size instructions.
+bool svm_object_decode(const uint8_t *data, uint64_t length, svm_instruction_t *program, uint64_t max_size,
+                       uint64_t *size);
+// Check that every instruction is one an object file may contain, that jump table entries only follow their jtab,
+// and that every label operand points into the program.
+bool svm_object_verify(const svm_instruction_t *program, uint64_t size);
+bool svm_object_write(const char *file_name, const svm_instruction_t *program, uint64_t size);
+
+#endif // HDR_SVM_OBJECT_H
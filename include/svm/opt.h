@@ -0,0 +1,26 @@
+#ifndef HDR_SVM_OPT_H
+#define HDR_SVM_OPT_H
+
+#include "svm/instructions.h"
+
+#include <stdint.h>
+
+// Each pass rewrites program in place and returns the new program size.
+
+// Fold arithmetic and comparisons on pushed constants, turn a push followed by arithmetic or a comparison into its
+// immediate form, turn jnz and jtab on a constant into a jmp (or drop the jnz) and remove jumps to the next instruction.
+uint64_t svm_opt_fold_constants(svm_instruction_t *program, uint64_t size);
+// Remove blocks that can't be reached from the first instruction, including functions that are never called.
+uint64_t svm_opt_remove_unreachable(svm_instruction_t *program, uint64_t size);
+// Replace calls to non-recursive functions of at most budget instructions with a copy of the function, as long as the
+// program stays within max_size instructions. Each ret in the copy becomes a jmp to the instruction after the call.
+uint64_t svm_opt_inline(svm_instruction_t *program, uint64_t size, uint64_t max_size, uint64_t budget);
+// Replace multiplication by powers of two with shifts, unsigned remainder by powers of two with masks and unsigned
+// division by constants with shifts or a multiplication by the inverse that keeps the high half, as long as the
+// program stays within max_size instructions.
+uint64_t svm_opt_strength_reduce(svm_instruction_t *program, uint64_t size, uint64_t max_size);
+// Turn allocs in functions into fallocs where the block can't be used once the function returns: its address isn't
+// returned, written to memory, passed to a call or handed to another fiber.
+uint64_t svm_opt_frame_allocs(svm_instruction_t *program, uint64_t size);
+
+#endif // HDR_SVM_OPT_H
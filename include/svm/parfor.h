@@ -0,0 +1,19 @@
+#ifndef HDR_SVM_PARFOR_H
+#define HDR_SVM_PARFOR_H
+
+#include "svm/svm.h"
+#include "svm/err.h"
+
+#include <stdint.h>
+
+// Threads in the pool, not counting the thread that runs parfor, which takes part as well.
+#define SVM_PARFOR_MAX_THREADS 63
+
+// Call the function at entry once for every index in [0, n), with the index as its only stack entry, and return when
+// all calls have returned (or halted). The calls are spread over a process wide pool of threads, each running them on
+// a VM of its own that shares the heap of svm. Uses at most svm->sched_workers threads if that is set. If the pool is
+// already busy, for example because parfor is used inside a parfor, the calls run one after the other on the calling
+// thread instead. Returns the first error any call failed with.
+svm_err_t svm_parfor_run(svm_t *svm, uint64_t entry, uint64_t n);
+
+#endif // HDR_SVM_PARFOR_H
@@ -0,0 +1,65 @@
+#ifndef HDR_SVM_PERF_H
+#define HDR_SVM_PERF_H
+
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/cfg.h"
+#include "svm/instructions.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Hardware performance counters, read with perf_event_open after every instruction. The difference between two reads
+ * is charged to the opcode that ran in between and to the basic block it belongs to, minus the cost of a read on its
+ * own. Counters the CPU (or the hypervisor) doesn't have are left out.
+ */
+
+typedef enum {
+  SVM_PERF_CYCLES,
+  SVM_PERF_INSTRUCTIONS,
+  SVM_PERF_BRANCH_MISSES,
+  SVM_PERF_L1D_MISSES,
+  SVM_PERF_LLC_MISSES,
+  // Software counter in nanoseconds, so there is something to look at without a PMU.
+  SVM_PERF_TASK_CLOCK,
+} svm_perf_counter_t;
+
+#define SVM_PERF_NUM_COUNTERS (SVM_PERF_TASK_CLOCK + 1)
+
+typedef struct {
+  uint64_t executed;
+  uint64_t counts[SVM_PERF_NUM_COUNTERS];
+} svm_perf_entry_t;
+
+typedef struct {
+  // File descriptor of each counter, or -1 if it couldn't be opened. The first open counter leads the group.
+  int fds[SVM_PERF_NUM_COUNTERS];
+  // Position of each counter in a group read.
+  uint64_t slots[SVM_PERF_NUM_COUNTERS];
+  uint64_t num_open;
+  // Smallest difference between two reads with nothing in between.
+  uint64_t overhead[SVM_PERF_NUM_COUNTERS];
+  // Time the group was enabled and actually counting. The counts are meaningless if it never ran.
+  uint64_t time_enabled;
+  uint64_t time_running;
+
+  svm_perf_entry_t total;
+  svm_perf_entry_t by_opcode[SVM_INST_TYPE_COUNT];
+  svm_cfg_t cfg;
+  svm_perf_entry_t *by_block;
+} svm_perf_t;
+
+const char *svm_perf_counter_to_string(svm_perf_counter_t counter);
+
+// Open the counters for the calling thread. Returns false, with errno set, if none of them could be opened.
+bool svm_perf_open(svm_perf_t *perf);
+void svm_perf_close(svm_perf_t *perf);
+
+// Run the program loaded in svm on the interpreter until it halts, reading the counters around every instruction.
+// Programs that spawn fibers aren't supported.
+svm_err_t svm_perf_run(svm_t *svm, svm_perf_t *perf);
+void svm_perf_print(const svm_perf_t *perf, FILE *out);
+
+#endif // HDR_SVM_PERF_H
@@ -0,0 +1,52 @@
+#ifndef HDR_SVM_PROFILE_H
+#define HDR_SVM_PROFILE_H
+
+#include "svm/svm.h"
+#include "svm/label_list.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Sampling profiler. A SIGPROF timer interrupts the thread running the VM and the signal handler records ip and the
+ * call stack into a table of distinct stacks that was allocated up front, so nothing runs between samples and the
+ * handler doesn't allocate. Only one profile can be running at a time.
+ *
+ * The handler reads the VM that was passed to svm_profile_start, so it must run on the calling thread: the parfor
+ * pool and the fiber scheduler block SIGPROF in their threads. Fibers run on VMs of their own, so programs that spawn
+ * them can't be profiled.
+ */
+
+// Calls deeper than this are cut off at the root end of the stack.
+#define SVM_PROFILE_MAX_DEPTH 64
+// Distinct stacks that can be told apart. Samples of any further stacks are counted as dropped.
+#define SVM_PROFILE_MAX_STACKS 4096
+
+typedef struct {
+  uint64_t count;
+  uint64_t ip;
+  // Return addresses from call_stack, the outermost first.
+  uint64_t depth;
+  uint64_t frames[SVM_PROFILE_MAX_DEPTH];
+  bool truncated;
+} svm_profile_stack_t;
+
+typedef struct {
+  svm_profile_stack_t *stacks;
+  uint64_t num_stacks;
+  uint64_t samples;
+  uint64_t dropped;
+} svm_profile_t;
+
+// Start sampling svm hz times per second of CPU time used by the process.
+bool svm_profile_start(svm_profile_t *profile, svm_t *svm, uint32_t hz);
+void svm_profile_stop(svm_profile_t *profile);
+void svm_profile_free(svm_profile_t *profile);
+
+// Write one line per distinct stack, as the frames separated by ';' followed by the number of samples. Each call is a
+// frame named after the label at the address it called, or the address if labels is NULL or has no label there, and
+// the innermost frame is the instruction at ip.
+bool svm_profile_write_folded(const svm_profile_t *profile, const svm_t *svm, svm_label_list_t *labels,
+                              const char *file_name);
+
+#endif // HDR_SVM_PROFILE_H
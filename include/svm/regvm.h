@@ -0,0 +1,126 @@
+#ifndef HDR_SVM_REGVM_H
+#define HDR_SVM_REGVM_H
+
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/value.h"
+#include "svm/instructions.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The register engine translates each basic block of the program into three address code before running it. Stack
+ * slots become virtual registers, so push, pop, copy and swap don't need to execute at all: they only change which
+ * register the following instructions read. Results are computed into temporaries and written back to the stack in
+ * one go at the end of the block.
+ */
+
+typedef enum {
+  SVM_REG_ADD_I,
+  SVM_REG_SUB_I,
+  SVM_REG_MULT_I,
+  SVM_REG_DIV_I,
+  SVM_REG_ADD_U,
+  SVM_REG_SUB_U,
+  SVM_REG_MULT_U,
+  SVM_REG_DIV_U,
+  SVM_REG_ADD_F,
+  SVM_REG_SUB_F,
+  SVM_REG_MULT_F,
+  SVM_REG_DIV_F,
+
+  SVM_REG_EQ,
+  SVM_REG_NOT_EQ,
+  SVM_REG_GT_I,
+  SVM_REG_GT_EQ_I,
+  SVM_REG_LT_I,
+  SVM_REG_LT_EQ_I,
+  SVM_REG_GT_U,
+  SVM_REG_GT_EQ_U,
+  SVM_REG_LT_U,
+  SVM_REG_LT_EQ_U,
+  SVM_REG_GT_F,
+  SVM_REG_GT_EQ_F,
+  SVM_REG_LT_F,
+  SVM_REG_LT_EQ_F,
+
+  SVM_REG_AND,
+  SVM_REG_OR,
+  SVM_REG_XOR,
+  SVM_REG_SHL,
+  SVM_REG_SHR,
+  SVM_REG_SAR,
+  SVM_REG_MOD_I,
+  SVM_REG_MOD_U,
+  SVM_REG_MULH_I,
+  SVM_REG_MULH_U,
+} svm_reg_opcode_t;
+
+typedef enum {
+  // Stack slot relative to the stack pointer on entry to the block.
+  SVM_REG_OPERAND_SLOT,
+  SVM_REG_OPERAND_CONST,
+  SVM_REG_OPERAND_TEMP,
+} svm_reg_operand_kind_t;
+
+typedef struct {
+  svm_reg_operand_kind_t kind;
+  union {
+    int64_t slot;
+    uint64_t temp;
+    svm_value_t value;
+  };
+} svm_reg_operand_t;
+
+// temps[dst] = a op b
+typedef struct {
+  svm_reg_opcode_t op;
+  uint64_t dst;
+  svm_reg_operand_t a;
+  svm_reg_operand_t b;
+} svm_reg_op_t;
+
+// stack[base + dst] = src
+typedef struct {
+  int64_t dst;
+  svm_reg_operand_t src;
+} svm_reg_move_t;
+
+typedef struct {
+  // Instructions [start, end) of the program. The last one may be a tail instruction that isn't translated.
+  uint64_t start;
+  uint64_t end;
+
+  svm_reg_op_t *ops;
+  uint64_t num_ops;
+  svm_reg_move_t *moves;
+  uint64_t num_moves;
+
+  // Stack entries the block needs on entry, how far above the entry stack pointer it goes and where it ends.
+  uint64_t need;
+  int64_t max_height;
+  int64_t height;
+
+  bool has_tail;
+  svm_instruction_t tail;
+  // Condition of a jnz tail.
+  svm_reg_operand_t cond;
+} svm_reg_block_t;
+
+typedef struct {
+  svm_reg_block_t *blocks;
+  uint64_t num_blocks;
+  // Index of the block starting at each address, or num_blocks if no block starts there.
+  uint64_t *block_at;
+  uint64_t max_temps;
+} svm_regvm_t;
+
+void svm_regvm_translate(svm_regvm_t *regvm, const svm_instruction_t *program, uint64_t size);
+void svm_regvm_free(svm_regvm_t *regvm);
+
+// Translate the program loaded in svm and run it until it halts. Has the same effect on svm as running it with
+// svm_exec_instruction.
+svm_err_t svm_regvm_run(svm_t *svm);
+
+#endif // HDR_SVM_REGVM_H
@@ -0,0 +1,98 @@
+#ifndef HDR_SVM_STATS_H
+#define HDR_SVM_STATS_H
+
+#include "svm/svm.h"
+#include "svm/symbols.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Memory statistics of a VM, collected while svm->stats is set: how high the stack, the call stack, the list of heap
+ * addresses and the frame storage got, and for every alloc instruction (its site) how much it allocated, how long the
+ * blocks lived in executed instructions and how many bytes from it were live at most at once. Read the fields of
+ * svm_stats_t at any time, or print them with svm_stats_print.
+ *
+ * The marks are taken before every instruction the interpreter runs, so with the reg engine the stack inside a block
+ * isn't seen. Fibers and parfor calls run on VMs of their own, so their instructions and stacks aren't counted, but
+ * their allocs and frees are, by the statistics of the VM whose heap they use.
+ */
+
+// Bucket b of the size histogram counts the blocks of at most 2^b bytes that didn't fit in bucket b - 1.
+#define SVM_STATS_SIZE_BUCKETS 32
+// Twice the most blocks that can be live at once, so the table of live blocks never gets full.
+#define SVM_STATS_BLOCKS_SIZE (2 * SVM_HEAP_ADDRS_SIZE)
+
+typedef struct {
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes;
+  uint64_t live_bytes;
+  uint64_t peak_live_bytes;
+  // Instructions executed between the alloc and the free of the freed blocks, summed.
+  uint64_t lifetime;
+  uint64_t max_lifetime;
+} svm_stats_site_t;
+
+typedef struct {
+  // NULL for an empty slot.
+  void *addr;
+  uint64_t site;
+  uint64_t size;
+  // Value of instructions at the alloc.
+  uint64_t born;
+} svm_stats_block_t;
+
+typedef struct svm_stats {
+  uint64_t instructions;
+
+  // High-water marks.
+  uint64_t max_stack;
+  uint64_t max_call_stack;
+  uint64_t max_heap_addrs;
+  uint64_t max_frame_storage;
+
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes;
+  uint64_t live_bytes;
+  uint64_t peak_live_bytes;
+  uint64_t size_histogram[SVM_STATS_SIZE_BUCKETS];
+
+  // Indexed by the address of the alloc instruction.
+  svm_stats_site_t *sites;
+  uint64_t program_size;
+
+  // Live blocks, by address.
+  svm_stats_block_t blocks[SVM_STATS_BLOCKS_SIZE];
+} svm_stats_t;
+
+// Start collecting statistics for svm, which has its program loaded.
+bool svm_stats_init(svm_stats_t *stats, svm_t *svm);
+void svm_stats_free(svm_stats_t *stats);
+
+// Update the high-water marks with the current state of svm. Run before every instruction, and once more when the
+// program is done so the state it ended in counts as well.
+static inline void svm_stats_sample(svm_stats_t *stats, const svm_t *svm)
+{
+  if (svm->stack_ptr > stats->max_stack) {
+    stats->max_stack = svm->stack_ptr;
+  }
+  if (svm->call_stack_ptr > stats->max_call_stack) {
+    stats->max_call_stack = svm->call_stack_ptr;
+  }
+  if (svm->frame_top > stats->max_frame_storage) {
+    stats->max_frame_storage = svm->frame_top;
+  }
+}
+
+// Run by alloc (and falloc when it uses the heap) at site, with the number of addresses now on the heap.
+void svm_stats_alloc(svm_stats_t *stats, uint64_t site, void *addr, uint64_t size, uint64_t heap_addrs);
+// Run when a block on the heap is freed, by free or by svm_reset.
+void svm_stats_release(svm_stats_t *stats, void *addr);
+
+// Print the high-water marks, the size histogram and the sites, most bytes first. symbols may be NULL.
+void svm_stats_print(const svm_stats_t *stats, const svm_symbols_t *symbols, FILE *out);
+
+#endif // HDR_SVM_STATS_H
@@ -0,0 +1,39 @@
+#ifndef HDR_SVM_STREAM_H
+#define HDR_SVM_STREAM_H
+
+#include "svm/svm.h"
+#include "svm/err.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Run a loaded program once for every record in a stream. A record is the initial stack of a run, and the VM is only
+ * reset with svm_reset between records, so the decoded program, what quickening has learned about it and the memo
+ * cache carry over from one record to the next.
+ *
+ * In CSV, every input line is a record of comma separated values, bottom of the stack first, written as integers or
+ * as floats with a '.'. Every output line is the svm_err_t of the run (0 for success) followed by the final stack,
+ * bottom first, as i64. Values aren't tagged, so a float on the final stack comes back as the i64 with the same bits.
+ *
+ * In binary, an input record is a u64 count followed by that many values, and an output record is the svm_err_t, the
+ * count and the values, all as native endian 64 bit words, like the svmd protocol.
+ */
+
+typedef enum {
+  SVM_STREAM_CSV,
+  SVM_STREAM_BINARY,
+} svm_stream_format_t;
+
+typedef struct {
+  uint64_t records;
+  // Records whose run returned an error, or that had more values than fit on the stack.
+  uint64_t failed;
+} svm_stream_stats_t;
+
+// Run svm on every record of in and write the results to out. Returns false if in is malformed or out can't be
+// written, after writing the results of the records before that.
+bool svm_stream_run(svm_t *svm, FILE *in, FILE *out, svm_stream_format_t format, svm_stream_stats_t *stats);
+
+#endif // HDR_SVM_STREAM_H
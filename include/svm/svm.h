@@ -7,39 +7,137 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #define SVM_STACK_SIZE 1024
 #define SVM_MAX_PROGRAM_SIZE 1024
 #define SVM_CALL_STACK_SIZE 1024
 #define SVM_HEAP_ADDRS_SIZE 1024
+#define SVM_MAX_CHANNELS 64
+// Most values a channel made by chan_new can hold.
+#define SVM_MAX_CHANNEL_CAPACITY (1 << 20)
+#define SVM_FRAME_STORAGE_SIZE 16384
+// Number of times more a jnz has to go one way than the other before it is quickened.
+#define SVM_QUICKEN_THRESHOLD 16
 
-typedef struct {
+typedef enum {
+  // Interpret the program one instruction at a time.
+  SVM_ENGINE_STACK,
+  // Translate the program into register based code first (see svm/regvm.h).
+  SVM_ENGINE_REG,
+} svm_engine_t;
+
+struct svm_sched;
+struct svm_fiber;
+struct svm_chan;
+struct svm_memo;
+struct svm_trace;
+struct svm_stats;
+struct svm_io;
+
+typedef struct svm {
   /* Misc stuff */
   bool halted;
+  svm_engine_t engine;
 
   /* Stack */
   svm_value_t stack[SVM_STACK_SIZE];
   uint64_t stack_ptr;
+  // Number of slots of stack in use. Less than SVM_STACK_SIZE while the VM runs a fiber, which has a smaller stack.
+  uint64_t stack_limit;
 
   /* Program */
-  svm_instruction_t program[SVM_MAX_PROGRAM_SIZE];
+  // The program is stored as a struct of arrays to keep it dense in the cache: one opcode byte per instruction, and
+  // the operands of only the instructions that have one packed together in operands. Use svm_program_get to read an
+  // instruction as a whole.
+  uint8_t opcodes[SVM_MAX_PROGRAM_SIZE];
+  // Index into operands of the operand of each instruction. Unused for instructions without an operand.
+  uint16_t operand_index[SVM_MAX_PROGRAM_SIZE];
+  svm_value_t operands[SVM_MAX_PROGRAM_SIZE];
+  uint64_t num_operands;
   uint64_t program_size;
   uint64_t ip;
+  // Rewrite instructions into specialized forms based on how they behave at run time.
+  bool quicken;
+  int8_t branch_bias[SVM_MAX_PROGRAM_SIZE];
 
   /* Call stack */
   uint64_t call_stack[SVM_CALL_STACK_SIZE];
   uint64_t call_stack_ptr;
+  // Like stack_limit.
+  uint64_t call_stack_limit;
+
+  /* Frame storage */
+  // Blocks handed out by falloc, each after a u64 with its size. They are released when the call that allocated them
+  // returns, or by free if they are the last block. Not cleared by svm_init, falloc clears the blocks it hands out.
+  _Alignas(16) uint8_t frame_storage[SVM_FRAME_STORAGE_SIZE];
+  uint64_t frame_top;
+  // frame_top at each call on the call stack.
+  uint64_t frame_marks[SVM_CALL_STACK_SIZE];
 
   /* Heap storage */
   void* heap_addrs[SVM_HEAP_ADDRS_SIZE];
+  // Size of the block at the same index in heap_addrs, for the instructions that take a buffer.
+  uint64_t heap_sizes[SVM_HEAP_ADDRS_SIZE];
   uint64_t heap_addrs_ptr;
+  // If set, heap instructions operate on the heap of this VM instead, while holding heap_lock.
+  struct svm *heap_vm;
+  pthread_mutex_t *heap_lock;
+
+  /* Fibers */
+  // Number of worker threads to run fibers on. 0 means one per online CPU.
+  uint32_t sched_workers;
+  // Only set while this VM is used by the scheduler to run a fiber.
+  struct svm_sched *sched;
+  struct svm_fiber *fiber;
+  bool yielded;
+  bool parked;
+
+  /* Channels */
+  // Indexed by the channel operands of send and recv. VMs that share a heap use the table of heap_vm.
+  struct svm_chan *channels[SVM_MAX_CHANNELS];
+  // Bit i is set if channels[i] was made by chan_new, so that svm_reset releases it.
+  uint64_t made_channels;
+
+  /* Memoization */
+  // Cache used by memo instructions (see svm/memo.h). Memo does nothing if this is NULL.
+  struct svm_memo *memo;
+
+  /* Tracing */
+  // Timestamps every call and return (see svm/trace.h). Nothing is traced if this is NULL.
+  struct svm_trace *trace;
+  // Collects memory statistics (see svm/stats.h). Nothing is collected if this is NULL.
+  struct svm_stats *stats;
+
+  /* I/O */
+  // Files of the I/O instructions (see svm/io.h). They fail with SVM_ERR_NO_IO if this is NULL.
+  struct svm_io *io;
 } svm_t;
 
 void svm_init(svm_t *svm);
+// Get svm ready to run its program again from the start, with an empty stack. Unlike svm_init this keeps the loaded
+// program (and what quickening has learned about it), the settings, the channels the host bound and the memo cache,
+// frees what the last run left allocated (including the channels it made), and only resets the pointers into the
+// stacks, so it costs next to nothing.
+void svm_reset(svm_t *svm);
 bool svm_load_program_from_array(svm_t *svm, svm_instruction_t *instructions, uint32_t program_size);
+bool svm_load_program_from_file(svm_t *svm, const char *file_name);
+// Load the program of src, as it is now (including quickened instructions).
+void svm_load_program_from_vm(svm_t *svm, const svm_t *src);
+svm_instruction_t svm_program_get(const svm_t *svm, uint64_t addr);
+// Write the program out as an array of program_size instructions.
+void svm_program_unpack(const svm_t *svm, svm_instruction_t *program);
 
 svm_err_t svm_exec_instruction(svm_t *svm);
 svm_err_t svm_run(svm_t *svm);
+// Like svm_run, without the warning about the addresses the program left allocated, for callers that free them with
+// svm_reset.
+svm_err_t svm_run_quiet(svm_t *svm);
+// Execute at most max_instructions instructions. Returns SVM_ERR_OUT_OF_FUEL if the program is still running, in
+// which case calling svm_run_for again picks up where it left off. Programs that spawn fibers need svm_run.
+svm_err_t svm_run_for(svm_t *svm, uint64_t max_instructions);
+// Whether the program has a spawn, which makes svm_run run it on the scheduler (see svm/fiber.h).
+bool svm_spawns_fibers(const svm_t *svm);
 
 void svm_print_stack(svm_t *svm);
 void svm_print_addr_list(svm_t *svm);
@@ -0,0 +1,42 @@
+#ifndef HDR_SVM_SYMBOLS_H
+#define HDR_SVM_SYMBOLS_H
+
+#include "svm/label_list.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Symbols of a program, written by svmasm -g as a section after the last instruction of the object file. The section
+ * starts with SVM_OBJECT_SYMBOLS_MAGIC where the type of the next instruction would be, so reading the program stops
+ * there. After the magic, all as native endian u64 words:
+ *
+ *   the number of labels, then for each its address, the length of its name and the name padded with zeros to a
+ *   multiple of 8 bytes;
+ *   the number of instructions, then the source line of each (0 if it isn't known);
+ *   the length of the name of the source file and the name, padded the same way.
+ *
+ * Tools that rewrite programs, like svmopt, drop the section since the addresses no longer hold.
+ */
+
+typedef struct {
+  svm_label_list_t *labels;
+  // Source line of each instruction, 0 if it isn't known.
+  uint64_t *lines;
+  uint64_t num_lines;
+  char *source;
+} svm_symbols_t;
+
+// Read the symbols of an object file. Returns false if it has none, or they are malformed.
+bool svm_symbols_read(const char *file_name, svm_symbols_t *symbols);
+// Write symbols as a symbol section, after the program has been written to out.
+bool svm_symbols_write(FILE *out, const svm_symbols_t *symbols);
+void svm_symbols_free(svm_symbols_t *symbols);
+
+// The label at address, or NULL if there isn't one. symbols may be NULL.
+const char *svm_symbols_label_at(const svm_symbols_t *symbols, uint64_t address);
+// The source line of the instruction at address, or 0 if it isn't known. symbols may be NULL.
+uint64_t svm_symbols_line_at(const svm_symbols_t *symbols, uint64_t address);
+
+#endif // HDR_SVM_SYMBOLS_H
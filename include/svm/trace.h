@@ -0,0 +1,80 @@
+#ifndef HDR_SVM_TRACE_H
+#define HDR_SVM_TRACE_H
+
+#include "svm/svm.h"
+#include "svm/symbols.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Call tracer. While svm->trace is set, call and ret timestamp every call of the VM, and each finished call becomes a
+ * trace event. The time spent in each function is added up two ways: inclusive time is from the call to the return
+ * (counted once for recursive calls), and exclusive time leaves out the time spent in the calls it made.
+ *
+ * Only the calls the VM itself makes are traced. Fibers and parfor calls run on VMs of their own, so svm refuses to
+ * trace programs that spawn fibers, which run even the root fiber on another VM.
+ */
+
+// Calls after this many are still added to the totals, but don't get an event of their own.
+#define SVM_TRACE_MAX_EVENTS (1 << 20)
+
+typedef struct {
+  uint64_t entry;
+  uint64_t depth;
+  // Nanoseconds since the trace started.
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint64_t exclusive_ns;
+} svm_trace_event_t;
+
+typedef struct {
+  uint64_t calls;
+  uint64_t inclusive_ns;
+  uint64_t exclusive_ns;
+  // Calls of the function that haven't returned yet.
+  uint64_t active;
+} svm_trace_function_t;
+
+typedef struct {
+  uint64_t entry;
+  uint64_t start_ns;
+  // Time spent in the calls made from this one.
+  uint64_t child_ns;
+} svm_trace_frame_t;
+
+typedef struct svm_trace {
+  uint64_t origin_ns;
+  // Indexed by the address of the first instruction of the function.
+  svm_trace_function_t *functions;
+  uint64_t program_size;
+
+  // frames[0] is the code outside of any call, which runs from the start of the trace to the end.
+  svm_trace_frame_t frames[SVM_CALL_STACK_SIZE + 1];
+  uint64_t depth;
+
+  svm_trace_event_t *events;
+  uint64_t num_events;
+  uint64_t events_cap;
+  uint64_t dropped;
+} svm_trace_t;
+
+// Start tracing the calls of svm, which has its program loaded.
+bool svm_trace_start(svm_trace_t *trace, svm_t *svm);
+// End the calls that haven't returned and stop tracing.
+void svm_trace_stop(svm_trace_t *trace, svm_t *svm);
+void svm_trace_free(svm_trace_t *trace);
+
+// Run by call after it has jumped to entry.
+void svm_trace_enter(svm_trace_t *trace, uint64_t entry);
+// Run by ret, and by memo when it returns with cached results.
+void svm_trace_leave(svm_trace_t *trace);
+
+// Write the events in the Chrome trace event format, which chrome://tracing and Perfetto open, with the totals of
+// every function under "svmFunctions". Functions are named after their labels in symbols, which may be NULL.
+bool svm_trace_write_json(const svm_trace_t *trace, const svm_symbols_t *symbols, const char *file_name);
+// Print the totals of every function that was called, most exclusive time first.
+void svm_trace_print(const svm_trace_t *trace, const svm_symbols_t *symbols, FILE *out);
+
+#endif // HDR_SVM_TRACE_H
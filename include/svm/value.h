@@ -2,6 +2,7 @@
 #define HDR_SVM_VALUE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef union {
   int64_t as_i64;
@@ -15,4 +16,23 @@ typedef union {
 #define SVM_VALUE_F64(value) ((svm_value_t){.as_f64 = (value)})
 #define SVM_VALUE_PTR(value) ((svm_value_t){.as_ptr = (value)})
 
+// High 64 bits of the 128 bit product of a and b.
+static inline uint64_t svm_mulh_u64(uint64_t a, uint64_t b)
+{
+  __extension__ unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)(product >> 64);
+}
+
+static inline int64_t svm_mulh_i64(int64_t a, int64_t b)
+{
+  __extension__ __int128 product = (__int128)a * b;
+  return (int64_t)(product >> 64);
+}
+
+// Whether a / b and a % b are defined: b isn't 0, and the quotient isn't INT64_MIN / -1, which doesn't fit.
+static inline bool svm_div_i64_ok(int64_t a, int64_t b)
+{
+  return b != 0 && !(a == INT64_MIN && b == -1);
+}
+
 #endif // HDR_SVM_VALUE_H
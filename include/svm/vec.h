@@ -0,0 +1,99 @@
+#ifndef HDR_SVM_VEC_H
+#define HDR_SVM_VEC_H
+
+#include "svm/value.h"
+
+#include <math.h>
+#include <stdint.h>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Lane-wise operations on vectors of SVM_VEC_LANES values, as used by the vector instructions. A vector is
+ * SVM_VEC_LANES consecutive stack slots, lane 0 first, so the operands don't need to be aligned. The operations use
+ * AVX (AVX2 for integers, FMA for fused multiply-add) when the compiler is allowed to, SSE2 otherwise, and plain C on
+ * other machines. Every version gives the same results: vfma is always fused, with fma() standing in for the
+ * instruction where there isn't one.
+ *
+ * dst may be the same as any of the operands, as it is on the stack.
+ */
+
+#define SVM_VEC_LANES 4
+
+static inline void svm_vec_add_f64(svm_value_t *dst, const svm_value_t *a, const svm_value_t *b)
+{
+#if defined(__AVX__)
+  _mm256_storeu_pd(&dst->as_f64, _mm256_add_pd(_mm256_loadu_pd(&a->as_f64), _mm256_loadu_pd(&b->as_f64)));
+#elif defined(__SSE2__)
+  __m128d lo = _mm_add_pd(_mm_loadu_pd(&a[0].as_f64), _mm_loadu_pd(&b[0].as_f64));
+  __m128d hi = _mm_add_pd(_mm_loadu_pd(&a[2].as_f64), _mm_loadu_pd(&b[2].as_f64));
+  _mm_storeu_pd(&dst[0].as_f64, lo);
+  _mm_storeu_pd(&dst[2].as_f64, hi);
+#else
+  for (int i = 0; i < SVM_VEC_LANES; i++) {
+    dst[i].as_f64 = a[i].as_f64 + b[i].as_f64;
+  }
+#endif
+}
+
+static inline void svm_vec_mul_f64(svm_value_t *dst, const svm_value_t *a, const svm_value_t *b)
+{
+#if defined(__AVX__)
+  _mm256_storeu_pd(&dst->as_f64, _mm256_mul_pd(_mm256_loadu_pd(&a->as_f64), _mm256_loadu_pd(&b->as_f64)));
+#elif defined(__SSE2__)
+  __m128d lo = _mm_mul_pd(_mm_loadu_pd(&a[0].as_f64), _mm_loadu_pd(&b[0].as_f64));
+  __m128d hi = _mm_mul_pd(_mm_loadu_pd(&a[2].as_f64), _mm_loadu_pd(&b[2].as_f64));
+  _mm_storeu_pd(&dst[0].as_f64, lo);
+  _mm_storeu_pd(&dst[2].as_f64, hi);
+#else
+  for (int i = 0; i < SVM_VEC_LANES; i++) {
+    dst[i].as_f64 = a[i].as_f64 * b[i].as_f64;
+  }
+#endif
+}
+
+// a * b + c, rounded once.
+static inline void svm_vec_fma_f64(svm_value_t *dst, const svm_value_t *a, const svm_value_t *b, const svm_value_t *c)
+{
+#if defined(__AVX__) && defined(__FMA__)
+  __m256d product = _mm256_fmadd_pd(_mm256_loadu_pd(&a->as_f64), _mm256_loadu_pd(&b->as_f64),
+                                    _mm256_loadu_pd(&c->as_f64));
+  _mm256_storeu_pd(&dst->as_f64, product);
+#else
+  for (int i = 0; i < SVM_VEC_LANES; i++) {
+    dst[i].as_f64 = fma(a[i].as_f64, b[i].as_f64, c[i].as_f64);
+  }
+#endif
+}
+
+static inline void svm_vec_add_i64(svm_value_t *dst, const svm_value_t *a, const svm_value_t *b)
+{
+#if defined(__AVX2__)
+  __m256i sum = _mm256_add_epi64(_mm256_loadu_si256((const __m256i *)a), _mm256_loadu_si256((const __m256i *)b));
+  _mm256_storeu_si256((__m256i *)dst, sum);
+#elif defined(__SSE2__)
+  __m128i lo = _mm_add_epi64(_mm_loadu_si128((const __m128i *)&a[0]), _mm_loadu_si128((const __m128i *)&b[0]));
+  __m128i hi = _mm_add_epi64(_mm_loadu_si128((const __m128i *)&a[2]), _mm_loadu_si128((const __m128i *)&b[2]));
+  _mm_storeu_si128((__m128i *)&dst[0], lo);
+  _mm_storeu_si128((__m128i *)&dst[2], hi);
+#else
+  for (int i = 0; i < SVM_VEC_LANES; i++) {
+    dst[i].as_u64 = a[i].as_u64 + b[i].as_u64;
+  }
+#endif
+}
+
+// (v0 + v1) + (v2 + v3), the order a pairwise reduction of the halves adds them in.
+static inline double svm_vec_reduce_f64(const svm_value_t *v)
+{
+  return (v[0].as_f64 + v[1].as_f64) + (v[2].as_f64 + v[3].as_f64);
+}
+
+static inline uint64_t svm_vec_reduce_i64(const svm_value_t *v)
+{
+  return v[0].as_u64 + v[1].as_u64 + v[2].as_u64 + v[3].as_u64;
+}
+
+#endif // HDR_SVM_VEC_H
@@ -0,0 +1,135 @@
+#include "svm/cfg.h"
+#include "svm/instructions.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+bool svm_instruction_type_ends_block(svm_instruction_type_t inst_type)
+{
+  // Using if instead of switch because we have -Wswitch-enum on.
+  if (svm_instruction_type_needs_label_operand(inst_type)) return true;
+  if (inst_type == SVM_INST_RET) return true;
+  if (inst_type == SVM_INST_HALT) return true;
+  if (inst_type == SVM_INST_JTAB) return true;
+
+  return false;
+}
+
+bool svm_instruction_type_falls_through(svm_instruction_type_t inst_type)
+{
+  // Using if instead of switch because we have -Wswitch-enum on.
+  if (inst_type == SVM_INST_JMP) return false;
+  if (inst_type == SVM_INST_RET) return false;
+  if (inst_type == SVM_INST_HALT) return false;
+
+  return true;
+}
+
+void svm_cfg_build(svm_cfg_t *cfg, const svm_instruction_t *program, uint64_t size)
+{
+  cfg->blocks = NULL;
+  cfg->num_blocks = 0;
+  cfg->block_of = malloc((size + 1) * sizeof(*cfg->block_of));
+  if (size == 0) {
+    return;
+  }
+
+  // Find the first instruction of every block.
+  bool *leader = calloc(size + 1, sizeof(*leader));
+  leader[0] = true;
+  for (uint64_t i = 0; i < size; i++) {
+    if (svm_instruction_type_needs_label_operand(program[i].type) && program[i].operand.as_u64 < size) {
+      leader[program[i].operand.as_u64] = true;
+    }
+    if (svm_instruction_type_ends_block(program[i].type)) {
+      leader[i + 1] = true;
+    }
+  }
+
+  for (uint64_t i = 0; i < size; i++) {
+    if (leader[i]) {
+      cfg->num_blocks++;
+    }
+    cfg->block_of[i] = cfg->num_blocks - 1;
+  }
+  // Jumps past the end of the program go to a block index that doesn't exist.
+  cfg->block_of[size] = cfg->num_blocks;
+
+  cfg->blocks = calloc(cfg->num_blocks, sizeof(*cfg->blocks));
+  for (uint64_t i = 0; i < size; i++) {
+    svm_block_t *block = &cfg->blocks[cfg->block_of[i]];
+    if (leader[i]) {
+      block->start = i;
+    }
+    block->end = i + 1;
+  }
+  free(leader);
+
+  for (uint64_t b = 0; b < cfg->num_blocks; b++) {
+    svm_block_t *block = &cfg->blocks[b];
+    svm_instruction_t last = program[block->end - 1];
+    if (svm_instruction_type_falls_through(last.type) && block->end < size) {
+      block->succ[block->num_succ++] = cfg->block_of[block->end];
+    }
+    if (svm_instruction_type_needs_label_operand(last.type) && last.operand.as_u64 < size) {
+      block->succ[block->num_succ++] = cfg->block_of[last.operand.as_u64];
+    }
+  }
+
+  // Mark everything reachable from the entry point.
+  uint64_t *work = malloc(cfg->num_blocks * sizeof(*work));
+  uint64_t work_size = 0;
+  cfg->blocks[0].reachable = true;
+  work[work_size++] = 0;
+  while (work_size > 0) {
+    svm_block_t *block = &cfg->blocks[work[--work_size]];
+    for (uint64_t s = 0; s < block->num_succ; s++) {
+      if (!cfg->blocks[block->succ[s]].reachable) {
+        cfg->blocks[block->succ[s]].reachable = true;
+        work[work_size++] = block->succ[s];
+      }
+    }
+  }
+  free(work);
+}
+
+void svm_cfg_free(svm_cfg_t *cfg)
+{
+  free(cfg->blocks);
+  free(cfg->block_of);
+  cfg->blocks = NULL;
+  cfg->block_of = NULL;
+  cfg->num_blocks = 0;
+}
+
+uint64_t svm_program_compact(svm_instruction_t *program, uint64_t size, const bool *keep)
+{
+  // new_addr[i] is the address of the first kept instruction at or after i.
+  uint64_t *new_addr = malloc((size + 1) * sizeof(*new_addr));
+  uint64_t new_size = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    new_addr[i] = new_size;
+    if (keep[i]) {
+      new_size++;
+    }
+  }
+  new_addr[size] = new_size;
+
+  uint64_t cnt = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    svm_instruction_t instruction = program[i];
+    if (svm_instruction_type_needs_label_operand(instruction.type)) {
+      uint64_t target = instruction.operand.as_u64;
+      // Jumps past the end stay past the end.
+      instruction.operand.as_u64 = target < size ? new_addr[target] : new_size + (target - size);
+    }
+    program[cnt++] = instruction;
+  }
+
+  free(new_addr);
+  return new_size;
+}
@@ -0,0 +1,280 @@
+#include "svm/chan.h"
+#include "svm/svm.h"
+#include "svm/fiber.h"
+#include "svm/value.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+// Number of times a blocking send or receive retries before it goes to sleep.
+#define SPIN_TRIES 64
+
+svm_chan_t *svm_chan_new(uint64_t capacity)
+{
+  if (capacity > SVM_MAX_CHANNEL_CAPACITY) {
+    return NULL;
+  }
+  // With a single cell, the cell a send filled would look free to the next send.
+  uint64_t size = 2;
+  while (size < capacity) {
+    size *= 2;
+  }
+
+  // calloc doesn't align to the cache lines the positions are put on.
+  svm_chan_t *chan = aligned_alloc(_Alignof(svm_chan_t), sizeof(*chan));
+  if (chan == NULL) {
+    return NULL;
+  }
+  memset(chan, 0, sizeof(*chan));
+  chan->cells = malloc(size * sizeof(*chan->cells));
+  if (chan->cells == NULL) {
+    free(chan);
+    return NULL;
+  }
+  chan->mask = size - 1;
+  for (uint64_t i = 0; i < size; i++) {
+    atomic_init(&chan->cells[i].seq, i);
+  }
+  atomic_init(&chan->refs, 1);
+  atomic_init(&chan->send_pos, 0);
+  atomic_init(&chan->recv_pos, 0);
+  pthread_mutex_init(&chan->lock, NULL);
+  pthread_cond_init(&chan->changed, NULL);
+  atomic_init(&chan->sleeping, 0);
+  atomic_init(&chan->changes, 0);
+  chan->waiters = NULL;
+  return chan;
+}
+
+void svm_chan_retain(svm_chan_t *chan)
+{
+  atomic_fetch_add_explicit(&chan->refs, 1, memory_order_relaxed);
+}
+
+void svm_chan_release(svm_chan_t *chan)
+{
+  if (atomic_fetch_sub_explicit(&chan->refs, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+  pthread_mutex_destroy(&chan->lock);
+  pthread_cond_destroy(&chan->changed);
+  free(chan->cells);
+  free(chan);
+}
+
+// Wake up the threads and fibers waiting for the channel to change. Called with the lock held.
+static void wake_locked(svm_chan_t *chan)
+{
+  pthread_cond_broadcast(&chan->changed);
+  svm_fiber_t *fiber = chan->waiters;
+  chan->waiters = NULL;
+  while (fiber != NULL) {
+    svm_fiber_t *next = fiber->next_waiter;
+    fiber->next_waiter = NULL;
+    atomic_fetch_sub(&chan->sleeping, 1);
+    svm_sched_wake(fiber);
+    fiber = next;
+  }
+}
+
+// Wake up threads and fibers waiting for the channel to change, if there are any.
+static void notify(svm_chan_t *chan)
+{
+  atomic_fetch_add(&chan->changes, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&chan->sleeping, memory_order_relaxed) > 0) {
+    pthread_mutex_lock(&chan->lock);
+    wake_locked(chan);
+    pthread_mutex_unlock(&chan->lock);
+  }
+}
+
+static bool try_send(svm_chan_t *chan, svm_value_t value)
+{
+  uint64_t pos = atomic_load_explicit(&chan->send_pos, memory_order_relaxed);
+  svm_chan_cell_t *cell;
+  while (true) {
+    cell = &chan->cells[pos & chan->mask];
+    uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    int64_t diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      // The cell is free for this position, claim it.
+      if (atomic_compare_exchange_weak_explicit(&chan->send_pos, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The cell still holds the value from one lap ago.
+      return false;
+    } else {
+      pos = atomic_load_explicit(&chan->send_pos, memory_order_relaxed);
+    }
+  }
+  cell->value = value;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+static bool try_recv(svm_chan_t *chan, svm_value_t *value)
+{
+  uint64_t pos = atomic_load_explicit(&chan->recv_pos, memory_order_relaxed);
+  svm_chan_cell_t *cell;
+  while (true) {
+    cell = &chan->cells[pos & chan->mask];
+    uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    int64_t diff = (int64_t)(seq - (pos + 1));
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&chan->recv_pos, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Nothing has been sent to this position yet.
+      return false;
+    } else {
+      pos = atomic_load_explicit(&chan->recv_pos, memory_order_relaxed);
+    }
+  }
+  *value = cell->value;
+  // Free the cell for the sender one lap later.
+  atomic_store_explicit(&cell->seq, pos + chan->mask + 1, memory_order_release);
+  return true;
+}
+
+bool svm_chan_try_send(svm_chan_t *chan, svm_value_t value)
+{
+  if (!try_send(chan, value)) {
+    return false;
+  }
+  notify(chan);
+  return true;
+}
+
+bool svm_chan_try_recv(svm_chan_t *chan, svm_value_t *value)
+{
+  if (!try_recv(chan, value)) {
+    return false;
+  }
+  notify(chan);
+  return true;
+}
+
+void svm_chan_send(svm_chan_t *chan, svm_value_t value)
+{
+  for (int i = 0; i < SPIN_TRIES; i++) {
+    if (svm_chan_try_send(chan, value)) {
+      return;
+    }
+    sched_yield();
+  }
+
+  pthread_mutex_lock(&chan->lock);
+  atomic_fetch_add(&chan->sleeping, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  // A receiver that frees a cell after this check sees sleeping and has to take the lock to wake us up.
+  while (!try_send(chan, value)) {
+    pthread_cond_wait(&chan->changed, &chan->lock);
+  }
+  atomic_fetch_sub(&chan->sleeping, 1);
+  atomic_fetch_add(&chan->changes, 1);
+  wake_locked(chan);
+  pthread_mutex_unlock(&chan->lock);
+}
+
+svm_value_t svm_chan_recv(svm_chan_t *chan)
+{
+  svm_value_t value;
+  for (int i = 0; i < SPIN_TRIES; i++) {
+    if (svm_chan_try_recv(chan, &value)) {
+      return value;
+    }
+    sched_yield();
+  }
+
+  pthread_mutex_lock(&chan->lock);
+  atomic_fetch_add(&chan->sleeping, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!try_recv(chan, &value)) {
+    pthread_cond_wait(&chan->changed, &chan->lock);
+  }
+  atomic_fetch_sub(&chan->sleeping, 1);
+  atomic_fetch_add(&chan->changes, 1);
+  wake_locked(chan);
+  pthread_mutex_unlock(&chan->lock);
+  return value;
+}
+
+uint64_t svm_chan_changes(svm_chan_t *chan)
+{
+  return atomic_load(&chan->changes);
+}
+
+bool svm_chan_park(svm_chan_t *chan, svm_fiber_t *fiber, uint64_t changes)
+{
+  pthread_mutex_lock(&chan->lock);
+  atomic_fetch_add(&chan->sleeping, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  // Like the sleeping threads: a send or receive that went ahead after this check sees sleeping and wakes the fiber.
+  if (atomic_load(&chan->changes) != changes) {
+    atomic_fetch_sub(&chan->sleeping, 1);
+    pthread_mutex_unlock(&chan->lock);
+    return false;
+  }
+  fiber->next_waiter = chan->waiters;
+  chan->waiters = fiber;
+  pthread_mutex_unlock(&chan->lock);
+  return true;
+}
+
+void svm_chan_unpark(svm_chan_t *chan, svm_fiber_t *fiber)
+{
+  pthread_mutex_lock(&chan->lock);
+  for (svm_fiber_t **link = &chan->waiters; *link != NULL; link = &(*link)->next_waiter) {
+    if (*link == fiber) {
+      *link = fiber->next_waiter;
+      fiber->next_waiter = NULL;
+      atomic_fetch_sub(&chan->sleeping, 1);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&chan->lock);
+}
+
+bool svm_chan_bind(svm_t *svm, uint64_t index, svm_chan_t *chan)
+{
+  if (index >= SVM_MAX_CHANNELS) {
+    return false;
+  }
+  if (chan != NULL) {
+    svm_chan_retain(chan);
+  }
+  if (svm->channels[index] != NULL) {
+    svm_chan_release(svm->channels[index]);
+  }
+  svm->channels[index] = chan;
+  svm->made_channels &= ~((uint64_t)1 << index);
+  return true;
+}
+
+bool svm_chan_bind_free(svm_t *svm, svm_chan_t *chan, uint64_t *index)
+{
+  for (uint64_t i = 0; i < SVM_MAX_CHANNELS; i++) {
+    if (svm->channels[i] == NULL) {
+      *index = i;
+      return svm_chan_bind(svm, i, chan);
+    }
+  }
+  return false;
+}
+
+void svm_chan_unbind_all(svm_t *svm)
+{
+  for (uint64_t i = 0; i < SVM_MAX_CHANNELS; i++) {
+    svm_chan_bind(svm, i, NULL);
+  }
+}
@@ -0,0 +1,422 @@
+#include "svm/debug.h"
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/value.h"
+#include "svm/instructions.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Number of instructions 'list' shows on either side of ip.
+#define LIST_CONTEXT 4
+
+void svm_debug_init(svm_debugger_t *dbg, svm_t *svm)
+{
+  memset(dbg, 0, sizeof(*dbg));
+  dbg->svm = svm;
+}
+
+// Index of the breakpoint at addr, or num_breakpoints if there is none.
+static uint64_t find_breakpoint(const svm_debugger_t *dbg, uint64_t addr)
+{
+  uint64_t i = 0;
+  while (i < dbg->num_breakpoints && dbg->breakpoints[i].addr != addr) {
+    i++;
+  }
+  return i;
+}
+
+bool svm_debug_set_breakpoint(svm_debugger_t *dbg, uint64_t addr)
+{
+  if (addr >= dbg->svm->program_size || dbg->num_breakpoints >= SVM_DEBUG_MAX_BREAKPOINTS) {
+    return false;
+  }
+  if (find_breakpoint(dbg, addr) < dbg->num_breakpoints) {
+    return true;
+  }
+  svm_breakpoint_t *bp = &dbg->breakpoints[dbg->num_breakpoints++];
+  bp->addr = addr;
+  bp->saved = dbg->svm->opcodes[addr];
+  dbg->svm->opcodes[addr] = SVM_INST_BREAK;
+  return true;
+}
+
+bool svm_debug_clear_breakpoint(svm_debugger_t *dbg, uint64_t addr)
+{
+  uint64_t i = find_breakpoint(dbg, addr);
+  if (i == dbg->num_breakpoints) {
+    return false;
+  }
+  dbg->svm->opcodes[addr] = dbg->breakpoints[i].saved;
+  dbg->breakpoints[i] = dbg->breakpoints[--dbg->num_breakpoints];
+  return true;
+}
+
+static bool heap_allocated(const svm_t *svm, void *addr)
+{
+  const svm_t *heap = svm->heap_vm != NULL ? svm->heap_vm : svm;
+  for (uint64_t i = 0; i < heap->heap_addrs_ptr; i++) {
+    if (heap->heap_addrs[i] == addr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Read the current state of a watchpoint into valid and value.
+static void watch_read(const svm_t *svm, const svm_watchpoint_t *watch, bool *valid, svm_value_t *value)
+{
+  *value = SVM_VALUE_U64(0);
+  if (watch->kind == SVM_WATCH_STACK) {
+    *valid = watch->slot < svm->stack_ptr;
+    if (*valid) {
+      *value = svm->stack[watch->slot];
+    }
+  } else {
+    // Only look at the address while it is allocated.
+    *valid = heap_allocated(svm, watch->addr);
+    if (*valid) {
+      memcpy(value, watch->addr, sizeof(*value));
+    }
+  }
+}
+
+static bool add_watchpoint(svm_debugger_t *dbg, svm_watchpoint_t watch)
+{
+  if (dbg->num_watchpoints >= SVM_DEBUG_MAX_WATCHPOINTS) {
+    return false;
+  }
+  watch_read(dbg->svm, &watch, &watch.valid, &watch.value);
+  dbg->watchpoints[dbg->num_watchpoints++] = watch;
+  return true;
+}
+
+bool svm_debug_watch_stack(svm_debugger_t *dbg, uint64_t slot)
+{
+  if (slot >= SVM_STACK_SIZE) {
+    return false;
+  }
+  return add_watchpoint(dbg, (svm_watchpoint_t){.kind = SVM_WATCH_STACK, .slot = slot});
+}
+
+bool svm_debug_watch_heap(svm_debugger_t *dbg, void *addr)
+{
+  if (!heap_allocated(dbg->svm, addr)) {
+    return false;
+  }
+  return add_watchpoint(dbg, (svm_watchpoint_t){.kind = SVM_WATCH_HEAP, .addr = addr});
+}
+
+bool svm_debug_unwatch(svm_debugger_t *dbg, uint64_t index)
+{
+  if (index >= dbg->num_watchpoints) {
+    return false;
+  }
+  memmove(&dbg->watchpoints[index], &dbg->watchpoints[index + 1],
+          (dbg->num_watchpoints - index - 1) * sizeof(dbg->watchpoints[0]));
+  dbg->num_watchpoints--;
+  return true;
+}
+
+// Update every watchpoint and return true, with the index of the first one that changed in *watch, if any changed.
+static bool check_watchpoints(svm_debugger_t *dbg, uint64_t *watch)
+{
+  bool changed = false;
+  for (uint64_t i = 0; i < dbg->num_watchpoints; i++) {
+    svm_watchpoint_t *wp = &dbg->watchpoints[i];
+    bool valid;
+    svm_value_t value;
+    watch_read(dbg->svm, wp, &valid, &value);
+    if (valid != wp->valid || value.as_u64 != wp->value.as_u64) {
+      if (!changed) {
+        *watch = i;
+      }
+      changed = true;
+    }
+    wp->valid = valid;
+    wp->value = value;
+  }
+  return changed;
+}
+
+svm_instruction_t svm_debug_instruction(const svm_debugger_t *dbg, uint64_t addr)
+{
+  svm_instruction_t inst = svm_program_get(dbg->svm, addr);
+  uint64_t i = find_breakpoint(dbg, addr);
+  if (i < dbg->num_breakpoints) {
+    inst.type = dbg->breakpoints[i].saved;
+  }
+  return inst;
+}
+
+svm_err_t svm_debug_step(svm_debugger_t *dbg, uint64_t *watch)
+{
+  svm_t *svm = dbg->svm;
+  if (svm->halted) {
+    return SVM_ERR_OK;
+  }
+
+  uint64_t i = find_breakpoint(dbg, svm->ip);
+  svm_breakpoint_t *bp = i < dbg->num_breakpoints ? &dbg->breakpoints[i] : NULL;
+  if (bp != NULL) {
+    svm->opcodes[bp->addr] = bp->saved;
+  }
+  svm_err_t err = svm_exec_instruction(svm);
+  if (bp != NULL) {
+    // The instruction may have been quickened or deoptimized while it ran.
+    bp->saved = svm->opcodes[bp->addr];
+    svm->opcodes[bp->addr] = SVM_INST_BREAK;
+  }
+  if (err != SVM_ERR_OK) {
+    return err;
+  }
+
+  if (check_watchpoints(dbg, watch)) {
+    return SVM_ERR_WATCHPOINT;
+  }
+  return SVM_ERR_OK;
+}
+
+svm_err_t svm_debug_continue(svm_debugger_t *dbg, uint64_t *watch)
+{
+  svm_t *svm = dbg->svm;
+
+  // Get off the breakpoint we may be stopped at first.
+  svm_err_t err = svm_debug_step(dbg, watch);
+  if (err != SVM_ERR_OK) {
+    return err;
+  }
+
+  if (dbg->num_watchpoints == 0) {
+    // Nothing to check between instructions, so let the interpreter run until it hits a breakpoint.
+    while (!svm->halted) {
+      err = svm_exec_instruction(svm);
+      if (err != SVM_ERR_OK) {
+        return err;
+      }
+    }
+    return SVM_ERR_OK;
+  }
+
+  while (!svm->halted) {
+    if (svm->ip < svm->program_size && svm->opcodes[svm->ip] == SVM_INST_BREAK) {
+      return SVM_ERR_BREAKPOINT;
+    }
+    err = svm_debug_step(dbg, watch);
+    if (err != SVM_ERR_OK) {
+      return err;
+    }
+  }
+  return SVM_ERR_OK;
+}
+
+void svm_debug_print_instruction(const svm_debugger_t *dbg, uint64_t addr, FILE *out)
+{
+  if (addr >= dbg->svm->program_size) {
+    fprintf(out, "%lu: [end of program]\n", addr);
+    return;
+  }
+  svm_instruction_t inst = svm_debug_instruction(dbg, addr);
+  fprintf(out, "%lu: %s", addr, svm_instruction_type_to_string(inst.type));
+  if (svm_instruction_type_needs_operand(inst.type)) {
+    fprintf(out, " %ld", inst.operand.as_i64);
+  }
+  fprintf(out, "\n");
+}
+
+void svm_debug_print_backtrace(const svm_debugger_t *dbg, FILE *out)
+{
+  const svm_t *svm = dbg->svm;
+  fprintf(out, "#0  ");
+  svm_debug_print_instruction(dbg, svm->ip, out);
+  // Each entry of the call stack is the instruction after a call.
+  for (uint64_t i = svm->call_stack_ptr; i > 0; i--) {
+    fprintf(out, "#%lu  ", svm->call_stack_ptr - i + 1);
+    svm_debug_print_instruction(dbg, svm->call_stack[i - 1] - 1, out);
+  }
+}
+
+static void print_value(svm_value_t value, FILE *out)
+{
+  fprintf(out, "i64: %ld | u64: %lu | f64: %f | ptr: %p\n", value.as_i64, value.as_u64, value.as_f64, value.as_ptr);
+}
+
+static void print_watchpoint(const svm_debugger_t *dbg, uint64_t index, FILE *out)
+{
+  const svm_watchpoint_t *wp = &dbg->watchpoints[index];
+  if (wp->kind == SVM_WATCH_STACK) {
+    fprintf(out, "Watchpoint %lu, stack slot %lu: ", index, wp->slot);
+  } else {
+    fprintf(out, "Watchpoint %lu, heap address %p: ", index, wp->addr);
+  }
+  if (wp->valid) {
+    print_value(wp->value, out);
+  } else {
+    fprintf(out, "[%s]\n", wp->kind == SVM_WATCH_STACK ? "not on the stack" : "not allocated");
+  }
+}
+
+static void repl_usage(FILE *out)
+{
+  fprintf(out, "Commands:\n");
+  fprintf(out, "  break ADDR, b ADDR    Stop before running the instruction at ADDR.\n");
+  fprintf(out, "  delete ADDR, d ADDR   Remove the breakpoint at ADDR.\n");
+  fprintf(out, "  watch stack SLOT      Stop when the stack slot SLOT (counted from the bottom) changes.\n");
+  fprintf(out, "  watch heap ADDR       Stop when the value at the allocated address ADDR changes.\n");
+  fprintf(out, "  unwatch N             Remove watchpoint N.\n");
+  fprintf(out, "  info                  List breakpoints and watchpoints.\n");
+  fprintf(out, "  step [N], s [N]       Run N instructions (default: 1).\n");
+  fprintf(out, "  continue, c           Run until a breakpoint or watchpoint, or the end of the program.\n");
+  fprintf(out, "  backtrace, bt         Show the current instruction and the calls that led to it.\n");
+  fprintf(out, "  list, l               Show the instructions around the current one.\n");
+  fprintf(out, "  stack                 Show the stack.\n");
+  fprintf(out, "  heap                  Show the allocated addresses.\n");
+  fprintf(out, "  quit, q               Stop debugging.\n");
+}
+
+static bool is_command(const char *cmd, const char *name, const char *alias)
+{
+  return strcmp(cmd, name) == 0 || (alias != NULL && strcmp(cmd, alias) == 0);
+}
+
+static bool parse_number(const char *token, uint64_t *value)
+{
+  if (token == NULL) {
+    return false;
+  }
+  char *endptr;
+  *value = strtoull(token, &endptr, 0);
+  return endptr != token && *endptr == '\0';
+}
+
+// Report why the program stopped. Returns false once it can't run any further.
+static bool report_stop(svm_debugger_t *dbg, svm_err_t err, uint64_t watch, FILE *out)
+{
+  svm_t *svm = dbg->svm;
+  if (err == SVM_ERR_WATCHPOINT) {
+    print_watchpoint(dbg, watch, out);
+  } else if (err == SVM_ERR_BREAKPOINT) {
+    fprintf(out, "Breakpoint at ");
+  } else if (err != SVM_ERR_OK) {
+    fprintf(out, "Error: %s at ", svm_err_to_string(err));
+    // Apart from running off the end, errors happen after ip has moved past the instruction.
+    svm_debug_print_instruction(dbg, err == SVM_ERR_IP_OVERFLOW ? svm->ip : svm->ip - 1, out);
+    return false;
+  }
+  if (svm->halted) {
+    fprintf(out, "Program halted.\n");
+    return false;
+  }
+  svm_debug_print_instruction(dbg, svm->ip, out);
+  return true;
+}
+
+svm_err_t svm_debug_repl(svm_debugger_t *dbg, FILE *in, FILE *out)
+{
+  svm_t *svm = dbg->svm;
+  svm_err_t result = SVM_ERR_OK;
+  bool running = !svm->halted;
+  char line[256];
+
+  fprintf(out, "Stopped at ");
+  svm_debug_print_instruction(dbg, svm->ip, out);
+  while (true) {
+    fprintf(out, "(svm) ");
+    fflush(out);
+    if (fgets(line, sizeof(line), in) == NULL) {
+      fprintf(out, "\n");
+      break;
+    }
+    char *cmd = strtok(line, " \t\n");
+    if (cmd == NULL) {
+      continue;
+    }
+    char *arg = strtok(NULL, " \t\n");
+    char *arg2 = strtok(NULL, " \t\n");
+    uint64_t n;
+
+    if (is_command(cmd, "quit", "q")) {
+      break;
+    } else if (is_command(cmd, "help", "h")) {
+      repl_usage(out);
+    } else if (is_command(cmd, "break", "b")) {
+      if (!parse_number(arg, &n) || !svm_debug_set_breakpoint(dbg, n)) {
+        fprintf(out, "Cannot set a breakpoint at '%s'.\n", arg != NULL ? arg : "");
+      }
+    } else if (is_command(cmd, "delete", "d")) {
+      if (!parse_number(arg, &n) || !svm_debug_clear_breakpoint(dbg, n)) {
+        fprintf(out, "No breakpoint at '%s'.\n", arg != NULL ? arg : "");
+      }
+    } else if (is_command(cmd, "watch", NULL)) {
+      bool ok = false;
+      if (arg != NULL && strcmp(arg, "stack") == 0 && parse_number(arg2, &n)) {
+        ok = svm_debug_watch_stack(dbg, n);
+      } else if (arg != NULL && strcmp(arg, "heap") == 0 && parse_number(arg2, &n)) {
+        ok = svm_debug_watch_heap(dbg, (void *)(uintptr_t)n);
+      }
+      if (ok) {
+        print_watchpoint(dbg, dbg->num_watchpoints - 1, out);
+      } else {
+        fprintf(out, "Cannot watch that. Use 'watch stack SLOT' or 'watch heap ADDR' with an allocated address.\n");
+      }
+    } else if (is_command(cmd, "unwatch", NULL)) {
+      if (!parse_number(arg, &n) || !svm_debug_unwatch(dbg, n)) {
+        fprintf(out, "No watchpoint '%s'.\n", arg != NULL ? arg : "");
+      }
+    } else if (is_command(cmd, "info", "i")) {
+      for (uint64_t i = 0; i < dbg->num_breakpoints; i++) {
+        fprintf(out, "Breakpoint at ");
+        svm_debug_print_instruction(dbg, dbg->breakpoints[i].addr, out);
+      }
+      for (uint64_t i = 0; i < dbg->num_watchpoints; i++) {
+        print_watchpoint(dbg, i, out);
+      }
+    } else if (is_command(cmd, "step", "s") || is_command(cmd, "continue", "c")) {
+      if (!running) {
+        fprintf(out, "The program is not running.\n");
+        continue;
+      }
+      uint64_t watch = 0;
+      svm_err_t err = SVM_ERR_OK;
+      if (is_command(cmd, "continue", "c")) {
+        err = svm_debug_continue(dbg, &watch);
+      } else {
+        uint64_t count = 1;
+        if (arg != NULL && !parse_number(arg, &count)) {
+          fprintf(out, "Expected a number of instructions, got '%s'.\n", arg);
+          continue;
+        }
+        for (uint64_t i = 0; i < count && err == SVM_ERR_OK && !svm->halted; i++) {
+          err = svm_debug_step(dbg, &watch);
+        }
+      }
+      running = report_stop(dbg, err, watch, out);
+      if (err != SVM_ERR_OK && err != SVM_ERR_BREAKPOINT && err != SVM_ERR_WATCHPOINT) {
+        result = err;
+      }
+    } else if (is_command(cmd, "backtrace", "bt")) {
+      svm_debug_print_backtrace(dbg, out);
+    } else if (is_command(cmd, "list", "l")) {
+      uint64_t start = svm->ip > LIST_CONTEXT ? svm->ip - LIST_CONTEXT : 0;
+      for (uint64_t addr = start; addr < svm->program_size && addr <= svm->ip + LIST_CONTEXT; addr++) {
+        fprintf(out, "%s%s", addr == svm->ip ? "=> " : "   ", find_breakpoint(dbg, addr) < dbg->num_breakpoints ? "* " : "  ");
+        svm_debug_print_instruction(dbg, addr, out);
+      }
+    } else if (is_command(cmd, "stack", NULL)) {
+      svm_print_stack(svm);
+    } else if (is_command(cmd, "heap", NULL)) {
+      svm_print_addr_list(svm);
+    } else {
+      fprintf(out, "Unknown command '%s'. Type 'help' for a list of commands.\n", cmd);
+    }
+  }
+
+  // Leave the program as it was loaded.
+  while (dbg->num_breakpoints > 0) {
+    svm_debug_clear_breakpoint(dbg, dbg->breakpoints[0].addr);
+  }
+  return result;
+}
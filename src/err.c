@@ -16,6 +16,23 @@ const char *svm_err_to_string(svm_err_t err)
 
     case SVM_ERR_ADDR_LIST_FULL: return "SVM_ERR_ADDR_LIST_FULL";
     case SVM_ERR_ILLEGAL_ADDR: return "SVM_ERR_ILLEGAL_ADDR";
+
+    case SVM_ERR_NO_SCHEDULER: return "SVM_ERR_NO_SCHEDULER";
+    case SVM_ERR_ILLEGAL_FIBER: return "SVM_ERR_ILLEGAL_FIBER";
+    case SVM_ERR_DEADLOCK: return "SVM_ERR_DEADLOCK";
+
+    case SVM_ERR_ILLEGAL_CHANNEL: return "SVM_ERR_ILLEGAL_CHANNEL";
+    case SVM_ERR_CHANNEL_LIST_FULL: return "SVM_ERR_CHANNEL_LIST_FULL";
+
+    case SVM_ERR_OUT_OF_FUEL: return "SVM_ERR_OUT_OF_FUEL";
+    case SVM_ERR_BREAKPOINT: return "SVM_ERR_BREAKPOINT";
+    case SVM_ERR_WATCHPOINT: return "SVM_ERR_WATCHPOINT";
+
+    case SVM_ERR_NO_IO: return "SVM_ERR_NO_IO";
+
+    case SVM_ERR_CHANNEL_TOO_LARGE: return "SVM_ERR_CHANNEL_TOO_LARGE";
+
+    case SVM_ERR_ILLEGAL_DIVISION: return "SVM_ERR_ILLEGAL_DIVISION";
     default:
       return "Unknown error";
       break;
@@ -0,0 +1,515 @@
+#include "svm/fiber.h"
+#include "svm/svm.h"
+#include "svm/chan.h"
+#include "svm/err.h"
+#include "svm/value.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+
+// A double ended queue of ready fibers. The owning worker pushes and pops at the bottom, other workers steal from the
+// top so that they pick up the oldest work.
+typedef struct {
+  pthread_mutex_t lock;
+  svm_fiber_t **items;
+  uint64_t cap;
+  uint64_t head;
+  uint64_t count;
+} svm_deque_t;
+
+typedef struct {
+  struct svm_sched *sched;
+  uint32_t idx;
+  pthread_t thread;
+  // VM that fibers are loaded onto while this worker runs them.
+  svm_t *carrier;
+  svm_deque_t deque;
+  unsigned int seed;
+} svm_worker_t;
+
+struct svm_sched {
+  svm_t *root;
+
+  // Guards the fiber table, join lists and sleeping workers.
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_mutex_t heap_lock;
+
+  svm_fiber_t **fibers;
+  uint64_t num_fibers;
+  uint64_t fibers_cap;
+
+  _Atomic uint64_t num_ready;
+  _Atomic uint32_t num_sleeping;
+  // Fibers parked on channels the host bound, which something outside the program may still send to or receive from.
+  _Atomic uint64_t num_external;
+  _Atomic bool done;
+  svm_err_t err;
+
+  uint32_t num_workers;
+  svm_worker_t workers[SVM_SCHED_MAX_WORKERS];
+};
+
+static void deque_init(svm_deque_t *deque)
+{
+  pthread_mutex_init(&deque->lock, NULL);
+  deque->cap = 64;
+  deque->items = malloc(deque->cap * sizeof(*deque->items));
+  deque->head = 0;
+  deque->count = 0;
+}
+
+static void deque_destroy(svm_deque_t *deque)
+{
+  pthread_mutex_destroy(&deque->lock);
+  free(deque->items);
+}
+
+static void deque_grow(svm_deque_t *deque)
+{
+  svm_fiber_t **items = malloc(deque->cap * 2 * sizeof(*items));
+  for (uint64_t i = 0; i < deque->count; i++) {
+    items[i] = deque->items[(deque->head + i) % deque->cap];
+  }
+  free(deque->items);
+  deque->items = items;
+  deque->cap *= 2;
+  deque->head = 0;
+}
+
+static void deque_push_bottom(svm_deque_t *deque, svm_fiber_t *fiber)
+{
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->cap) {
+    deque_grow(deque);
+  }
+  deque->items[(deque->head + deque->count) % deque->cap] = fiber;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static void deque_push_top(svm_deque_t *deque, svm_fiber_t *fiber)
+{
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->cap) {
+    deque_grow(deque);
+  }
+  deque->head = (deque->head + deque->cap - 1) % deque->cap;
+  deque->items[deque->head] = fiber;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static svm_fiber_t *deque_pop_bottom(svm_deque_t *deque)
+{
+  svm_fiber_t *fiber = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    deque->count--;
+    fiber = deque->items[(deque->head + deque->count) % deque->cap];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return fiber;
+}
+
+static svm_fiber_t *deque_pop_top(svm_deque_t *deque)
+{
+  svm_fiber_t *fiber = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    fiber = deque->items[deque->head];
+    deque->head = (deque->head + 1) % deque->cap;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return fiber;
+}
+
+static void notify_ready(svm_sched_t *sched)
+{
+  atomic_fetch_add(&sched->num_ready, 1);
+  if (atomic_load(&sched->num_sleeping) > 0) {
+    pthread_mutex_lock(&sched->lock);
+    pthread_cond_signal(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+  }
+}
+
+// Put a fiber that should run soon (new or woken up) on the worker's deque.
+static void push_ready(svm_worker_t *worker, svm_fiber_t *fiber)
+{
+  fiber->state = SVM_FIBER_READY;
+  deque_push_bottom(&worker->deque, fiber);
+  notify_ready(worker->sched);
+}
+
+// Put a fiber that yielded or ran out of its slice behind the other work on the worker's deque.
+static void push_yielded(svm_worker_t *worker, svm_fiber_t *fiber)
+{
+  fiber->state = SVM_FIBER_READY;
+  deque_push_top(&worker->deque, fiber);
+  notify_ready(worker->sched);
+}
+
+static void stop(svm_sched_t *sched, svm_err_t err)
+{
+  pthread_mutex_lock(&sched->lock);
+  if (sched->err == SVM_ERR_OK) {
+    sched->err = err;
+  }
+  atomic_store(&sched->done, true);
+  pthread_cond_broadcast(&sched->wake);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static svm_fiber_t *next_fiber(svm_worker_t *worker)
+{
+  svm_sched_t *sched = worker->sched;
+
+  while (!atomic_load(&sched->done)) {
+    svm_fiber_t *fiber = deque_pop_bottom(&worker->deque);
+    if (fiber != NULL) {
+      atomic_fetch_sub(&sched->num_ready, 1);
+      return fiber;
+    }
+
+    // Try to steal from the other workers, starting at a random one.
+    uint32_t start = rand_r(&worker->seed) % sched->num_workers;
+    for (uint32_t i = 0; i < sched->num_workers; i++) {
+      svm_worker_t *victim = &sched->workers[(start + i) % sched->num_workers];
+      if (victim == worker) {
+        continue;
+      }
+      fiber = deque_pop_top(&victim->deque);
+      if (fiber != NULL) {
+        atomic_fetch_sub(&sched->num_ready, 1);
+        return fiber;
+      }
+    }
+
+    // Nothing to do, sleep until a fiber becomes ready.
+    pthread_mutex_lock(&sched->lock);
+    uint32_t sleeping = atomic_fetch_add(&sched->num_sleeping, 1) + 1;
+    // svm_sched_wake makes the fiber ready before it stops counting it as external, so read them the other way round.
+    if (sleeping == sched->num_workers && atomic_load(&sched->num_external) == 0 &&
+        atomic_load(&sched->num_ready) == 0 && !atomic_load(&sched->done)) {
+      // Every worker is idle and nothing is ready, so every remaining fiber is blocked in a join or on a channel
+      // that only the fibers send to and receive from.
+      if (sched->err == SVM_ERR_OK) {
+        sched->err = SVM_ERR_DEADLOCK;
+      }
+      atomic_store(&sched->done, true);
+      pthread_cond_broadcast(&sched->wake);
+    }
+    while (atomic_load(&sched->num_ready) == 0 && !atomic_load(&sched->done)) {
+      pthread_cond_wait(&sched->wake, &sched->lock);
+    }
+    atomic_fetch_sub(&sched->num_sleeping, 1);
+    pthread_mutex_unlock(&sched->lock);
+  }
+
+  return NULL;
+}
+
+static void load_fiber(svm_t *carrier, svm_fiber_t *fiber)
+{
+  memcpy(carrier->stack, fiber->stack, fiber->stack_ptr * sizeof(*fiber->stack));
+  carrier->stack_ptr = fiber->stack_ptr;
+  memcpy(carrier->call_stack, fiber->call_stack, fiber->call_stack_ptr * sizeof(*fiber->call_stack));
+  carrier->call_stack_ptr = fiber->call_stack_ptr;
+  carrier->ip = fiber->ip;
+  // So the instruction that outgrows the stacks of the fiber fails, not the switch back to the fiber.
+  carrier->stack_limit = fiber->stack_size;
+  carrier->call_stack_limit = fiber->call_stack_size;
+
+  carrier->fiber = fiber;
+  carrier->halted = false;
+}
+
+static void save_fiber(svm_t *carrier, svm_fiber_t *fiber)
+{
+  memcpy(fiber->stack, carrier->stack, carrier->stack_ptr * sizeof(*fiber->stack));
+  fiber->stack_ptr = carrier->stack_ptr;
+  memcpy(fiber->call_stack, carrier->call_stack, carrier->call_stack_ptr * sizeof(*fiber->call_stack));
+  fiber->call_stack_ptr = carrier->call_stack_ptr;
+  fiber->ip = carrier->ip;
+}
+
+static void fiber_free_stacks(svm_fiber_t *fiber)
+{
+  free(fiber->stack);
+  fiber->stack = NULL;
+  fiber->call_stack = NULL;
+}
+
+static void finish_fiber(svm_worker_t *worker, svm_fiber_t *fiber)
+{
+  svm_sched_t *sched = worker->sched;
+
+  pthread_mutex_lock(&sched->lock);
+  fiber->result = fiber->stack_ptr > 0 ? fiber->stack[fiber->stack_ptr - 1] : SVM_VALUE_I64(0);
+  fiber->state = SVM_FIBER_DONE;
+  svm_fiber_t *waiter = fiber->waiters;
+  fiber->waiters = NULL;
+  pthread_mutex_unlock(&sched->lock);
+
+  if (fiber->id != 0) {
+    fiber_free_stacks(fiber);
+  }
+
+  while (waiter != NULL) {
+    svm_fiber_t *next = waiter->next_waiter;
+    waiter->next_waiter = NULL;
+    push_ready(worker, waiter);
+    waiter = next;
+  }
+
+  if (fiber->id == 0) {
+    stop(sched, SVM_ERR_OK);
+  }
+}
+
+// Called once a fiber that executed a join on an unfinished fiber has been switched out. The fiber id is still on top
+// of its stack so that the join runs again when it is woken up.
+static void park_fiber(svm_worker_t *worker, svm_fiber_t *fiber)
+{
+  svm_sched_t *sched = worker->sched;
+  uint64_t id = fiber->stack[fiber->stack_ptr - 1].as_u64;
+
+  pthread_mutex_lock(&sched->lock);
+  svm_fiber_t *target = sched->fibers[id];
+  if (target->state == SVM_FIBER_DONE) {
+    pthread_mutex_unlock(&sched->lock);
+    push_ready(worker, fiber);
+    return;
+  }
+  fiber->state = SVM_FIBER_BLOCKED;
+  fiber->next_waiter = target->waiters;
+  target->waiters = fiber;
+  pthread_mutex_unlock(&sched->lock);
+}
+
+// Called once a fiber whose send or recv couldn't go ahead has been switched out. The instruction runs again when the
+// fiber is woken up.
+static void park_on_channel(svm_worker_t *worker, svm_fiber_t *fiber)
+{
+  svm_sched_t *sched = worker->sched;
+  bool external = fiber->chan_external;
+
+  // Set before the fiber can be woken, which makes it ready.
+  fiber->state = SVM_FIBER_BLOCKED;
+  if (external) {
+    atomic_fetch_add(&sched->num_external, 1);
+  }
+  if (!svm_chan_park(fiber->chan, fiber, fiber->chan_changes)) {
+    push_yielded(worker, fiber);
+    if (external) {
+      atomic_fetch_sub(&sched->num_external, 1);
+    }
+  }
+}
+
+void svm_sched_wake(svm_fiber_t *fiber)
+{
+  svm_sched_t *sched = fiber->sched;
+  bool external = fiber->chan_external;
+  push_ready(&sched->workers[fiber->worker], fiber);
+  if (external) {
+    atomic_fetch_sub(&sched->num_external, 1);
+  }
+}
+
+static void run_fiber(svm_worker_t *worker, svm_fiber_t *fiber)
+{
+  svm_t *carrier = worker->carrier;
+  svm_err_t err;
+
+  fiber->worker = worker->idx;
+  fiber->chan = NULL;
+  load_fiber(carrier, fiber);
+  err = svm_run_for(carrier, SVM_FIBER_SLICE);
+  if (err == SVM_ERR_OUT_OF_FUEL) {
+    err = SVM_ERR_OK;
+  }
+  if (err == SVM_ERR_OK) {
+    save_fiber(carrier, fiber);
+  }
+  carrier->fiber = NULL;
+
+  if (err != SVM_ERR_OK) {
+    fprintf(stderr, "Error: fiber %lu failed at ip %lu\n", fiber->id, carrier->ip);
+    stop(worker->sched, err);
+  } else if (carrier->halted) {
+    finish_fiber(worker, fiber);
+  } else if (carrier->parked && fiber->chan != NULL) {
+    park_on_channel(worker, fiber);
+  } else if (carrier->parked) {
+    park_fiber(worker, fiber);
+  } else {
+    push_yielded(worker, fiber);
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  svm_worker_t *worker = arg;
+
+  svm_fiber_t *fiber;
+  while ((fiber = next_fiber(worker)) != NULL) {
+    run_fiber(worker, fiber);
+  }
+
+  return NULL;
+}
+
+static svm_fiber_t *fiber_new(uint64_t stack_size, uint64_t call_stack_size)
+{
+  // The stacks live in a separate block so they can be released as soon as the fiber is done.
+  svm_fiber_t *fiber = calloc(1, sizeof(*fiber));
+  void *stacks = malloc(stack_size * sizeof(svm_value_t) + call_stack_size * sizeof(uint64_t));
+  fiber->stack = stacks;
+  fiber->stack_size = stack_size;
+  fiber->call_stack = (uint64_t *)(fiber->stack + stack_size);
+  fiber->call_stack_size = call_stack_size;
+  return fiber;
+}
+
+static uint64_t add_fiber(svm_sched_t *sched, svm_fiber_t *fiber)
+{
+  pthread_mutex_lock(&sched->lock);
+  if (sched->num_fibers == sched->fibers_cap) {
+    sched->fibers_cap = sched->fibers_cap == 0 ? 64 : sched->fibers_cap * 2;
+    sched->fibers = realloc(sched->fibers, sched->fibers_cap * sizeof(*sched->fibers));
+  }
+  fiber->id = sched->num_fibers;
+  fiber->sched = sched;
+  sched->fibers[sched->num_fibers++] = fiber;
+  pthread_mutex_unlock(&sched->lock);
+
+  return fiber->id;
+}
+
+svm_err_t svm_sched_spawn(svm_sched_t *sched, svm_fiber_t *parent, uint64_t entry, svm_value_t arg, uint64_t *id)
+{
+  svm_fiber_t *fiber = fiber_new(SVM_FIBER_STACK_SIZE, SVM_FIBER_CALL_STACK_SIZE);
+  fiber->stack[0] = arg;
+  fiber->stack_ptr = 1;
+  fiber->ip = entry;
+
+  *id = add_fiber(sched, fiber);
+  push_ready(&sched->workers[parent->worker], fiber);
+  return SVM_ERR_OK;
+}
+
+svm_err_t svm_sched_try_join(svm_sched_t *sched, uint64_t id, bool *done, svm_value_t *result)
+{
+  pthread_mutex_lock(&sched->lock);
+  if (id >= sched->num_fibers) {
+    pthread_mutex_unlock(&sched->lock);
+    return SVM_ERR_ILLEGAL_FIBER;
+  }
+  svm_fiber_t *fiber = sched->fibers[id];
+  *done = fiber->state == SVM_FIBER_DONE;
+  if (*done) {
+    *result = fiber->result;
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  return SVM_ERR_OK;
+}
+
+svm_err_t svm_sched_run(svm_t *svm, uint32_t num_workers)
+{
+  if (num_workers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = cpus > 0 ? cpus : 1;
+  }
+  if (num_workers > SVM_SCHED_MAX_WORKERS) {
+    num_workers = SVM_SCHED_MAX_WORKERS;
+  }
+
+  svm_sched_t *sched = calloc(1, sizeof(*sched));
+  sched->root = svm;
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->wake, NULL);
+  pthread_mutex_init(&sched->heap_lock, NULL);
+  sched->num_workers = num_workers;
+
+  for (uint32_t i = 0; i < num_workers; i++) {
+    svm_worker_t *worker = &sched->workers[i];
+    worker->sched = sched;
+    worker->idx = i;
+    worker->seed = i + 1;
+    deque_init(&worker->deque);
+
+    worker->carrier = malloc(sizeof(*worker->carrier));
+    svm_init(worker->carrier);
+    svm_load_program_from_vm(worker->carrier, svm);
+    worker->carrier->heap_vm = svm;
+    worker->carrier->heap_lock = &sched->heap_lock;
+    worker->carrier->sched = sched;
+    // Used under heap_lock, like the heap.
+    worker->carrier->io = svm->io;
+  }
+
+  // The root fiber runs on the stacks of the VM itself so its final state ends up where svm_print_stack looks.
+  svm_fiber_t root = {0};
+  root.stack = svm->stack;
+  root.stack_size = SVM_STACK_SIZE;
+  root.stack_ptr = svm->stack_ptr;
+  root.call_stack = svm->call_stack;
+  root.call_stack_size = SVM_CALL_STACK_SIZE;
+  root.call_stack_ptr = svm->call_stack_ptr;
+  root.ip = svm->ip;
+  add_fiber(sched, &root);
+  push_ready(&sched->workers[0], &root);
+
+  // Like the parfor pool, the workers don't take SIGPROF.
+  sigset_t sigprof, old_mask;
+  sigemptyset(&sigprof);
+  sigaddset(&sigprof, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &sigprof, &old_mask);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    pthread_create(&sched->workers[i].thread, NULL, worker_main, &sched->workers[i]);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    pthread_join(sched->workers[i].thread, NULL);
+  }
+
+  svm->stack_ptr = root.stack_ptr;
+  svm->call_stack_ptr = root.call_stack_ptr;
+  svm->ip = root.ip;
+  svm->halted = root.state == SVM_FIBER_DONE;
+  svm_err_t err = sched->err;
+
+  // Take the fibers that are still parked off their channels, which may outlive the run.
+  for (uint64_t i = 0; i < sched->num_fibers; i++) {
+    if (sched->fibers[i]->chan != NULL) {
+      svm_chan_unpark(sched->fibers[i]->chan, sched->fibers[i]);
+    }
+  }
+
+  // Fibers that were still running when the root fiber halted are dropped.
+  for (uint64_t i = 1; i < sched->num_fibers; i++) {
+    fiber_free_stacks(sched->fibers[i]);
+    free(sched->fibers[i]);
+  }
+  free(sched->fibers);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    deque_destroy(&sched->workers[i].deque);
+    free(sched->workers[i].carrier);
+  }
+  pthread_mutex_destroy(&sched->heap_lock);
+  pthread_cond_destroy(&sched->wake);
+  pthread_mutex_destroy(&sched->lock);
+  free(sched);
+
+  return err;
+}
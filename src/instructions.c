@@ -1,144 +1,179 @@
 #include "svm/instructions.h"
 
+#include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+
+typedef struct {
+  const char *name;
+  const char *mnemonic;
+  svm_operand_kind_t operand;
+  int pops;
+  int pushes;
+} instruction_info_t;
+
+#define INSTRUCTION_INFO(name, mnemonic, operand, pops, pushes) \
+  [SVM_INST_##name] = {"SVM_INST_" #name, mnemonic, SVM_OPERAND_##operand, pops, pushes},
+static const instruction_info_t instructions[SVM_INST_TYPE_COUNT] = {
+  SVM_INSTRUCTIONS(INSTRUCTION_INFO)
+};
+#undef INSTRUCTION_INFO
+
+static const instruction_info_t *info(svm_instruction_type_t inst_type)
+{
+  return (uint64_t)inst_type < SVM_INST_TYPE_COUNT ? &instructions[inst_type] : NULL;
+}
 
 const char *svm_instruction_type_to_string(svm_instruction_type_t inst_type)
 {
-  switch (inst_type) {
-    case SVM_INST_NOP: return "SVM_INST_NOP";
-    case SVM_INST_HALT: return "SVM_INST_HALT";
-
-    case SVM_INST_PUSH: return "SVM_INST_PUSH";
-    case SVM_INST_POP: return "SVM_INST_POP";
-    case SVM_INST_COPY: return "SVM_INST_COPY";
-    case SVM_INST_SWAP: return "SVM_INST_SWAP";
-
-    case SVM_INST_ADD_I: return "SVM_INST_ADD_I";
-    case SVM_INST_SUB_I: return "SVM_INST_SUB_I";
-    case SVM_INST_MULT_I: return "SVM_INST_MULT_I";
-    case SVM_INST_DIV_I: return "SVM_INST_DIV_I";
-
-    case SVM_INST_ADD_U: return "SVM_INST_ADD_U";
-    case SVM_INST_SUB_U: return "SVM_INST_SUB_U";
-    case SVM_INST_MULT_U: return "SVM_INST_MULT_U";
-    case SVM_INST_DIV_U: return "SVM_INST_DIV_U";
-
-    case SVM_INST_ADD_F: return "SVM_INST_ADD_F";
-    case SVM_INST_SUB_F: return "SVM_INST_SUB_F";
-    case SVM_INST_MULT_F: return "SVM_INST_MULT_F";
-    case SVM_INST_DIV_F: return "SVM_INST_DIV_F";
-
-    case SVM_INST_EQ: return "SVM_INST_EQ";
-    case SVM_INST_NOT_EQ: return "SVM_INST_NOT_EQ";
-
-    case SVM_INST_GT_I: return "SVM_INST_GT_I";
-    case SVM_INST_GT_EQ_I: return "SVM_INST_GT_EQ_I";
-    case SVM_INST_LT_I: return "SVM_INST_LT_I";
-    case SVM_INST_LT_EQ_I: return "SVM_INST_LT_EQ_I";
-
-    case SVM_INST_GT_U: return "SVM_INST_GT_U";
-    case SVM_INST_GT_EQ_U: return "SVM_INST_GT_EQ_U";
-    case SVM_INST_LT_U: return "SVM_INST_LT_U";
-    case SVM_INST_LT_EQ_U: return "SVM_INST_LT_EQ_U";
-
-    case SVM_INST_GT_F: return "SVM_INST_GT_F";
-    case SVM_INST_GT_EQ_F: return "SVM_INST_GT_EQ_F";
-    case SVM_INST_LT_F: return "SVM_INST_LT_F";
-    case SVM_INST_LT_EQ_F: return "SVM_INST_LT_EQ_F";
-
-    case SVM_INST_JMP: return "SVM_INST_JMP";
-    case SVM_INST_JNZ: return "SVM_INST_JNZ";
-
-    case SVM_INST_CALL: return "SVM_INST_CALL";
-    case SVM_INST_RET: return "SVM_INST_RET";
-
-    case SVM_INST_ALLOC: return "SVM_INST_ALLOC";
-    case SVM_INST_FREE: return "SVM_INST_FREE";
-    case SVM_INST_READ: return "SVM_INST_READ";
-    case SVM_INST_WRITE: return "SVM_INST_WRITE";
-    default:
-      return "Unknown instruction type.";
-  }
+  const instruction_info_t *inst = info(inst_type);
+  return inst != NULL ? inst->name : "Unknown instruction type.";
 }
 
-bool svm_instruction_type_needs_operand(svm_instruction_type_t inst_type)
+const char *svm_instruction_type_mnemonic(svm_instruction_type_t inst_type)
 {
-  // Using if instead of switch because we have -Wswitch-enum on.
-  if (inst_type == SVM_INST_PUSH) return true;
-  if (inst_type == SVM_INST_COPY) return true;
-  if (inst_type == SVM_INST_SWAP) return true;
-  if (inst_type == SVM_INST_JMP) return true;
-  if (inst_type == SVM_INST_JNZ) return true;
-  if (inst_type == SVM_INST_CALL) return true;
-  if (inst_type == SVM_INST_ALLOC) return true;
+  const instruction_info_t *inst = info(inst_type);
+  return inst != NULL ? inst->mnemonic : NULL;
+}
 
-  return false;
+svm_operand_kind_t svm_instruction_type_operand(svm_instruction_type_t inst_type)
+{
+  const instruction_info_t *inst = info(inst_type);
+  return inst != NULL ? inst->operand : SVM_OPERAND_NONE;
+}
+
+bool svm_instruction_type_needs_operand(svm_instruction_type_t inst_type)
+{
+  return svm_instruction_type_operand(inst_type) != SVM_OPERAND_NONE;
 }
 
 bool svm_instruction_type_needs_label_operand(svm_instruction_type_t inst_type)
 {
-  // Using if instead of switch because we have -Wswitch-enum on.
-  if (inst_type == SVM_INST_JMP) return true;
-  if (inst_type == SVM_INST_JNZ) return true;
-  if (inst_type == SVM_INST_CALL) return true;
+  return svm_instruction_type_operand(inst_type) == SVM_OPERAND_LABEL;
+}
 
-  return false;
+bool svm_instruction_type_stack_effect(svm_instruction_type_t inst_type, uint64_t *pops, uint64_t *pushes)
+{
+  const instruction_info_t *inst = info(inst_type);
+  if (inst == NULL || inst->pops == SVM_STACK_VARIES || inst->pushes == SVM_STACK_VARIES) {
+    return false;
+  }
+  *pops = inst->pops;
+  *pushes = inst->pushes;
+  return true;
+}
+
+/*
+ * Mnemonics are looked up in a hash table of MNEMONIC_SLOTS opcodes, filled in from SVM_INSTRUCTIONS the first time
+ * it's needed. MNEMONIC_SEED is picked so that every mnemonic gets a slot of its own, making a lookup one hash and one
+ * strcmp. A new mnemonic that does collide still works, it just takes the next free slot.
+ */
+#define MNEMONIC_SLOTS 256
+#define MNEMONIC_SEED 483828u
+
+_Static_assert(SVM_INST_TYPE_COUNT <= UINT8_MAX, "Opcodes must fit in a byte, with UINT8_MAX left for empty slots.");
+
+static uint8_t mnemonic_slots[MNEMONIC_SLOTS];
+static pthread_once_t mnemonic_once = PTHREAD_ONCE_INIT;
+
+static uint32_t mnemonic_hash(const char *str)
+{
+  // FNV-1a, with the high bits folded into the low ones that pick the slot.
+  uint32_t hash = MNEMONIC_SEED;
+  for (; *str != '\0'; str++) {
+    hash = (hash ^ (uint8_t)*str) * 16777619u;
+  }
+  return (hash ^ (hash >> 16)) & (MNEMONIC_SLOTS - 1);
+}
+
+static void mnemonic_init(void)
+{
+  memset(mnemonic_slots, UINT8_MAX, sizeof(mnemonic_slots));
+  for (uint64_t type = 0; type < SVM_INST_TYPE_COUNT; type++) {
+    if (instructions[type].mnemonic == NULL) {
+      continue;
+    }
+    uint32_t slot = mnemonic_hash(instructions[type].mnemonic);
+    while (mnemonic_slots[slot] != UINT8_MAX) {
+      slot = (slot + 1) & (MNEMONIC_SLOTS - 1);
+    }
+    mnemonic_slots[slot] = type;
+  }
 }
 
 bool svm_instruction_type_from_string(const char *str, svm_instruction_type_t *inst_type)
 {
-  if (strncmp(str, "nop", 3) == 0) { *inst_type = SVM_INST_NOP; return true; }
-  if (strncmp(str, "halt", 4) == 0) { *inst_type = SVM_INST_HALT; return true; }
-
-  if (strncmp(str, "push", 4) == 0) { *inst_type = SVM_INST_PUSH; return true; }
-  if (strncmp(str, "pop", 3) == 0) { *inst_type = SVM_INST_POP; return true; }
-  if (strncmp(str, "copy", 4) == 0) { *inst_type = SVM_INST_COPY; return true; }
-  if (strncmp(str, "swap", 4) == 0) { *inst_type = SVM_INST_SWAP; return true; }
-
-  if (strncmp(str, "addi", 4) == 0) { *inst_type = SVM_INST_ADD_I; return true; }
-  if (strncmp(str, "subi", 4) == 0) { *inst_type = SVM_INST_SUB_I; return true; }
-  if (strncmp(str, "multi", 5) == 0) { *inst_type = SVM_INST_MULT_I; return true; }
-  if (strncmp(str, "divi", 4) == 0) { *inst_type = SVM_INST_DIV_I; return true; }
-
-  if (strncmp(str, "addu", 4) == 0) { *inst_type = SVM_INST_ADD_U; return true; }
-  if (strncmp(str, "subu", 4) == 0) { *inst_type = SVM_INST_SUB_U; return true; }
-  if (strncmp(str, "multu", 5) == 0) { *inst_type = SVM_INST_MULT_U; return true; }
-  if (strncmp(str, "divu", 4) == 0) { *inst_type = SVM_INST_DIV_U; return true; }
-
-  if (strncmp(str, "addf", 4) == 0) { *inst_type = SVM_INST_ADD_F; return true; }
-  if (strncmp(str, "subf", 4) == 0) { *inst_type = SVM_INST_SUB_F; return true; }
-  if (strncmp(str, "multf", 5) == 0) { *inst_type = SVM_INST_MULT_F; return true; }
-  if (strncmp(str, "divf", 4) == 0) { *inst_type = SVM_INST_DIV_F; return true; }
-
-  if (strncmp(str, "eq", 2) == 0) { *inst_type = SVM_INST_EQ; return true; }
-  if (strncmp(str, "neq", 3) == 0) { *inst_type = SVM_INST_NOT_EQ; return true; }
-
-  if (strncmp(str, "gti", 3) == 0) { *inst_type = SVM_INST_GT_I; return true; }
-  if (strncmp(str, "gtei", 4) == 0) { *inst_type = SVM_INST_GT_EQ_I; return true; }
-  if (strncmp(str, "lti", 3) == 0) { *inst_type = SVM_INST_LT_I; return true; }
-  if (strncmp(str, "ltei", 4) == 0) { *inst_type = SVM_INST_LT_EQ_I; return true; }
-
-  if (strncmp(str, "gtu", 3) == 0) { *inst_type = SVM_INST_GT_U; return true; }
-  if (strncmp(str, "gteu", 4) == 0) { *inst_type = SVM_INST_GT_EQ_U; return true; }
-  if (strncmp(str, "ltu", 3) == 0) { *inst_type = SVM_INST_LT_U; return true; }
-  if (strncmp(str, "lteu", 4) == 0) { *inst_type = SVM_INST_LT_EQ_U; return true; }
-
-  if (strncmp(str, "gtf", 3) == 0) { *inst_type = SVM_INST_GT_F; return true; }
-  if (strncmp(str, "gtef", 4) == 0) { *inst_type = SVM_INST_GT_EQ_F; return true; }
-  if (strncmp(str, "ltf", 3) == 0) { *inst_type = SVM_INST_LT_F; return true; }
-  if (strncmp(str, "ltef", 4) == 0) { *inst_type = SVM_INST_LT_EQ_F; return true; }
-
-  if (strncmp(str, "jmp", 3) == 0) { *inst_type = SVM_INST_JMP; return true; }
-  if (strncmp(str, "jnz", 3) == 0) { *inst_type = SVM_INST_JNZ; return true; }
-
-  if (strncmp(str, "call", 4) == 0) { *inst_type = SVM_INST_CALL; return true; }
-  if (strncmp(str, "ret", 3) == 0) { *inst_type = SVM_INST_RET; return true; }
-
-  if (strncmp(str, "alloc", 5) == 0) { *inst_type = SVM_INST_ALLOC; return true; }
-  if (strncmp(str, "free", 4) == 0) { *inst_type = SVM_INST_FREE; return true; }
-  if (strncmp(str, "read", 4) == 0) { *inst_type = SVM_INST_READ; return true; }
-  if (strncmp(str, "write", 5) == 0) { *inst_type = SVM_INST_WRITE; return true; }
+  pthread_once(&mnemonic_once, mnemonic_init);
+  for (uint32_t slot = mnemonic_hash(str);; slot = (slot + 1) & (MNEMONIC_SLOTS - 1)) {
+    uint8_t type = mnemonic_slots[slot];
+    if (type == UINT8_MAX) {
+      return false;
+    }
+    if (strcmp(instructions[type].mnemonic, str) == 0) {
+      *inst_type = type;
+      return true;
+    }
+  }
+}
+
+static const svm_instruction_type_t immediate_forms[][2] = {
+  {SVM_INST_ADD_I, SVM_INST_ADD_I_IMM},
+  {SVM_INST_SUB_I, SVM_INST_SUB_I_IMM},
+  {SVM_INST_MULT_I, SVM_INST_MULT_I_IMM},
+  {SVM_INST_DIV_I, SVM_INST_DIV_I_IMM},
+  {SVM_INST_ADD_U, SVM_INST_ADD_U_IMM},
+  {SVM_INST_SUB_U, SVM_INST_SUB_U_IMM},
+  {SVM_INST_MULT_U, SVM_INST_MULT_U_IMM},
+  {SVM_INST_DIV_U, SVM_INST_DIV_U_IMM},
+  {SVM_INST_ADD_F, SVM_INST_ADD_F_IMM},
+  {SVM_INST_SUB_F, SVM_INST_SUB_F_IMM},
+  {SVM_INST_MULT_F, SVM_INST_MULT_F_IMM},
+  {SVM_INST_DIV_F, SVM_INST_DIV_F_IMM},
+  {SVM_INST_EQ, SVM_INST_EQ_IMM},
+  {SVM_INST_NOT_EQ, SVM_INST_NOT_EQ_IMM},
+  {SVM_INST_GT_I, SVM_INST_GT_I_IMM},
+  {SVM_INST_GT_EQ_I, SVM_INST_GT_EQ_I_IMM},
+  {SVM_INST_LT_I, SVM_INST_LT_I_IMM},
+  {SVM_INST_LT_EQ_I, SVM_INST_LT_EQ_I_IMM},
+  {SVM_INST_GT_U, SVM_INST_GT_U_IMM},
+  {SVM_INST_GT_EQ_U, SVM_INST_GT_EQ_U_IMM},
+  {SVM_INST_LT_U, SVM_INST_LT_U_IMM},
+  {SVM_INST_LT_EQ_U, SVM_INST_LT_EQ_U_IMM},
+  {SVM_INST_GT_F, SVM_INST_GT_F_IMM},
+  {SVM_INST_GT_EQ_F, SVM_INST_GT_EQ_F_IMM},
+  {SVM_INST_LT_F, SVM_INST_LT_F_IMM},
+  {SVM_INST_LT_EQ_F, SVM_INST_LT_EQ_F_IMM},
+  {SVM_INST_AND, SVM_INST_AND_IMM},
+  {SVM_INST_OR, SVM_INST_OR_IMM},
+  {SVM_INST_XOR, SVM_INST_XOR_IMM},
+  {SVM_INST_SHL, SVM_INST_SHL_IMM},
+  {SVM_INST_SHR, SVM_INST_SHR_IMM},
+  {SVM_INST_SAR, SVM_INST_SAR_IMM},
+  {SVM_INST_MOD_I, SVM_INST_MOD_I_IMM},
+  {SVM_INST_MOD_U, SVM_INST_MOD_U_IMM},
+  {SVM_INST_MULH_I, SVM_INST_MULH_I_IMM},
+  {SVM_INST_MULH_U, SVM_INST_MULH_U_IMM},
+};
+
+bool svm_instruction_type_to_immediate(svm_instruction_type_t inst_type, svm_instruction_type_t *imm_type)
+{
+  for (size_t i = 0; i < sizeof(immediate_forms) / sizeof(immediate_forms[0]); i++) {
+    if (immediate_forms[i][0] == inst_type) {
+      *imm_type = immediate_forms[i][1];
+      return true;
+    }
+  }
+  return false;
+}
 
+bool svm_instruction_type_from_immediate(svm_instruction_type_t imm_type, svm_instruction_type_t *inst_type)
+{
+  for (size_t i = 0; i < sizeof(immediate_forms) / sizeof(immediate_forms[0]); i++) {
+    if (immediate_forms[i][1] == imm_type) {
+      *inst_type = immediate_forms[i][0];
+      return true;
+    }
+  }
   return false;
 }
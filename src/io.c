@@ -0,0 +1,416 @@
+#include "svm/io.h"
+#include "svm/svm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Reading and writing the current position of the file needs IORING_OP_READ and IORING_FEAT_RW_CUR_POS, which came
+// together in 5.6. Older headers get the blocking requests only.
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(SYS_io_uring_setup)
+#define SVM_IO_URING 1
+#else
+#define SVM_IO_URING 0
+#endif
+
+static bool valid_handle(const svm_io_t *io, uint64_t handle)
+{
+  return handle < SVM_IO_MAX_FILES && io->files[handle].fd >= 0;
+}
+
+// Write all of buf, as write may take only part of it.
+static int64_t write_all(svm_io_t *io, int fd, const uint8_t *buf, uint64_t size)
+{
+  uint64_t written = 0;
+  while (written < size) {
+    io->syscalls++;
+    ssize_t n = write(fd, buf + written, size - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    written += n;
+  }
+  io->bytes_written += written;
+  return written;
+}
+
+static int64_t flush_file(svm_io_t *io, svm_io_file_t *file)
+{
+  int64_t result = write_all(io, file->fd, file->buffer, file->buffered);
+  file->buffered = 0;
+  return result < 0 ? result : 0;
+}
+
+// Do a request on the spot, as a single read or write like io_uring does.
+static int64_t blocking_request(svm_io_t *io, uint64_t op, int fd, void *buf, uint64_t size)
+{
+  ssize_t n;
+  do {
+    io->syscalls++;
+    n = op == SVM_IO_OP_READ ? read(fd, buf, size) : write(fd, buf, size);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return -errno;
+  }
+  if (op == SVM_IO_OP_READ) {
+    io->bytes_read += n;
+  } else {
+    io->bytes_written += n;
+  }
+  return n;
+}
+
+#if SVM_IO_URING
+
+static void uring_init(svm_io_t *io)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(SYS_io_uring_setup, SVM_IO_MAX_REQUESTS, &params);
+  if (fd < 0) {
+    return;
+  }
+  // One mapping for both rings keeps this simple, and every kernel with RW_CUR_POS has SINGLE_MMAP.
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd);
+    return;
+  }
+
+  uint64_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  uint64_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  io->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  io->ring = mmap(NULL, io->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (io->ring == MAP_FAILED) {
+    io->ring = NULL;
+    close(fd);
+    return;
+  }
+  io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED) {
+    io->sqes = NULL;
+    munmap(io->ring, io->ring_size);
+    io->ring = NULL;
+    close(fd);
+    return;
+  }
+
+  uint8_t *ring = io->ring;
+  io->sq_tail = (uint32_t *)(ring + params.sq_off.tail);
+  io->sq_mask = (uint32_t *)(ring + params.sq_off.ring_mask);
+  io->sq_array = (uint32_t *)(ring + params.sq_off.array);
+  io->cq_head = (uint32_t *)(ring + params.cq_off.head);
+  io->cq_tail = (uint32_t *)(ring + params.cq_off.tail);
+  io->cq_mask = (uint32_t *)(ring + params.cq_off.ring_mask);
+  io->cqes = ring + params.cq_off.cqes;
+  io->ring_fd = fd;
+}
+
+static void uring_free(svm_io_t *io)
+{
+  munmap(io->sqes, io->sqes_size);
+  munmap(io->ring, io->ring_size);
+  close(io->ring_fd);
+}
+
+// Hand the queued requests to the kernel and, if wait is set, wait for at least one of them to complete.
+static int64_t uring_enter(svm_io_t *io, bool wait)
+{
+  int ret;
+  do {
+    io->syscalls++;
+    ret = syscall(SYS_io_uring_enter, io->ring_fd, io->unsubmitted, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                  NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    return -errno;
+  }
+  io->unsubmitted -= ret;
+  return 0;
+}
+
+static void uring_reap(svm_io_t *io)
+{
+  uint32_t head = *io->cq_head;
+  uint32_t tail = atomic_load_explicit((_Atomic uint32_t *)io->cq_tail, memory_order_acquire);
+  struct io_uring_cqe *cqes = io->cqes;
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &cqes[head & *io->cq_mask];
+    svm_io_request_t *request = &io->requests[cqe->user_data];
+    request->result = cqe->res;
+    if (cqe->res > 0 && request->op == SVM_IO_OP_READ) {
+      io->bytes_read += cqe->res;
+    } else if (cqe->res > 0) {
+      io->bytes_written += cqe->res;
+    }
+    request->done = true;
+    io->in_flight--;
+  }
+  atomic_store_explicit((_Atomic uint32_t *)io->cq_head, head, memory_order_release);
+}
+
+static void uring_submit(svm_io_t *io, uint64_t id, uint64_t op, int fd, void *buf, uint64_t size)
+{
+  uint32_t tail = *io->sq_tail;
+  uint32_t index = tail & *io->sq_mask;
+  struct io_uring_sqe *sqe = &((struct io_uring_sqe *)io->sqes)[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op == SVM_IO_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  // Longer requests are done in part, like a short read or write.
+  sqe->len = size < UINT32_MAX ? size : UINT32_MAX;
+  // At the current position of the file, which the request moves on.
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = id;
+  io->sq_array[index] = index;
+  atomic_store_explicit((_Atomic uint32_t *)io->sq_tail, tail + 1, memory_order_release);
+  io->unsubmitted++;
+  io->in_flight++;
+  // If the kernel is busy, the request stays queued and goes in with the next one or when it is waited for.
+  uring_enter(io, false);
+}
+
+#endif // SVM_IO_URING
+
+void svm_io_init(svm_io_t *io, svm_t *svm, bool uring)
+{
+  memset(io, 0, sizeof(*io));
+  for (uint64_t i = 0; i < SVM_IO_MAX_FILES; i++) {
+    io->files[i].fd = i <= STDERR_FILENO ? (int)i : -1;
+  }
+  io->ring_fd = -1;
+#if SVM_IO_URING
+  if (uring) {
+    uring_init(io);
+  }
+#else
+  (void)uring;
+#endif
+  svm->io = io;
+}
+
+void svm_io_free(svm_io_t *io)
+{
+  svm_io_drain(io);
+  for (uint64_t i = 0; i < SVM_IO_MAX_FILES; i++) {
+    if (valid_handle(io, i)) {
+      svm_io_close(io, i);
+    }
+  }
+#if SVM_IO_URING
+  if (io->ring_fd >= 0) {
+    uring_free(io);
+  }
+#endif
+}
+
+bool svm_io_uses_uring(const svm_io_t *io)
+{
+  return io->ring_fd >= 0;
+}
+
+void svm_io_print(const svm_io_t *io, FILE *out)
+{
+  fprintf(out, "I/O: %lu bytes read, %lu bytes written, %lu system calls, %s\n", io->bytes_read, io->bytes_written,
+          io->syscalls, svm_io_uses_uring(io) ? "io_uring" : "blocking");
+}
+
+int64_t svm_io_open(svm_io_t *io, const char *path, uint64_t max_path, uint64_t mode)
+{
+  int flags;
+  // Using if instead of switch because we have -Wswitch-enum on.
+  if (mode == SVM_IO_OPEN_READ) {
+    flags = O_RDONLY;
+  } else if (mode == SVM_IO_OPEN_WRITE) {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  } else if (mode == SVM_IO_OPEN_APPEND) {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+  } else {
+    return -EINVAL;
+  }
+  uint64_t limit = max_path < PATH_MAX ? max_path : PATH_MAX;
+  if (strnlen(path, limit) == limit) {
+    return -ENAMETOOLONG;
+  }
+
+  uint64_t handle = STDERR_FILENO + 1;
+  while (handle < SVM_IO_MAX_FILES && io->files[handle].fd >= 0) {
+    handle++;
+  }
+  if (handle == SVM_IO_MAX_FILES) {
+    return -EMFILE;
+  }
+  io->syscalls++;
+  int fd = open(path, flags | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return -errno;
+  }
+  io->files[handle].fd = fd;
+  io->files[handle].buffered = 0;
+  return handle;
+}
+
+int64_t svm_io_close(svm_io_t *io, uint64_t handle)
+{
+  if (!valid_handle(io, handle)) {
+    return -EBADF;
+  }
+  // A request in flight may still be using the file.
+  svm_io_drain(io);
+  svm_io_file_t *file = &io->files[handle];
+  int64_t result = flush_file(io, file);
+  free(file->buffer);
+  file->buffer = NULL;
+  // stdin, stdout and stderr belong to the host, the program only loses its handles to them.
+  if (handle > STDERR_FILENO) {
+    io->syscalls++;
+    if (close(file->fd) < 0 && result == 0) {
+      result = -errno;
+    }
+  }
+  file->fd = -1;
+  return result;
+}
+
+int64_t svm_io_read(svm_io_t *io, uint64_t handle, void *buf, uint64_t size)
+{
+  if (!valid_handle(io, handle)) {
+    return -EBADF;
+  }
+  return blocking_request(io, SVM_IO_OP_READ, io->files[handle].fd, buf, size);
+}
+
+int64_t svm_io_write(svm_io_t *io, uint64_t handle, const void *buf, uint64_t size)
+{
+  if (!valid_handle(io, handle)) {
+    return -EBADF;
+  }
+  svm_io_file_t *file = &io->files[handle];
+  if (file->buffered + size > SVM_IO_BUFFER_SIZE) {
+    int64_t result = flush_file(io, file);
+    if (result < 0) {
+      return result;
+    }
+  }
+  // Anything too big for the buffer goes straight to the file.
+  if (size >= SVM_IO_BUFFER_SIZE) {
+    return write_all(io, file->fd, buf, size);
+  }
+  if (file->buffer == NULL) {
+    file->buffer = malloc(SVM_IO_BUFFER_SIZE);
+    if (file->buffer == NULL) {
+      return -ENOMEM;
+    }
+  }
+  memcpy(file->buffer + file->buffered, buf, size);
+  file->buffered += size;
+  return size;
+}
+
+int64_t svm_io_flush(svm_io_t *io, uint64_t handle)
+{
+  if (!valid_handle(io, handle)) {
+    return -EBADF;
+  }
+  return flush_file(io, &io->files[handle]);
+}
+
+int64_t svm_io_submit(svm_io_t *io, uint64_t op, uint64_t handle, void *buf, uint64_t size)
+{
+  if (op != SVM_IO_OP_READ && op != SVM_IO_OP_WRITE) {
+    return -EINVAL;
+  }
+  if (!valid_handle(io, handle)) {
+    return -EBADF;
+  }
+  uint64_t id = 0;
+  while (id < SVM_IO_MAX_REQUESTS && io->requests[id].used) {
+    id++;
+  }
+  if (id == SVM_IO_MAX_REQUESTS) {
+    return -EAGAIN;
+  }
+  svm_io_file_t *file = &io->files[handle];
+  // What io_write buffered comes first.
+  if (op == SVM_IO_OP_WRITE && file->buffered > 0) {
+    int64_t result = flush_file(io, file);
+    if (result < 0) {
+      return result;
+    }
+  }
+
+  svm_io_request_t *request = &io->requests[id];
+  request->used = true;
+  request->done = false;
+  request->op = op;
+#if SVM_IO_URING
+  if (io->ring_fd >= 0) {
+    uring_submit(io, id, op, file->fd, buf, size);
+    return id;
+  }
+#endif
+  request->result = blocking_request(io, op, file->fd, buf, size);
+  request->done = true;
+  return id;
+}
+
+int64_t svm_io_wait(svm_io_t *io, uint64_t id)
+{
+  if (id >= SVM_IO_MAX_REQUESTS || !io->requests[id].used) {
+    return -EINVAL;
+  }
+  svm_io_request_t *request = &io->requests[id];
+#if SVM_IO_URING
+  while (!request->done) {
+    uring_reap(io);
+    if (!request->done) {
+      int64_t result = uring_enter(io, true);
+      if (result < 0 && result != -EBUSY && result != -EAGAIN) {
+        return result;
+      }
+    }
+  }
+#endif
+  request->used = false;
+  return request->result;
+}
+
+void svm_io_drain(svm_io_t *io)
+{
+#if SVM_IO_URING
+  while (io->in_flight > 0) {
+    uring_reap(io);
+    if (io->in_flight == 0) {
+      break;
+    }
+    int64_t result = uring_enter(io, true);
+    if (result < 0 && result != -EBUSY && result != -EAGAIN) {
+      break;
+    }
+  }
+#else
+  (void)io;
+#endif
+}
+
+void svm_io_reset(svm_io_t *io)
+{
+  svm_io_drain(io);
+  for (uint64_t i = 0; i < SVM_IO_MAX_REQUESTS; i++) {
+    io->requests[i].used = false;
+  }
+}
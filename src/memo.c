@@ -0,0 +1,150 @@
+#include "svm/memo.h"
+#include "svm/svm.h"
+#include "svm/value.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+bool svm_memo_init(svm_memo_t *memo, uint64_t capacity)
+{
+  memset(memo, 0, sizeof(*memo));
+  memo->num_sets = 1;
+  while (memo->num_sets * SVM_MEMO_WAYS < capacity) {
+    memo->num_sets *= 2;
+  }
+  memo->entries = calloc(memo->num_sets * SVM_MEMO_WAYS, sizeof(*memo->entries));
+  memo->hands = calloc(memo->num_sets, sizeof(*memo->hands));
+  memo->pending = malloc(SVM_CALL_STACK_SIZE * sizeof(*memo->pending));
+  if (memo->entries == NULL || memo->hands == NULL || memo->pending == NULL) {
+    svm_memo_free(memo);
+    return false;
+  }
+  return true;
+}
+
+void svm_memo_free(svm_memo_t *memo)
+{
+  free(memo->entries);
+  free(memo->hands);
+  free(memo->pending);
+  memo->entries = NULL;
+  memo->hands = NULL;
+  memo->pending = NULL;
+}
+
+void svm_memo_print(const svm_memo_t *memo, FILE *out)
+{
+  uint64_t lookups = memo->hits + memo->misses;
+  fprintf(out, "Memo: %lu hits, %lu misses (%.1f%% hits), %lu evictions\n", memo->hits, memo->misses,
+          lookups > 0 ? 100.0 * memo->hits / lookups : 0.0, memo->evictions);
+}
+
+static uint64_t key_hash(uint64_t entry, const svm_value_t *args, uint64_t num_args)
+{
+  // FNV-1a over whole values.
+  uint64_t hash = 14695981039346656037ull;
+  hash = (hash ^ entry) * 1099511628211ull;
+  for (uint64_t i = 0; i < num_args; i++) {
+    hash = (hash ^ args[i].as_u64) * 1099511628211ull;
+  }
+  // The low bits pick the set, so fold the high bits into them.
+  return hash ^ (hash >> 32);
+}
+
+static svm_memo_entry_t *find_set(svm_memo_t *memo, uint64_t entry, const svm_value_t *args, uint64_t num_args,
+                                  uint64_t *set)
+{
+  *set = key_hash(entry, args, num_args) & (memo->num_sets - 1);
+  return &memo->entries[*set * SVM_MEMO_WAYS];
+}
+
+// Forget calls whose frames are gone without having returned, e.g. because the program halted inside them.
+static void drop_stale(svm_memo_t *memo, uint64_t depth)
+{
+  while (memo->num_pending > 0 && memo->pending[memo->num_pending - 1].depth > depth) {
+    memo->num_pending--;
+  }
+}
+
+bool svm_memo_enter(svm_memo_t *memo, svm_t *svm, uint64_t entry, uint64_t num_args)
+{
+  // Only a called function with arguments that fit can be cached.
+  if (svm->call_stack_ptr == 0 || num_args > SVM_MEMO_MAX_ARGS || num_args > svm->stack_ptr) {
+    return false;
+  }
+  const svm_value_t *args = &svm->stack[svm->stack_ptr - num_args];
+
+  uint64_t set;
+  svm_memo_entry_t *ways = find_set(memo, entry, args, num_args, &set);
+  for (uint64_t w = 0; w < SVM_MEMO_WAYS; w++) {
+    svm_memo_entry_t *cached = &ways[w];
+    if (!cached->used || cached->entry != entry || cached->num_args != num_args ||
+        memcmp(cached->args, args, num_args * sizeof(*args)) != 0) {
+      continue;
+    }
+    uint64_t base = svm->stack_ptr - num_args;
+    if (base + cached->num_results > svm->stack_limit) {
+      break;
+    }
+    cached->referenced = true;
+    memo->hits++;
+    memcpy(&svm->stack[base], cached->results, cached->num_results * sizeof(*cached->results));
+    svm->stack_ptr = base + cached->num_results;
+    svm->ip = svm->call_stack[--svm->call_stack_ptr];
+    return true;
+  }
+
+  memo->misses++;
+  drop_stale(memo, svm->call_stack_ptr - 1);
+  svm_memo_call_t *call = &memo->pending[memo->num_pending++];
+  call->depth = svm->call_stack_ptr;
+  call->base = svm->stack_ptr - num_args;
+  call->entry = entry;
+  call->num_args = num_args;
+  memcpy(call->args, args, num_args * sizeof(*args));
+  return false;
+}
+
+void svm_memo_leave(svm_memo_t *memo, svm_t *svm)
+{
+  drop_stale(memo, svm->call_stack_ptr);
+  if (memo->num_pending == 0 || memo->pending[memo->num_pending - 1].depth != svm->call_stack_ptr) {
+    return;
+  }
+  svm_memo_call_t *call = &memo->pending[--memo->num_pending];
+  // A function that pops more than its arguments or leaves too much behind can't be replayed from the cache.
+  if (svm->stack_ptr < call->base || svm->stack_ptr - call->base > SVM_MEMO_MAX_RESULTS) {
+    return;
+  }
+
+  uint64_t set;
+  svm_memo_entry_t *ways = find_set(memo, call->entry, call->args, call->num_args, &set);
+  svm_memo_entry_t *victim = NULL;
+  for (uint64_t w = 0; w < SVM_MEMO_WAYS; w++) {
+    if (!ways[w].used) {
+      victim = &ways[w];
+      break;
+    }
+  }
+  while (victim == NULL) {
+    svm_memo_entry_t *candidate = &ways[memo->hands[set]];
+    memo->hands[set] = (memo->hands[set] + 1) % SVM_MEMO_WAYS;
+    if (candidate->referenced) {
+      candidate->referenced = false;
+    } else {
+      victim = candidate;
+      memo->evictions++;
+    }
+  }
+
+  victim->used = true;
+  victim->referenced = false;
+  victim->entry = call->entry;
+  victim->num_args = call->num_args;
+  memcpy(victim->args, call->args, call->num_args * sizeof(*call->args));
+  victim->num_results = svm->stack_ptr - call->base;
+  memcpy(victim->results, &svm->stack[call->base], victim->num_results * sizeof(*victim->results));
+}
@@ -0,0 +1,141 @@
+#include "svm/object.h"
+#include "svm/instructions.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+bool svm_object_read(const char *file_name, svm_instruction_t *program, uint64_t max_size, uint64_t *size)
+{
+  FILE *fd;
+
+  fd = fopen(file_name, "r");
+  if (fd == NULL) {
+    fprintf(stderr, "Error: Cannot open '%s'\n", file_name);
+    return false;
+  }
+
+  uint64_t cnt = 0;
+  while (cnt < max_size) {
+    uint64_t type_value;
+    size_t num_read = fread(&type_value, 1, sizeof(type_value), fd);
+    if (num_read < 1 || type_value == SVM_OBJECT_SYMBOLS_MAGIC) {
+      break;
+    }
+    svm_instruction_type_t type = (svm_instruction_type_t)type_value;
+
+    svm_value_t operand = {0};
+    if (svm_instruction_type_needs_operand(type)) {
+      num_read = fread(&operand, 1, sizeof(operand), fd);
+      if (num_read < 1) {
+        break;
+      }
+    }
+
+    program[cnt] = (svm_instruction_t){.type = type, .operand = operand};
+    cnt++;
+  }
+  *size = cnt;
+
+  fclose(fd);
+  return true;
+}
+
+bool svm_object_decode(const uint8_t *data, uint64_t length, svm_instruction_t *program, uint64_t max_size,
+                       uint64_t *size)
+{
+  uint64_t cnt = 0;
+  uint64_t pos = 0;
+  while (pos < length) {
+    if (cnt >= max_size || length - pos < sizeof(uint64_t)) {
+      return false;
+    }
+    uint64_t type_value;
+    memcpy(&type_value, data + pos, sizeof(type_value));
+    pos += sizeof(type_value);
+    if (type_value == SVM_OBJECT_SYMBOLS_MAGIC) {
+      break;
+    }
+    svm_instruction_type_t type = (svm_instruction_type_t)type_value;
+
+    svm_value_t operand = {0};
+    if (type_value < SVM_INST_TYPE_COUNT && svm_instruction_type_needs_operand(type)) {
+      if (length - pos < sizeof(operand)) {
+        return false;
+      }
+      memcpy(&operand, data + pos, sizeof(operand));
+      pos += sizeof(operand);
+    }
+
+    program[cnt] = (svm_instruction_t){.type = type, .operand = operand};
+    cnt++;
+  }
+  *size = cnt;
+  return true;
+}
+
+bool svm_object_verify(const svm_instruction_t *program, uint64_t size)
+{
+  // One past the last entry of the jump table the instructions are in, if they are in one.
+  uint64_t table_end = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    svm_instruction_type_t type = program[i].type;
+    if ((uint64_t)type >= SVM_INST_TYPE_COUNT) {
+      return false;
+    }
+    // Besides the instructions svmasm writes, only the immediate forms svmopt makes and the entries of jump tables
+    // belong in object files. Quickened forms and breakpoints are only ever swapped in at run time.
+    svm_instruction_type_t generic;
+    if (svm_instruction_type_mnemonic(type) == NULL && !svm_instruction_type_from_immediate(type, &generic) &&
+        type != SVM_INST_JTAB_ENTRY) {
+      return false;
+    }
+    if (type == SVM_INST_JTAB_ENTRY && i >= table_end) {
+      return false;
+    }
+    if (svm_instruction_type_needs_label_operand(type) && program[i].operand.as_u64 >= size) {
+      return false;
+    }
+    if (type == SVM_INST_JTAB) {
+      uint64_t entries = program[i].operand.as_u64;
+      if (entries >= size - i - 1) {
+        return false;
+      }
+      for (uint64_t j = i + 1; j <= i + 1 + entries; j++) {
+        if (program[j].type != SVM_INST_JTAB_ENTRY) {
+          return false;
+        }
+      }
+      table_end = i + 2 + entries;
+    }
+  }
+  return true;
+}
+
+bool svm_object_write(const char *file_name, const svm_instruction_t *program, uint64_t size)
+{
+  FILE *fd = fopen(file_name, "w");
+  if (fd == NULL) {
+    fprintf(stderr, "Error: Cannot open '%s'\n", file_name);
+    return false;
+  }
+
+  for (uint64_t i = 0; i < size; i++) {
+    uint64_t type_value = (uint64_t)program[i].type;
+    if (fwrite(&type_value, sizeof(type_value), 1, fd) == 0) {
+      fclose(fd);
+      return false;
+    }
+    if (!svm_instruction_type_needs_operand(program[i].type)) {
+      continue;
+    }
+    if (fwrite(&program[i].operand.as_u64, sizeof(program[i].operand), 1, fd) == 0) {
+      fclose(fd);
+      return false;
+    }
+  }
+
+  fclose(fd);
+  return true;
+}
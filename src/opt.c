@@ -0,0 +1,840 @@
+#include "svm/opt.h"
+#include "svm/cfg.h"
+#include "svm/instructions.h"
+#include "svm/value.h"
+#include "svm/vec.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool fold_binary(svm_instruction_type_t type, svm_value_t a, svm_value_t b, svm_value_t *result)
+{
+  // Using if instead of switch because we have -Wswitch-enum on.
+  // Signed arithmetic is done on the unsigned values so that it wraps the same way it does in the VM.
+  if (type == SVM_INST_ADD_I) { *result = SVM_VALUE_U64(a.as_u64 + b.as_u64); return true; }
+  if (type == SVM_INST_SUB_I) { *result = SVM_VALUE_U64(a.as_u64 - b.as_u64); return true; }
+  if (type == SVM_INST_MULT_I) { *result = SVM_VALUE_U64(a.as_u64 * b.as_u64); return true; }
+  if (type == SVM_INST_DIV_I) {
+    // Leave the errors for the VM.
+    if (b.as_i64 == 0 || (a.as_i64 == INT64_MIN && b.as_i64 == -1)) return false;
+    *result = SVM_VALUE_I64(a.as_i64 / b.as_i64);
+    return true;
+  }
+
+  if (type == SVM_INST_ADD_U) { *result = SVM_VALUE_U64(a.as_u64 + b.as_u64); return true; }
+  if (type == SVM_INST_SUB_U) { *result = SVM_VALUE_U64(a.as_u64 - b.as_u64); return true; }
+  if (type == SVM_INST_MULT_U) { *result = SVM_VALUE_U64(a.as_u64 * b.as_u64); return true; }
+  if (type == SVM_INST_DIV_U) {
+    if (b.as_u64 == 0) return false;
+    *result = SVM_VALUE_U64(a.as_u64 / b.as_u64);
+    return true;
+  }
+
+  if (type == SVM_INST_ADD_F) { *result = SVM_VALUE_F64(a.as_f64 + b.as_f64); return true; }
+  if (type == SVM_INST_SUB_F) { *result = SVM_VALUE_F64(a.as_f64 - b.as_f64); return true; }
+  if (type == SVM_INST_MULT_F) { *result = SVM_VALUE_F64(a.as_f64 * b.as_f64); return true; }
+  if (type == SVM_INST_DIV_F) { *result = SVM_VALUE_F64(a.as_f64 / b.as_f64); return true; }
+
+  if (type == SVM_INST_EQ) { *result = SVM_VALUE_I64(a.as_u64 == b.as_u64); return true; }
+  if (type == SVM_INST_NOT_EQ) { *result = SVM_VALUE_I64(a.as_u64 != b.as_u64); return true; }
+
+  if (type == SVM_INST_GT_I) { *result = SVM_VALUE_I64(a.as_i64 > b.as_i64); return true; }
+  if (type == SVM_INST_GT_EQ_I) { *result = SVM_VALUE_I64(a.as_i64 >= b.as_i64); return true; }
+  if (type == SVM_INST_LT_I) { *result = SVM_VALUE_I64(a.as_i64 < b.as_i64); return true; }
+  if (type == SVM_INST_LT_EQ_I) { *result = SVM_VALUE_I64(a.as_i64 <= b.as_i64); return true; }
+
+  if (type == SVM_INST_GT_U) { *result = SVM_VALUE_I64(a.as_u64 > b.as_u64); return true; }
+  if (type == SVM_INST_GT_EQ_U) { *result = SVM_VALUE_I64(a.as_u64 >= b.as_u64); return true; }
+  if (type == SVM_INST_LT_U) { *result = SVM_VALUE_I64(a.as_u64 < b.as_u64); return true; }
+  if (type == SVM_INST_LT_EQ_U) { *result = SVM_VALUE_I64(a.as_u64 <= b.as_u64); return true; }
+
+  if (type == SVM_INST_GT_F) { *result = SVM_VALUE_I64(a.as_f64 > b.as_f64); return true; }
+  if (type == SVM_INST_GT_EQ_F) { *result = SVM_VALUE_I64(a.as_f64 >= b.as_f64); return true; }
+  if (type == SVM_INST_LT_F) { *result = SVM_VALUE_I64(a.as_f64 < b.as_f64); return true; }
+  if (type == SVM_INST_LT_EQ_F) { *result = SVM_VALUE_I64(a.as_f64 <= b.as_f64); return true; }
+
+  if (type == SVM_INST_AND) { *result = SVM_VALUE_U64(a.as_u64 & b.as_u64); return true; }
+  if (type == SVM_INST_OR) { *result = SVM_VALUE_U64(a.as_u64 | b.as_u64); return true; }
+  if (type == SVM_INST_XOR) { *result = SVM_VALUE_U64(a.as_u64 ^ b.as_u64); return true; }
+  if (type == SVM_INST_SHL) { *result = SVM_VALUE_U64(a.as_u64 << (b.as_u64 & 63)); return true; }
+  if (type == SVM_INST_SHR) { *result = SVM_VALUE_U64(a.as_u64 >> (b.as_u64 & 63)); return true; }
+  if (type == SVM_INST_SAR) { *result = SVM_VALUE_I64(a.as_i64 >> (b.as_u64 & 63)); return true; }
+  if (type == SVM_INST_MOD_I) {
+    if (b.as_i64 == 0 || (a.as_i64 == INT64_MIN && b.as_i64 == -1)) return false;
+    *result = SVM_VALUE_I64(a.as_i64 % b.as_i64);
+    return true;
+  }
+  if (type == SVM_INST_MOD_U) {
+    if (b.as_u64 == 0) return false;
+    *result = SVM_VALUE_U64(a.as_u64 % b.as_u64);
+    return true;
+  }
+  if (type == SVM_INST_MULH_I) { *result = SVM_VALUE_I64(svm_mulh_i64(a.as_i64, b.as_i64)); return true; }
+  if (type == SVM_INST_MULH_U) { *result = SVM_VALUE_U64(svm_mulh_u64(a.as_u64, b.as_u64)); return true; }
+
+  return false;
+}
+
+uint64_t svm_opt_fold_constants(svm_instruction_t *program, uint64_t size)
+{
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    svm_cfg_t cfg;
+    svm_cfg_build(&cfg, program, size);
+    bool *keep = malloc(size * sizeof(*keep));
+    for (uint64_t i = 0; i < size; i++) {
+      keep[i] = true;
+    }
+
+    for (uint64_t i = 0; i < size; i++) {
+      svm_instruction_t *inst = &program[i];
+      // Only look at the following instructions if nothing can jump between them.
+      svm_instruction_t *next = i + 1 < size && cfg.block_of[i + 1] == cfg.block_of[i] ? &program[i + 1] : NULL;
+      svm_instruction_t *next2 = next != NULL && i + 2 < size && cfg.block_of[i + 2] == cfg.block_of[i] ? &program[i + 2] : NULL;
+
+      if (inst->type == SVM_INST_NOP) {
+        keep[i] = false;
+        changed = true;
+        continue;
+      }
+
+      if (inst->type == SVM_INST_JMP || inst->type == SVM_INST_JNZ || inst->type == SVM_INST_JTAB_ENTRY) {
+        uint64_t target = inst->operand.as_u64;
+        // Jump straight to the end of a chain of jumps.
+        if (target < size && program[target].type == SVM_INST_JMP && program[target].operand.as_u64 != target) {
+          inst->operand = program[target].operand;
+          changed = true;
+        } else if (inst->type == SVM_INST_JMP && target == i + 1) {
+          keep[i] = false;
+          changed = true;
+        }
+        continue;
+      }
+
+      if (inst->type != SVM_INST_PUSH || next == NULL) {
+        continue;
+      }
+
+      // push a; push b; op -> push (a op b)
+      svm_value_t result;
+      if (next2 != NULL && next->type == SVM_INST_PUSH && fold_binary(next2->type, inst->operand, next->operand, &result)) {
+        inst->operand = result;
+        keep[i + 1] = false;
+        keep[i + 2] = false;
+        changed = true;
+        i += 2;
+        continue;
+      }
+
+      // push a; op b -> push (a op b)
+      svm_instruction_type_t base_type;
+      if (svm_instruction_type_from_immediate(next->type, &base_type) &&
+          fold_binary(base_type, inst->operand, next->operand, &result)) {
+        inst->operand = result;
+        keep[i + 1] = false;
+        changed = true;
+        i++;
+        continue;
+      }
+
+      // push b; op -> op b
+      svm_instruction_type_t imm_type;
+      if (svm_instruction_type_to_immediate(next->type, &imm_type)) {
+        *inst = (svm_instruction_t){.type = imm_type, .operand = inst->operand};
+        keep[i + 1] = false;
+        changed = true;
+        i++;
+        continue;
+      }
+
+      // push a; jnz label -> jmp label, or nothing if a is 0.
+      if (next->type == SVM_INST_JNZ) {
+        if (inst->operand.as_i64 != 0) {
+          *inst = (svm_instruction_t){.type = SVM_INST_JMP, .operand = next->operand};
+        } else {
+          keep[i] = false;
+        }
+        keep[i + 1] = false;
+        changed = true;
+        i++;
+        continue;
+      }
+
+      // push a; not -> push ~a
+      if (next->type == SVM_INST_NOT) {
+        inst->operand.as_u64 = ~inst->operand.as_u64;
+        keep[i + 1] = false;
+        changed = true;
+        i++;
+        continue;
+      }
+
+      // push a; jtab n -> jmp to the entry for a. The table is left for remove_unreachable.
+      if (next->type == SVM_INST_JTAB) {
+        uint64_t entry = i + 2;
+        if (inst->operand.as_u64 < next->operand.as_u64) {
+          entry += inst->operand.as_u64 + 1;
+        }
+        if (entry < size && program[entry].type == SVM_INST_JTAB_ENTRY) {
+          *inst = (svm_instruction_t){.type = SVM_INST_JMP, .operand = program[entry].operand};
+          keep[i + 1] = false;
+          changed = true;
+          i++;
+          continue;
+        }
+      }
+
+      // push a; pop -> nothing
+      if (next->type == SVM_INST_POP) {
+        keep[i] = false;
+        keep[i + 1] = false;
+        changed = true;
+        i++;
+        continue;
+      }
+
+      // push a; copy 1 -> push a; push a
+      if (next->type == SVM_INST_COPY && next->operand.as_u64 == 1) {
+        next->type = SVM_INST_PUSH;
+        next->operand = inst->operand;
+        changed = true;
+        continue;
+      }
+    }
+
+    if (changed) {
+      size = svm_program_compact(program, size, keep);
+    }
+    free(keep);
+    svm_cfg_free(&cfg);
+  }
+
+  return size;
+}
+
+uint64_t svm_opt_remove_unreachable(svm_instruction_t *program, uint64_t size)
+{
+  svm_cfg_t cfg;
+  svm_cfg_build(&cfg, program, size);
+
+  bool *keep = malloc(size * sizeof(*keep));
+  for (uint64_t i = 0; i < size; i++) {
+    keep[i] = cfg.blocks[cfg.block_of[i]].reachable;
+  }
+  size = svm_program_compact(program, size, keep);
+
+  free(keep);
+  svm_cfg_free(&cfg);
+  return size;
+}
+
+// Mark the instructions of the function starting at entry in in_body and count them. Calls are assumed to return to
+// the next instruction. Returns false if the function can run off the end of the program.
+static bool function_body(const svm_instruction_t *program, uint64_t size, uint64_t entry, bool *in_body, uint64_t *body_size)
+{
+  memset(in_body, 0, size * sizeof(*in_body));
+  *body_size = 0;
+  if (entry >= size) {
+    return false;
+  }
+
+  uint64_t *work = malloc(size * sizeof(*work));
+  uint64_t work_size = 0;
+  bool ok = true;
+  in_body[entry] = true;
+  work[work_size++] = entry;
+  while (work_size > 0 && ok) {
+    uint64_t i = work[--work_size];
+    (*body_size)++;
+
+    uint64_t succ[2];
+    uint64_t num_succ = 0;
+    svm_instruction_type_t type = program[i].type;
+    if (svm_instruction_type_falls_through(type)) {
+      succ[num_succ++] = i + 1;
+    }
+    if (type == SVM_INST_JMP || type == SVM_INST_JNZ || type == SVM_INST_JTAB_ENTRY) {
+      succ[num_succ++] = program[i].operand.as_u64;
+    }
+
+    for (uint64_t s = 0; s < num_succ; s++) {
+      if (succ[s] >= size) {
+        ok = false;
+        break;
+      }
+      if (!in_body[succ[s]]) {
+        in_body[succ[s]] = true;
+        work[work_size++] = succ[s];
+      }
+    }
+  }
+
+  free(work);
+  return ok;
+}
+
+// Check whether the function at entry can end up calling itself.
+static bool is_recursive(const svm_instruction_t *program, uint64_t size, uint64_t entry)
+{
+  bool *visited = calloc(size, sizeof(*visited));
+  bool *in_body = malloc(size * sizeof(*in_body));
+  uint64_t *work = malloc(size * sizeof(*work));
+  uint64_t work_size = 0;
+  bool recursive = false;
+
+  work[work_size++] = entry;
+  visited[entry] = true;
+  while (work_size > 0 && !recursive) {
+    uint64_t func = work[--work_size];
+    uint64_t body_size;
+    function_body(program, size, func, in_body, &body_size);
+    for (uint64_t i = 0; i < size; i++) {
+      if (!in_body[i] || program[i].type != SVM_INST_CALL || program[i].operand.as_u64 >= size) {
+        continue;
+      }
+      uint64_t callee = program[i].operand.as_u64;
+      if (callee == entry) {
+        recursive = true;
+        break;
+      }
+      if (!visited[callee]) {
+        visited[callee] = true;
+        work[work_size++] = callee;
+      }
+    }
+  }
+
+  free(work);
+  free(in_body);
+  free(visited);
+  return recursive;
+}
+
+static bool has_memo(const svm_instruction_t *program, uint64_t size, const bool *in_body)
+{
+  for (uint64_t i = 0; i < size; i++) {
+    if (in_body[i] && program[i].type == SVM_INST_MEMO) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t svm_opt_inline(svm_instruction_t *program, uint64_t size, uint64_t max_size, uint64_t budget)
+{
+  if (budget == 0 || size == 0) {
+    return size;
+  }
+
+  // bodies[entry] is set for every function that may be inlined.
+  bool **bodies = calloc(size, sizeof(*bodies));
+  uint64_t *body_sizes = calloc(size, sizeof(*body_sizes));
+  bool *checked = calloc(size, sizeof(*checked));
+  for (uint64_t i = 0; i < size; i++) {
+    if (program[i].type != SVM_INST_CALL || program[i].operand.as_u64 >= size) {
+      continue;
+    }
+    uint64_t entry = program[i].operand.as_u64;
+    if (checked[entry]) {
+      continue;
+    }
+    checked[entry] = true;
+
+    bool *in_body = malloc(size * sizeof(*in_body));
+    uint64_t body_size;
+    // Memoized functions have to stay calls, since a hit in the cache returns from the function.
+    if (function_body(program, size, entry, in_body, &body_size) && body_size <= budget && !is_recursive(program, size, entry) &&
+        !has_memo(program, size, in_body)) {
+      bodies[entry] = in_body;
+      body_sizes[entry] = body_size;
+    } else {
+      free(in_body);
+    }
+  }
+
+  // Work out where every instruction ends up, inlining call sites in order until the program is full.
+  bool *inline_site = calloc(size, sizeof(*inline_site));
+  uint64_t *new_addr = malloc((size + 1) * sizeof(*new_addr));
+  uint64_t new_size = 0;
+  uint64_t grown = size;
+  for (uint64_t i = 0; i < size; i++) {
+    new_addr[i] = new_size;
+    if (program[i].type == SVM_INST_CALL && program[i].operand.as_u64 < size && bodies[program[i].operand.as_u64] != NULL) {
+      uint64_t body_size = body_sizes[program[i].operand.as_u64];
+      if (grown + body_size - 1 <= max_size) {
+        inline_site[i] = true;
+        grown += body_size - 1;
+        new_size += body_size;
+        continue;
+      }
+    }
+    new_size++;
+  }
+  new_addr[size] = new_size;
+
+  svm_instruction_t *out = malloc(new_size * sizeof(*out));
+  uint64_t *body_addr = malloc(size * sizeof(*body_addr));
+  for (uint64_t i = 0; i < size; i++) {
+    if (!inline_site[i]) {
+      svm_instruction_t instruction = program[i];
+      if (svm_instruction_type_needs_label_operand(instruction.type)) {
+        uint64_t target = instruction.operand.as_u64;
+        instruction.operand.as_u64 = target < size ? new_addr[target] : new_size + (target - size);
+      }
+      out[new_addr[i]] = instruction;
+      continue;
+    }
+
+    // Copy the body in address order so fall throughs stay intact.
+    bool *in_body = bodies[program[i].operand.as_u64];
+    uint64_t cnt = new_addr[i];
+    for (uint64_t j = 0; j < size; j++) {
+      if (in_body[j]) {
+        body_addr[j] = cnt++;
+      }
+    }
+    for (uint64_t j = 0; j < size; j++) {
+      if (!in_body[j]) {
+        continue;
+      }
+      svm_instruction_t instruction = program[j];
+      if (instruction.type == SVM_INST_RET) {
+        instruction = (svm_instruction_t){.type = SVM_INST_JMP, .operand = SVM_VALUE_U64(new_addr[i + 1])};
+      } else if (instruction.type == SVM_INST_JMP || instruction.type == SVM_INST_JNZ ||
+                 instruction.type == SVM_INST_JTAB_ENTRY) {
+        instruction.operand.as_u64 = body_addr[instruction.operand.as_u64];
+      } else if (svm_instruction_type_needs_label_operand(instruction.type)) {
+        uint64_t target = instruction.operand.as_u64;
+        instruction.operand.as_u64 = target < size ? new_addr[target] : new_size + (target - size);
+      }
+      out[body_addr[j]] = instruction;
+    }
+  }
+  memcpy(program, out, new_size * sizeof(*out));
+
+  free(body_addr);
+  free(out);
+  free(new_addr);
+  free(inline_site);
+  for (uint64_t i = 0; i < size; i++) {
+    free(bodies[i]);
+  }
+  free(checked);
+  free(body_sizes);
+  free(bodies);
+  return new_size;
+}
+
+static bool is_power_of_two(uint64_t value)
+{
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+static uint64_t log2_u64(uint64_t value)
+{
+  uint64_t log = 0;
+  while (value > 1) {
+    value >>= 1;
+    log++;
+  }
+  return log;
+}
+
+// Find m and shift such that x / d == mulh(x, m) >> shift for every u64 x, following Granlund and Montgomery: that
+// holds if 2^(64 + shift) <= m * d <= 2^(64 + shift) + 2^shift. Returns false if there is no such m below 2^64.
+static bool unsigned_magic(uint64_t d, uint64_t *m, uint64_t *shift)
+{
+  __extension__ typedef unsigned __int128 u128;
+  for (uint64_t l = 0; l < 64; l++) {
+    u128 power = (u128)1 << (64 + l);
+    u128 candidate = (power + d - 1) / d;
+    if (candidate >> 64 != 0) {
+      break;
+    }
+    if (candidate * d - power <= ((u128)1 << l)) {
+      *m = (uint64_t)candidate;
+      *shift = l;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Write the cheaper instructions that do the same as inst to out and return how many there are, or 0 if there is
+// nothing cheaper.
+static uint64_t strength_reduce(svm_instruction_t inst, svm_instruction_t *out)
+{
+  uint64_t operand = inst.operand.as_u64;
+
+  // x * 2^k -> x << k, which wraps the same way for signed and unsigned values.
+  if ((inst.type == SVM_INST_MULT_I_IMM || inst.type == SVM_INST_MULT_U_IMM) && is_power_of_two(operand) &&
+      operand > 1) {
+    out[0] = (svm_instruction_t){.type = SVM_INST_SHL_IMM, .operand = SVM_VALUE_U64(log2_u64(operand))};
+    return 1;
+  }
+
+  if (inst.type == SVM_INST_MOD_U_IMM && is_power_of_two(operand)) {
+    out[0] = (svm_instruction_t){.type = SVM_INST_AND_IMM, .operand = SVM_VALUE_U64(operand - 1)};
+    return 1;
+  }
+
+  if (inst.type == SVM_INST_DIV_U_IMM && operand > 1) {
+    if (is_power_of_two(operand)) {
+      out[0] = (svm_instruction_t){.type = SVM_INST_SHR_IMM, .operand = SVM_VALUE_U64(log2_u64(operand))};
+      return 1;
+    }
+    uint64_t m;
+    uint64_t shift;
+    if (!unsigned_magic(operand, &m, &shift)) {
+      return 0;
+    }
+    out[0] = (svm_instruction_t){.type = SVM_INST_MULH_U_IMM, .operand = SVM_VALUE_U64(m)};
+    if (shift == 0) {
+      return 1;
+    }
+    out[1] = (svm_instruction_t){.type = SVM_INST_SHR_IMM, .operand = SVM_VALUE_U64(shift)};
+    return 2;
+  }
+
+  return 0;
+}
+
+uint64_t svm_opt_strength_reduce(svm_instruction_t *program, uint64_t size, uint64_t max_size)
+{
+  // Work out where every instruction ends up first, so that jumps can be pointed at their new targets.
+  svm_instruction_t (*replacements)[2] = malloc(size * sizeof(*replacements));
+  uint64_t *lengths = malloc(size * sizeof(*lengths));
+  uint64_t *new_addr = malloc((size + 1) * sizeof(*new_addr));
+  uint64_t new_size = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    lengths[i] = strength_reduce(program[i], replacements[i]);
+    if (lengths[i] == 0 || new_size + lengths[i] + (size - i - 1) > max_size) {
+      replacements[i][0] = program[i];
+      lengths[i] = 1;
+    }
+    new_addr[i] = new_size;
+    new_size += lengths[i];
+  }
+  new_addr[size] = new_size;
+
+  svm_instruction_t *out = malloc(new_size * sizeof(*out));
+  for (uint64_t i = 0; i < size; i++) {
+    for (uint64_t j = 0; j < lengths[i]; j++) {
+      svm_instruction_t instruction = replacements[i][j];
+      if (svm_instruction_type_needs_label_operand(instruction.type)) {
+        uint64_t target = instruction.operand.as_u64;
+        instruction.operand.as_u64 = target < size ? new_addr[target] : new_size + (target - size);
+      }
+      out[new_addr[i] + j] = instruction;
+    }
+  }
+  memcpy(program, out, new_size * sizeof(*out));
+
+  free(out);
+  free(new_addr);
+  free(lengths);
+  free(replacements);
+  return new_size;
+}
+
+#define FRAME_MAX_SITES 64
+#define FRAME_MAX_DEPTH 16
+
+// The top len slots of the stack before an instruction, as masks of the allocs of the function each value may have
+// come from. The values below them can't come from any alloc that hasn't escaped already.
+typedef struct {
+  bool reached;
+  uint8_t len;
+  uint64_t slots[FRAME_MAX_DEPTH];
+} frame_state_t;
+
+static uint64_t frame_pop(frame_state_t *state)
+{
+  if (state->len == 0) {
+    return 0;
+  }
+  uint64_t top = state->slots[0];
+  state->len--;
+  memmove(&state->slots[0], &state->slots[1], state->len * sizeof(*state->slots));
+  return top;
+}
+
+static void frame_push(frame_state_t *state, uint64_t sites, uint64_t *escaped)
+{
+  if (state->len == FRAME_MAX_DEPTH) {
+    // The deepest slot is lost track of, so whatever it points to escapes.
+    *escaped |= state->slots[FRAME_MAX_DEPTH - 1];
+    state->len--;
+  }
+  memmove(&state->slots[1], &state->slots[0], state->len * sizeof(*state->slots));
+  state->slots[0] = sites;
+  state->len++;
+}
+
+static void frame_clear(frame_state_t *state, uint64_t *escaped)
+{
+  for (uint8_t i = 0; i < state->len; i++) {
+    *escaped |= state->slots[i];
+  }
+  state->len = 0;
+}
+
+// Pop num_pops values that escape and push num_pushes values that don't point anywhere.
+static void frame_opaque(frame_state_t *state, uint64_t num_pops, uint64_t num_pushes, uint64_t *escaped)
+{
+  for (uint64_t i = 0; i < num_pops; i++) {
+    *escaped |= frame_pop(state);
+  }
+  for (uint64_t i = 0; i < num_pushes; i++) {
+    frame_push(state, 0, escaped);
+  }
+}
+
+// Apply inst to state. site is the mask of inst if it is an alloc of the function.
+static void frame_transfer(svm_instruction_t inst, uint64_t site, frame_state_t *state, uint64_t *escaped)
+{
+  svm_instruction_type_t type = inst.type;
+  uint64_t n = inst.operand.as_u64;
+  svm_instruction_type_t other_type;
+
+  // Using if instead of switch because we have -Wswitch-enum on.
+  if (type == SVM_INST_NOP || type == SVM_INST_BREAK || type == SVM_INST_JMP || type == SVM_INST_JTAB_ENTRY ||
+      type == SVM_INST_MEMO) {
+    return;
+  }
+  if (type == SVM_INST_ALLOC) {
+    frame_push(state, site, escaped);
+    return;
+  }
+  if (type == SVM_INST_PUSH || type == SVM_INST_FALLOC) {
+    frame_push(state, 0, escaped);
+    return;
+  }
+  if (type == SVM_INST_POP || type == SVM_INST_FREE || type == SVM_INST_JNZ || type == SVM_INST_JNZ_TAKEN ||
+      type == SVM_INST_JNZ_NOT_TAKEN || type == SVM_INST_JTAB) {
+    frame_pop(state);
+    return;
+  }
+  if (type == SVM_INST_COPY || type == SVM_INST_COPY_1) {
+    if (type == SVM_INST_COPY_1) {
+      n = 1;
+    }
+    frame_push(state, n >= 1 && n <= state->len ? state->slots[n - 1] : 0, escaped);
+    return;
+  }
+  if (type == SVM_INST_SWAP || type == SVM_INST_SWAP_1) {
+    if (type == SVM_INST_SWAP_1) {
+      n = 1;
+    }
+    if (state->len == 0) {
+      return;
+    }
+    uint64_t top = state->slots[0];
+    if (n >= FRAME_MAX_DEPTH) {
+      // The top goes too deep to keep track of.
+      *escaped |= top;
+      state->slots[0] = 0;
+      return;
+    }
+    // The slots below the tracked ones don't point anywhere, so tracking more of them is a matter of adding zeros.
+    while (state->len <= n) {
+      state->slots[state->len++] = 0;
+    }
+    state->slots[0] = state->slots[n];
+    state->slots[n] = top;
+    return;
+  }
+  if (type == SVM_INST_READ || type == SVM_INST_READ_CACHED) {
+    // Only values that escaped can be read back from memory.
+    frame_pop(state);
+    frame_push(state, 0, escaped);
+    return;
+  }
+  if (type == SVM_INST_WRITE) {
+    *escaped |= frame_pop(state);
+    frame_pop(state);
+    return;
+  }
+  if (type == SVM_INST_VLOAD) {
+    frame_opaque(state, 1, 0, escaped);
+    frame_pop(state);
+    frame_opaque(state, 0, SVM_VEC_LANES, escaped);
+    return;
+  }
+  if (type == SVM_INST_VSTORE) {
+    frame_opaque(state, SVM_VEC_LANES + 1, 0, escaped);
+    frame_pop(state);
+    return;
+  }
+  if (svm_instruction_type_to_immediate(type, &other_type)) {
+    // Arithmetic on an address may give another address into the same block.
+    uint64_t b = frame_pop(state);
+    uint64_t a = frame_pop(state);
+    frame_push(state, a | b, escaped);
+    return;
+  }
+  if (svm_instruction_type_from_immediate(type, &other_type) || type == SVM_INST_NOT) {
+    frame_push(state, frame_pop(state), escaped);
+    return;
+  }
+  if (type == SVM_INST_HALT || type == SVM_INST_PARFOR) {
+    // The host gets the stack after a halt, and the parfor body gets the value under the count.
+    frame_clear(state, escaped);
+    return;
+  }
+  uint64_t pops;
+  uint64_t pushes;
+  if (svm_instruction_type_stack_effect(type, &pops, &pushes)) {
+    // Anything else may keep the values it takes somewhere, and leaves new ones in their place.
+    frame_opaque(state, pops, pushes, escaped);
+    return;
+  }
+
+  // Returning, calls and everything else: anything on the stack may outlive the call.
+  frame_clear(state, escaped);
+}
+
+// Merge from into to. Returns true if to changed.
+static bool frame_merge(frame_state_t *to, const frame_state_t *from)
+{
+  if (!to->reached) {
+    *to = *from;
+    return true;
+  }
+  bool changed = false;
+  if (from->len > to->len) {
+    memset(&to->slots[to->len], 0, (from->len - to->len) * sizeof(*to->slots));
+    to->len = from->len;
+    changed = true;
+  }
+  for (uint8_t i = 0; i < from->len; i++) {
+    if ((to->slots[i] | from->slots[i]) != to->slots[i]) {
+      to->slots[i] |= from->slots[i];
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Find which allocs in the function at entry can't be used once it returns, and mark the others in escapes.
+static void frame_analyze(const svm_instruction_t *program, uint64_t size, uint64_t entry, const bool *in_body,
+                          frame_state_t *states, bool *escapes)
+{
+  // Give the first FRAME_MAX_SITES allocs a bit each.
+  uint64_t *site_of = calloc(size, sizeof(*site_of));
+  uint64_t sites[FRAME_MAX_SITES];
+  uint64_t num_sites = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    states[i].reached = false;
+    if (!in_body[i] || program[i].type != SVM_INST_ALLOC) {
+      continue;
+    }
+    if (num_sites == FRAME_MAX_SITES) {
+      escapes[i] = true;
+      continue;
+    }
+    site_of[i] = (uint64_t)1 << num_sites;
+    sites[num_sites++] = i;
+  }
+
+  uint64_t escaped = 0;
+  uint64_t *work = malloc(size * sizeof(*work));
+  bool *queued = calloc(size, sizeof(*queued));
+  uint64_t work_size = 0;
+  states[entry] = (frame_state_t){.reached = true};
+  work[work_size++] = entry;
+  queued[entry] = true;
+  while (work_size > 0) {
+    uint64_t i = work[--work_size];
+    queued[i] = false;
+    frame_state_t state = states[i];
+    frame_transfer(program[i], site_of[i], &state, &escaped);
+
+    uint64_t succ[2];
+    uint64_t num_succ = 0;
+    svm_instruction_type_t type = program[i].type;
+    if (svm_instruction_type_falls_through(type)) {
+      succ[num_succ++] = i + 1;
+    }
+    if (type == SVM_INST_JMP || type == SVM_INST_JNZ || type == SVM_INST_JTAB_ENTRY) {
+      succ[num_succ++] = program[i].operand.as_u64;
+    }
+    for (uint64_t s = 0; s < num_succ; s++) {
+      // function_body has checked that the successors are in the program.
+      if (frame_merge(&states[succ[s]], &state) && !queued[succ[s]]) {
+        queued[succ[s]] = true;
+        work[work_size++] = succ[s];
+      }
+    }
+  }
+
+  for (uint64_t s = 0; s < num_sites; s++) {
+    if (escaped & ((uint64_t)1 << s)) {
+      escapes[sites[s]] = true;
+    }
+  }
+  free(queued);
+  free(work);
+  free(site_of);
+}
+
+uint64_t svm_opt_frame_allocs(svm_instruction_t *program, uint64_t size)
+{
+  if (size == 0) {
+    return size;
+  }
+
+  bool *escapes = calloc(size, sizeof(*escapes));
+  bool *analyzed = calloc(size, sizeof(*analyzed));
+  bool *is_entry = calloc(size, sizeof(*is_entry));
+  bool *in_body = malloc(size * sizeof(*in_body));
+  frame_state_t *states = malloc(size * sizeof(*states));
+
+  // Code that runs outside of any call never returns, so its allocs stay on the heap.
+  uint64_t body_size;
+  function_body(program, size, 0, in_body, &body_size);
+  for (uint64_t i = 0; i < size; i++) {
+    escapes[i] = in_body[i];
+  }
+
+  for (uint64_t i = 0; i < size; i++) {
+    svm_instruction_type_t type = program[i].type;
+    if (type == SVM_INST_CALL || type == SVM_INST_SPAWN || type == SVM_INST_PARFOR) {
+      if (program[i].operand.as_u64 < size) {
+        is_entry[program[i].operand.as_u64] = true;
+      }
+    }
+  }
+  for (uint64_t entry = 0; entry < size; entry++) {
+    if (!is_entry[entry]) {
+      continue;
+    }
+    bool ok = function_body(program, size, entry, in_body, &body_size);
+    for (uint64_t i = 0; i < size; i++) {
+      if (in_body[i]) {
+        analyzed[i] = true;
+        escapes[i] |= !ok;
+      }
+    }
+    if (ok) {
+      frame_analyze(program, size, entry, in_body, states, escapes);
+    }
+  }
+
+  for (uint64_t i = 0; i < size; i++) {
+    if (program[i].type == SVM_INST_ALLOC && analyzed[i] && !escapes[i]) {
+      program[i].type = SVM_INST_FALLOC;
+    }
+  }
+
+  free(states);
+  free(in_body);
+  free(is_entry);
+  free(analyzed);
+  free(escapes);
+  return size;
+}
@@ -0,0 +1,217 @@
+#include "svm/parfor.h"
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/value.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+
+typedef struct {
+  svm_t *parent;
+  uint64_t entry;
+  uint64_t n;
+  // Handed to every call below its index.
+  svm_value_t context;
+  // Pool threads that may take part, not counting the calling thread.
+  uint32_t max_threads;
+
+  svm_t *heap_vm;
+  pthread_mutex_t *heap_lock;
+
+  // Next index to hand out.
+  _Atomic uint64_t next;
+  _Atomic bool failed;
+  svm_err_t err;
+} parfor_job_t;
+
+static struct {
+  pthread_once_t once;
+  // Held by the thread whose parfor is running on the pool.
+  pthread_mutex_t busy;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  // Bumped for every job, so that the threads can tell a new job from a spurious wake up.
+  uint64_t generation;
+  parfor_job_t *job;
+  // Pool threads that haven't finished the current job yet.
+  uint32_t running;
+
+  uint32_t num_threads;
+  // VMs the calls run on, one per pool thread plus one for the calling thread at index 0.
+  svm_t *vms[SVM_PARFOR_MAX_THREADS + 1];
+} pool = {
+  .once = PTHREAD_ONCE_INIT,
+  .busy = PTHREAD_MUTEX_INITIALIZER,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .start = PTHREAD_COND_INITIALIZER,
+  .finished = PTHREAD_COND_INITIALIZER,
+};
+
+static svm_err_t run_index(svm_t *vm, uint64_t entry, svm_value_t context, uint64_t index)
+{
+  vm->halted = false;
+  vm->stack[0] = context;
+  vm->stack[1] = SVM_VALUE_I64(index);
+  vm->stack_ptr = 2;
+  // Returning from the function goes to one past the end of the program, which ends the call.
+  vm->call_stack[0] = vm->program_size;
+  vm->call_stack_ptr = 1;
+  vm->frame_marks[0] = 0;
+  vm->frame_top = 0;
+  vm->ip = entry;
+
+  while (!vm->halted && vm->ip != vm->program_size) {
+    svm_err_t err = svm_exec_instruction(vm);
+    if (err != SVM_ERR_OK) {
+      return err;
+    }
+  }
+  return SVM_ERR_OK;
+}
+
+static void run_job(parfor_job_t *job, svm_t *vm)
+{
+  svm_init(vm);
+  svm_load_program_from_vm(vm, job->parent);
+  vm->quicken = job->parent->quicken;
+  vm->heap_vm = job->heap_vm;
+  vm->heap_lock = job->heap_lock;
+
+  while (!atomic_load(&job->failed)) {
+    uint64_t index = atomic_fetch_add(&job->next, 1);
+    if (index >= job->n) {
+      break;
+    }
+    svm_err_t err = run_index(vm, job->entry, job->context, index);
+    if (err != SVM_ERR_OK) {
+      bool expected = false;
+      if (atomic_compare_exchange_strong(&job->failed, &expected, true)) {
+        job->err = err;
+        fprintf(stderr, "Error: parfor index %lu failed at ip %lu\n", index, vm->ip);
+      }
+      break;
+    }
+  }
+}
+
+static void *pool_main(void *arg)
+{
+  uint32_t idx = (uint32_t)(uintptr_t)arg;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool.lock);
+  while (true) {
+    while (pool.generation == seen) {
+      pthread_cond_wait(&pool.start, &pool.lock);
+    }
+    seen = pool.generation;
+    parfor_job_t *job = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (idx <= job->max_threads) {
+      run_job(job, pool.vms[idx]);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.running--;
+    if (pool.running == 0) {
+      pthread_cond_signal(&pool.finished);
+    }
+  }
+
+  return NULL;
+}
+
+static void pool_init(void)
+{
+  // The calling thread takes part, so one thread less than there are CPUs.
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_threads = cpus > 1 ? cpus - 1 : 0;
+  if (num_threads > SVM_PARFOR_MAX_THREADS) {
+    num_threads = SVM_PARFOR_MAX_THREADS;
+  }
+
+  // The threads inherit the signal mask. Keep SIGPROF off them so the profiler's handler only runs on the thread of
+  // the VM it samples.
+  sigset_t sigprof, old_mask;
+  sigemptyset(&sigprof);
+  sigaddset(&sigprof, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &sigprof, &old_mask);
+
+  pool.vms[0] = malloc(sizeof(*pool.vms[0]));
+  for (uint32_t i = 1; i <= num_threads; i++) {
+    pool.vms[i] = malloc(sizeof(*pool.vms[i]));
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_main, (void *)(uintptr_t)i) != 0) {
+      free(pool.vms[i]);
+      break;
+    }
+    pthread_detach(thread);
+    pool.num_threads = i;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+svm_err_t svm_parfor_run(svm_t *svm, uint64_t entry, uint64_t n)
+{
+  if (svm->stack_ptr < 1) {
+    return SVM_ERR_STACK_UNDERFLOW;
+  }
+
+  parfor_job_t job = {
+    .parent = svm,
+    .entry = entry,
+    .n = n,
+    .context = svm->stack[svm->stack_ptr - 1],
+    .heap_vm = svm->heap_vm != NULL ? svm->heap_vm : svm,
+    .heap_lock = svm->heap_lock,
+    .err = SVM_ERR_OK,
+  };
+  atomic_init(&job.next, 0);
+  atomic_init(&job.failed, false);
+
+  // The heap of a VM that runs on its own isn't locked, so give the calls a lock to share while svm waits for them.
+  pthread_mutex_t heap_lock;
+  if (job.heap_lock == NULL) {
+    pthread_mutex_init(&heap_lock, NULL);
+    job.heap_lock = &heap_lock;
+  }
+
+  pthread_once(&pool.once, pool_init);
+  if (pthread_mutex_trylock(&pool.busy) != 0) {
+    svm_t *vm = malloc(sizeof(*vm));
+    run_job(&job, vm);
+    free(vm);
+  } else {
+    job.max_threads = svm->sched_workers > 0 ? svm->sched_workers - 1 : pool.num_threads;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    pool.running = pool.num_threads;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_job(&job, pool.vms[0]);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) {
+      pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pool.job = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.busy);
+  }
+
+  if (job.heap_lock == &heap_lock) {
+    pthread_mutex_destroy(&heap_lock);
+  }
+  return job.err;
+}
@@ -0,0 +1,300 @@
+#include "svm/perf.h"
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/cfg.h"
+#include "svm/instructions.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Number of back to back reads used to work out the cost of a read.
+#define CALIBRATION_READS 1000
+#define MAX_PRINTED_BLOCKS 20
+
+#define CACHE_READ_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+  const char *name;
+} counters[SVM_PERF_NUM_COUNTERS] = {
+  [SVM_PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+  [SVM_PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+  [SVM_PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+  [SVM_PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D), "L1D-misses"},
+  [SVM_PERF_LLC_MISSES] = {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL), "LLC-misses"},
+  [SVM_PERF_TASK_CLOCK] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock"},
+};
+
+const char *svm_perf_counter_to_string(svm_perf_counter_t counter)
+{
+  return counters[counter].name;
+}
+
+static int group_leader(const svm_perf_t *perf)
+{
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    if (perf->fds[c] >= 0) {
+      return perf->fds[c];
+    }
+  }
+  return -1;
+}
+
+bool svm_perf_open(svm_perf_t *perf)
+{
+  memset(perf, 0, sizeof(*perf));
+
+  int leader = -1;
+  int first_errno = 0;
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[c].type;
+    attr.config = counters[c].config;
+    // The whole group is started by enabling the leader.
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    perf->fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (perf->fds[c] < 0) {
+      if (first_errno == 0) {
+        first_errno = errno;
+      }
+      continue;
+    }
+    if (leader == -1) {
+      leader = perf->fds[c];
+    }
+    perf->slots[c] = perf->num_open++;
+  }
+
+  if (perf->num_open == 0) {
+    errno = first_errno;
+    return false;
+  }
+  return true;
+}
+
+void svm_perf_close(svm_perf_t *perf)
+{
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    if (perf->fds[c] >= 0) {
+      close(perf->fds[c]);
+      perf->fds[c] = -1;
+    }
+  }
+  if (perf->by_block != NULL) {
+    free(perf->by_block);
+    perf->by_block = NULL;
+    svm_cfg_free(&perf->cfg);
+  }
+}
+
+static void read_counters(svm_perf_t *perf, const uint64_t *prev, uint64_t *values)
+{
+  // nr, time_enabled, time_running, then one value per open counter.
+  uint64_t buf[3 + SVM_PERF_NUM_COUNTERS];
+  ssize_t size = (3 + perf->num_open) * sizeof(buf[0]);
+
+  if (read(group_leader(perf), buf, size) != size) {
+    // Charge nothing rather than garbage.
+    memcpy(values, prev, SVM_PERF_NUM_COUNTERS * sizeof(*values));
+    return;
+  }
+  perf->time_enabled = buf[1];
+  perf->time_running = buf[2];
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    values[c] = perf->fds[c] >= 0 ? buf[3 + perf->slots[c]] : 0;
+  }
+}
+
+static void charge(svm_perf_entry_t *entry, const uint64_t *delta)
+{
+  entry->executed++;
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    entry->counts[c] += delta[c];
+  }
+}
+
+svm_err_t svm_perf_run(svm_t *svm, svm_perf_t *perf)
+{
+  svm_instruction_t *program = malloc(svm->program_size * sizeof(*program) + 1);
+  svm_program_unpack(svm, program);
+  svm_cfg_build(&perf->cfg, program, svm->program_size);
+  free(program);
+  perf->by_block = calloc(perf->cfg.num_blocks, sizeof(*perf->by_block));
+
+  int leader = group_leader(perf);
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+  uint64_t prev[SVM_PERF_NUM_COUNTERS] = {0};
+  uint64_t now[SVM_PERF_NUM_COUNTERS];
+  uint64_t delta[SVM_PERF_NUM_COUNTERS];
+
+  // Reading the counters shows up in the counters, so find the smallest amount a read adds on its own.
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    perf->overhead[c] = UINT64_MAX;
+  }
+  read_counters(perf, prev, prev);
+  for (int i = 0; i < CALIBRATION_READS; i++) {
+    read_counters(perf, prev, now);
+    for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+      if (now[c] - prev[c] < perf->overhead[c]) {
+        perf->overhead[c] = now[c] - prev[c];
+      }
+    }
+    memcpy(prev, now, sizeof(prev));
+  }
+
+  svm_err_t err = SVM_ERR_OK;
+  while (!svm->halted) {
+    uint64_t ip = svm->ip;
+    // Charge the instruction as it was dispatched, which may be a quickened form.
+    svm_instruction_type_t type = ip < svm->program_size ? svm->opcodes[ip] : SVM_INST_NOP;
+
+    err = svm_exec_instruction(svm);
+    read_counters(perf, prev, now);
+
+    if (ip < svm->program_size) {
+      for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+        uint64_t diff = now[c] - prev[c];
+        delta[c] = diff > perf->overhead[c] ? diff - perf->overhead[c] : 0;
+      }
+      charge(&perf->total, delta);
+      // Unknown opcodes are loaded as UINT8_MAX, and fail without having an entry.
+      if (type < SVM_INST_TYPE_COUNT) {
+        charge(&perf->by_opcode[type], delta);
+      }
+      charge(&perf->by_block[perf->cfg.block_of[ip]], delta);
+    }
+    memcpy(prev, now, sizeof(prev));
+
+    if (err != SVM_ERR_OK) {
+      break;
+    }
+  }
+
+  ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  return err;
+}
+
+typedef struct {
+  char label[48];
+  const svm_perf_entry_t *entry;
+  uint64_t key;
+} row_t;
+
+static int compare_rows(const void *a, const void *b)
+{
+  uint64_t key_a = ((const row_t *)a)->key;
+  uint64_t key_b = ((const row_t *)b)->key;
+  return key_a < key_b ? 1 : key_a > key_b ? -1 : 0;
+}
+
+static void print_header(const svm_perf_t *perf, FILE *out)
+{
+  fprintf(out, "  %-28s %14s", "", "executed");
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    if (perf->fds[c] >= 0) {
+      fprintf(out, " %14s", counters[c].name);
+    }
+  }
+  fprintf(out, "\n");
+}
+
+static void print_row(const svm_perf_t *perf, const char *label, const svm_perf_entry_t *entry, FILE *out)
+{
+  fprintf(out, "  %-28s %14lu", label, entry->executed);
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    if (perf->fds[c] >= 0) {
+      fprintf(out, " %14lu", entry->counts[c]);
+    }
+  }
+  fprintf(out, "\n");
+}
+
+static void print_rows(const svm_perf_t *perf, row_t *rows, uint64_t num_rows, uint64_t max_rows, FILE *out)
+{
+  qsort(rows, num_rows, sizeof(*rows), compare_rows);
+  print_header(perf, out);
+  for (uint64_t i = 0; i < num_rows && i < max_rows; i++) {
+    print_row(perf, rows[i].label, rows[i].entry, out);
+  }
+}
+
+void svm_perf_print(const svm_perf_t *perf, FILE *out)
+{
+  // Sort by the first counter that is open, which is cycles whenever there is a PMU.
+  int key = 0;
+  while (perf->fds[key] < 0) {
+    key++;
+  }
+
+  fprintf(out, "Performance counters, sorted by %s. Cost of a read subtracted:", counters[key].name);
+  for (int c = 0; c < SVM_PERF_NUM_COUNTERS; c++) {
+    if (perf->fds[c] >= 0) {
+      fprintf(out, " %s %lu", counters[c].name, perf->overhead[c]);
+    }
+  }
+  fprintf(out, "\n");
+  if (perf->time_running < perf->time_enabled) {
+    fprintf(out, "WARNING: The counters only ran for %lu of %lu ns, counts are partial.\n", perf->time_running,
+            perf->time_enabled);
+  }
+  print_header(perf, out);
+  print_row(perf, "total", &perf->total, out);
+  if (perf->fds[SVM_PERF_CYCLES] >= 0 && perf->fds[SVM_PERF_INSTRUCTIONS] >= 0 && perf->total.counts[SVM_PERF_CYCLES] != 0) {
+    fprintf(out, "  IPC: %.2f, cycles per VM instruction: %.1f\n",
+            (double)perf->total.counts[SVM_PERF_INSTRUCTIONS] / perf->total.counts[SVM_PERF_CYCLES],
+            perf->total.executed != 0 ? (double)perf->total.counts[SVM_PERF_CYCLES] / perf->total.executed : 0.0);
+  }
+
+  row_t *rows = malloc(SVM_INST_TYPE_COUNT * sizeof(*rows));
+  uint64_t num_rows = 0;
+  for (uint64_t type = 0; type < SVM_INST_TYPE_COUNT; type++) {
+    const svm_perf_entry_t *entry = &perf->by_opcode[type];
+    if (entry->executed == 0) {
+      continue;
+    }
+    row_t *row = &rows[num_rows++];
+    snprintf(row->label, sizeof(row->label), "%s", svm_instruction_type_to_string(type));
+    row->entry = entry;
+    row->key = entry->counts[key];
+  }
+  fprintf(out, "\nBy opcode:\n");
+  print_rows(perf, rows, num_rows, num_rows, out);
+  free(rows);
+
+  if (perf->by_block == NULL) {
+    return;
+  }
+  rows = malloc(perf->cfg.num_blocks * sizeof(*rows));
+  num_rows = 0;
+  for (uint64_t b = 0; b < perf->cfg.num_blocks; b++) {
+    const svm_perf_entry_t *entry = &perf->by_block[b];
+    if (entry->executed == 0) {
+      continue;
+    }
+    row_t *row = &rows[num_rows++];
+    snprintf(row->label, sizeof(row->label), "[%lu, %lu)", perf->cfg.blocks[b].start, perf->cfg.blocks[b].end);
+    row->entry = entry;
+    row->key = entry->counts[key];
+  }
+  fprintf(out, "\nBy block (top %d):\n", MAX_PRINTED_BLOCKS);
+  print_rows(perf, rows, num_rows, MAX_PRINTED_BLOCKS, out);
+  free(rows);
+}
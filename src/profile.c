@@ -0,0 +1,193 @@
+#include "svm/profile.h"
+#include "svm/svm.h"
+#include "svm/label_list.h"
+#include "svm/instructions.h"
+
+#include <signal.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Read by the signal handler.
+static svm_profile_t *volatile active_profile = NULL;
+static const svm_t *volatile active_svm = NULL;
+
+static struct sigaction old_action;
+static struct itimerval old_timer;
+
+static uint64_t stack_hash(uint64_t ip, const uint64_t *frames, uint64_t depth)
+{
+  // FNV-1a over whole values.
+  uint64_t hash = 14695981039346656037ull;
+  hash = (hash ^ ip) * 1099511628211ull;
+  for (uint64_t i = 0; i < depth; i++) {
+    hash = (hash ^ frames[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+static void handle_sigprof(int sig)
+{
+  (void)sig;
+  svm_profile_t *profile = active_profile;
+  const svm_t *svm = active_svm;
+  if (profile == NULL || svm == NULL) {
+    return;
+  }
+  profile->samples++;
+
+  uint64_t ip = svm->ip;
+  uint64_t depth = svm->call_stack_ptr;
+  if (depth > SVM_CALL_STACK_SIZE) {
+    depth = SVM_CALL_STACK_SIZE;
+  }
+  const uint64_t *frames = svm->call_stack;
+  bool truncated = false;
+  if (depth > SVM_PROFILE_MAX_DEPTH) {
+    frames += depth - SVM_PROFILE_MAX_DEPTH;
+    depth = SVM_PROFILE_MAX_DEPTH;
+    truncated = true;
+  }
+
+  uint64_t hash = stack_hash(ip, frames, depth);
+  for (uint64_t probe = 0; probe < SVM_PROFILE_MAX_STACKS; probe++) {
+    svm_profile_stack_t *stack = &profile->stacks[(hash + probe) % SVM_PROFILE_MAX_STACKS];
+    if (stack->count == 0) {
+      stack->ip = ip;
+      stack->depth = depth;
+      stack->truncated = truncated;
+      memcpy(stack->frames, frames, depth * sizeof(*frames));
+      stack->count = 1;
+      profile->num_stacks++;
+      return;
+    }
+    if (stack->ip == ip && stack->depth == depth && stack->truncated == truncated &&
+        memcmp(stack->frames, frames, depth * sizeof(*frames)) == 0) {
+      stack->count++;
+      return;
+    }
+  }
+  profile->dropped++;
+}
+
+bool svm_profile_start(svm_profile_t *profile, svm_t *svm, uint32_t hz)
+{
+  if (active_profile != NULL || hz == 0 || hz > 1000000) {
+    return false;
+  }
+  memset(profile, 0, sizeof(*profile));
+  profile->stacks = calloc(SVM_PROFILE_MAX_STACKS, sizeof(*profile->stacks));
+  if (profile->stacks == NULL) {
+    return false;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_sigprof;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &old_action) != 0) {
+    svm_profile_free(profile);
+    return false;
+  }
+
+  active_svm = svm;
+  active_profile = profile;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, &old_timer) != 0) {
+    active_profile = NULL;
+    active_svm = NULL;
+    sigaction(SIGPROF, &old_action, NULL);
+    svm_profile_free(profile);
+    return false;
+  }
+  return true;
+}
+
+void svm_profile_stop(svm_profile_t *profile)
+{
+  if (active_profile != profile) {
+    return;
+  }
+  setitimer(ITIMER_PROF, &old_timer, NULL);
+  // A signal that is already pending finds nothing to record.
+  active_profile = NULL;
+  active_svm = NULL;
+  sigaction(SIGPROF, &old_action, NULL);
+}
+
+void svm_profile_free(svm_profile_t *profile)
+{
+  svm_profile_stop(profile);
+  free(profile->stacks);
+  profile->stacks = NULL;
+}
+
+static svm_label_list_t *label_at(svm_label_list_t *labels, uint64_t address)
+{
+  for (svm_label_list_t *current = labels; current != NULL; current = current->next) {
+    if (current->address == address) {
+      return current;
+    }
+  }
+  return NULL;
+}
+
+static void write_function(FILE *out, svm_label_list_t *labels, uint64_t entry)
+{
+  svm_label_list_t *label = label_at(labels, entry);
+  if (label != NULL) {
+    fprintf(out, "%s", label->label);
+  } else {
+    fprintf(out, "%lu", entry);
+  }
+}
+
+bool svm_profile_write_folded(const svm_profile_t *profile, const svm_t *svm, svm_label_list_t *labels,
+                              const char *file_name)
+{
+  FILE *out = fopen(file_name, "w");
+  if (out == NULL) {
+    return false;
+  }
+
+  for (uint64_t s = 0; s < SVM_PROFILE_MAX_STACKS; s++) {
+    const svm_profile_stack_t *stack = &profile->stacks[s];
+    if (stack->count == 0) {
+      continue;
+    }
+
+    if (stack->truncated) {
+      fprintf(out, "[truncated]");
+    } else {
+      write_function(out, labels, 0);
+    }
+    for (uint64_t i = 0; i < stack->depth; i++) {
+      fprintf(out, ";");
+      // Name the call by the function it called.
+      uint64_t call_addr = stack->frames[i] - 1;
+      if (call_addr < svm->program_size && svm->opcodes[call_addr] == SVM_INST_CALL) {
+        write_function(out, labels, svm_program_get(svm, call_addr).operand.as_u64);
+      } else {
+        fprintf(out, "[%lu]", call_addr);
+      }
+    }
+    if (stack->ip < svm->program_size) {
+      fprintf(out, ";%s", svm_instruction_type_to_string(svm->opcodes[stack->ip]));
+    }
+    fprintf(out, " %lu\n", stack->count);
+  }
+
+  bool ok = ferror(out) == 0;
+  if (fclose(out) != 0) {
+    ok = false;
+  }
+  return ok;
+}
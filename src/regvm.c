@@ -0,0 +1,420 @@
+#include "svm/regvm.h"
+#include "svm/svm.h"
+#include "svm/cfg.h"
+#include "svm/err.h"
+#include "svm/value.h"
+#include "svm/instructions.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+static bool reg_opcode(svm_instruction_type_t type, svm_reg_opcode_t *op)
+{
+  // Using if instead of switch because we have -Wswitch-enum on.
+  if (type == SVM_INST_ADD_I) { *op = SVM_REG_ADD_I; return true; }
+  if (type == SVM_INST_SUB_I) { *op = SVM_REG_SUB_I; return true; }
+  if (type == SVM_INST_MULT_I) { *op = SVM_REG_MULT_I; return true; }
+  if (type == SVM_INST_DIV_I) { *op = SVM_REG_DIV_I; return true; }
+  if (type == SVM_INST_ADD_U) { *op = SVM_REG_ADD_U; return true; }
+  if (type == SVM_INST_SUB_U) { *op = SVM_REG_SUB_U; return true; }
+  if (type == SVM_INST_MULT_U) { *op = SVM_REG_MULT_U; return true; }
+  if (type == SVM_INST_DIV_U) { *op = SVM_REG_DIV_U; return true; }
+  if (type == SVM_INST_ADD_F) { *op = SVM_REG_ADD_F; return true; }
+  if (type == SVM_INST_SUB_F) { *op = SVM_REG_SUB_F; return true; }
+  if (type == SVM_INST_MULT_F) { *op = SVM_REG_MULT_F; return true; }
+  if (type == SVM_INST_DIV_F) { *op = SVM_REG_DIV_F; return true; }
+
+  if (type == SVM_INST_EQ) { *op = SVM_REG_EQ; return true; }
+  if (type == SVM_INST_NOT_EQ) { *op = SVM_REG_NOT_EQ; return true; }
+  if (type == SVM_INST_GT_I) { *op = SVM_REG_GT_I; return true; }
+  if (type == SVM_INST_GT_EQ_I) { *op = SVM_REG_GT_EQ_I; return true; }
+  if (type == SVM_INST_LT_I) { *op = SVM_REG_LT_I; return true; }
+  if (type == SVM_INST_LT_EQ_I) { *op = SVM_REG_LT_EQ_I; return true; }
+  if (type == SVM_INST_GT_U) { *op = SVM_REG_GT_U; return true; }
+  if (type == SVM_INST_GT_EQ_U) { *op = SVM_REG_GT_EQ_U; return true; }
+  if (type == SVM_INST_LT_U) { *op = SVM_REG_LT_U; return true; }
+  if (type == SVM_INST_LT_EQ_U) { *op = SVM_REG_LT_EQ_U; return true; }
+  if (type == SVM_INST_GT_F) { *op = SVM_REG_GT_F; return true; }
+  if (type == SVM_INST_GT_EQ_F) { *op = SVM_REG_GT_EQ_F; return true; }
+  if (type == SVM_INST_LT_F) { *op = SVM_REG_LT_F; return true; }
+  if (type == SVM_INST_LT_EQ_F) { *op = SVM_REG_LT_EQ_F; return true; }
+
+  if (type == SVM_INST_AND) { *op = SVM_REG_AND; return true; }
+  if (type == SVM_INST_OR) { *op = SVM_REG_OR; return true; }
+  if (type == SVM_INST_XOR) { *op = SVM_REG_XOR; return true; }
+  if (type == SVM_INST_SHL) { *op = SVM_REG_SHL; return true; }
+  if (type == SVM_INST_SHR) { *op = SVM_REG_SHR; return true; }
+  if (type == SVM_INST_SAR) { *op = SVM_REG_SAR; return true; }
+  if (type == SVM_INST_MOD_I) { *op = SVM_REG_MOD_I; return true; }
+  if (type == SVM_INST_MOD_U) { *op = SVM_REG_MOD_U; return true; }
+  if (type == SVM_INST_MULH_I) { *op = SVM_REG_MULH_I; return true; }
+  if (type == SVM_INST_MULH_U) { *op = SVM_REG_MULH_U; return true; }
+
+  return false;
+}
+
+// Symbolic contents of the stack while translating a block. Slots that were never written still hold whatever was
+// on the stack when the block was entered.
+typedef struct {
+  int64_t *slots;
+  svm_reg_operand_t *operands;
+  uint64_t size;
+} sym_stack_t;
+
+static svm_reg_operand_t sym_get(sym_stack_t *sym, int64_t slot)
+{
+  for (uint64_t i = 0; i < sym->size; i++) {
+    if (sym->slots[i] == slot) {
+      return sym->operands[i];
+    }
+  }
+  return (svm_reg_operand_t){.kind = SVM_REG_OPERAND_SLOT, .slot = slot};
+}
+
+static void sym_set(sym_stack_t *sym, int64_t slot, svm_reg_operand_t operand)
+{
+  for (uint64_t i = 0; i < sym->size; i++) {
+    if (sym->slots[i] == slot) {
+      sym->operands[i] = operand;
+      return;
+    }
+  }
+  sym->slots[sym->size] = slot;
+  sym->operands[sym->size] = operand;
+  sym->size++;
+}
+
+static uint64_t translate_block(svm_reg_block_t *block, const svm_instruction_t *program, uint64_t start, uint64_t limit)
+{
+  uint64_t len = limit - start;
+  // Every instruction writes at most two slots.
+  sym_stack_t sym = {
+    .slots = malloc(2 * len * sizeof(*sym.slots)),
+    .operands = malloc(2 * len * sizeof(*sym.operands)),
+    .size = 0,
+  };
+
+  block->start = start;
+  block->ops = malloc(len * sizeof(*block->ops));
+  block->num_ops = 0;
+  block->has_tail = false;
+
+  int64_t height = 0;
+  int64_t max_height = 0;
+  int64_t min_slot = 0;
+  uint64_t i = start;
+  while (i < limit) {
+    svm_instruction_t inst = program[i];
+    uint64_t offset = inst.operand.as_u64;
+    svm_reg_opcode_t op;
+    svm_instruction_type_t base_type;
+
+    if (inst.type == SVM_INST_NOP) {
+      // Nothing to do.
+    } else if (inst.type == SVM_INST_PUSH) {
+      sym_set(&sym, height, (svm_reg_operand_t){.kind = SVM_REG_OPERAND_CONST, .value = inst.operand});
+      height++;
+    } else if (inst.type == SVM_INST_POP) {
+      height--;
+    } else if (inst.type == SVM_INST_COPY && offset != 0 && offset <= SVM_STACK_SIZE) {
+      int64_t slot = height - (int64_t)offset;
+      if (slot < min_slot) {
+        min_slot = slot;
+      }
+      sym_set(&sym, height, sym_get(&sym, slot));
+      height++;
+    } else if (inst.type == SVM_INST_SWAP && offset != 0 && offset < SVM_STACK_SIZE) {
+      int64_t slot = height - (int64_t)offset - 1;
+      if (slot < min_slot) {
+        min_slot = slot;
+      }
+      svm_reg_operand_t top = sym_get(&sym, height - 1);
+      sym_set(&sym, height - 1, sym_get(&sym, slot));
+      sym_set(&sym, slot, top);
+    } else if (reg_opcode(inst.type, &op)) {
+      if (height - 2 < min_slot) {
+        min_slot = height - 2;
+      }
+      svm_reg_op_t *reg_op = &block->ops[block->num_ops];
+      reg_op->op = op;
+      reg_op->dst = block->num_ops;
+      reg_op->a = sym_get(&sym, height - 2);
+      reg_op->b = sym_get(&sym, height - 1);
+      block->num_ops++;
+      sym_set(&sym, height - 2, (svm_reg_operand_t){.kind = SVM_REG_OPERAND_TEMP, .temp = reg_op->dst});
+      height--;
+    } else if ((svm_instruction_type_from_immediate(inst.type, &base_type) && reg_opcode(base_type, &op)) ||
+               inst.type == SVM_INST_NOT) {
+      if (height - 1 < min_slot) {
+        min_slot = height - 1;
+      }
+      svm_reg_op_t *reg_op = &block->ops[block->num_ops];
+      reg_op->dst = block->num_ops;
+      reg_op->a = sym_get(&sym, height - 1);
+      if (inst.type == SVM_INST_NOT) {
+        // not x is x xor all ones.
+        reg_op->op = SVM_REG_XOR;
+        reg_op->b = (svm_reg_operand_t){.kind = SVM_REG_OPERAND_CONST, .value = SVM_VALUE_U64(UINT64_MAX)};
+      } else {
+        reg_op->op = op;
+        reg_op->b = (svm_reg_operand_t){.kind = SVM_REG_OPERAND_CONST, .value = inst.operand};
+      }
+      block->num_ops++;
+      sym_set(&sym, height - 1, (svm_reg_operand_t){.kind = SVM_REG_OPERAND_TEMP, .temp = reg_op->dst});
+    } else if (inst.type == SVM_INST_JNZ) {
+      block->cond = sym_get(&sym, height - 1);
+      height--;
+      block->has_tail = true;
+    } else {
+      // Everything else ends the block and is left to the interpreter.
+      block->has_tail = true;
+    }
+
+    if (height < min_slot) {
+      min_slot = height;
+    }
+    if (height > max_height) {
+      max_height = height;
+    }
+    i++;
+    if (block->has_tail) {
+      block->tail = inst;
+      break;
+    }
+  }
+  block->end = i;
+  block->height = height;
+  block->max_height = max_height;
+  block->need = -min_slot;
+
+  // Write back every slot that still holds something different from when the block was entered.
+  block->moves = malloc(sym.size * sizeof(*block->moves));
+  block->num_moves = 0;
+  for (uint64_t s = 0; s < sym.size; s++) {
+    svm_reg_operand_t operand = sym.operands[s];
+    if (sym.slots[s] >= height) {
+      continue;
+    }
+    if (operand.kind == SVM_REG_OPERAND_SLOT && operand.slot == sym.slots[s]) {
+      continue;
+    }
+    block->moves[block->num_moves++] = (svm_reg_move_t){.dst = sym.slots[s], .src = operand};
+  }
+
+  free(sym.slots);
+  free(sym.operands);
+  return i;
+}
+
+void svm_regvm_translate(svm_regvm_t *regvm, const svm_instruction_t *program, uint64_t size)
+{
+  svm_cfg_t cfg;
+  svm_cfg_build(&cfg, program, size);
+
+  regvm->blocks = malloc((size + 1) * sizeof(*regvm->blocks));
+  regvm->num_blocks = 0;
+  regvm->max_temps = 0;
+
+  // Blocks of the CFG are split further at every instruction the translation leaves to the interpreter.
+  for (uint64_t b = 0; b < cfg.num_blocks; b++) {
+    uint64_t i = cfg.blocks[b].start;
+    while (i < cfg.blocks[b].end) {
+      svm_reg_block_t *block = &regvm->blocks[regvm->num_blocks++];
+      i = translate_block(block, program, i, cfg.blocks[b].end);
+      if (block->num_ops + block->num_moves > regvm->max_temps) {
+        regvm->max_temps = block->num_ops + block->num_moves;
+      }
+    }
+  }
+
+  regvm->block_at = malloc((size + 1) * sizeof(*regvm->block_at));
+  for (uint64_t i = 0; i <= size; i++) {
+    regvm->block_at[i] = regvm->num_blocks;
+  }
+  for (uint64_t b = 0; b < regvm->num_blocks; b++) {
+    regvm->block_at[regvm->blocks[b].start] = b;
+  }
+
+  svm_cfg_free(&cfg);
+}
+
+void svm_regvm_free(svm_regvm_t *regvm)
+{
+  for (uint64_t b = 0; b < regvm->num_blocks; b++) {
+    free(regvm->blocks[b].ops);
+    free(regvm->blocks[b].moves);
+  }
+  free(regvm->blocks);
+  free(regvm->block_at);
+}
+
+static inline svm_value_t operand_value(const svm_reg_operand_t *operand, const svm_value_t *base, const svm_value_t *temps)
+{
+  switch (operand->kind) {
+    case SVM_REG_OPERAND_SLOT: return base[operand->slot];
+    case SVM_REG_OPERAND_CONST: return operand->value;
+    case SVM_REG_OPERAND_TEMP: return temps[operand->temp];
+  }
+  return SVM_VALUE_U64(0);
+}
+
+static inline svm_value_t eval_value(svm_reg_opcode_t op, svm_value_t a, svm_value_t b)
+{
+  switch (op) {
+    case SVM_REG_ADD_I: a.as_i64 += b.as_i64; return a;
+    case SVM_REG_SUB_I: a.as_i64 -= b.as_i64; return a;
+    case SVM_REG_MULT_I: a.as_i64 *= b.as_i64; return a;
+    case SVM_REG_DIV_I: a.as_i64 /= b.as_i64; return a;
+    case SVM_REG_ADD_U: a.as_u64 += b.as_u64; return a;
+    case SVM_REG_SUB_U: a.as_u64 -= b.as_u64; return a;
+    case SVM_REG_MULT_U: a.as_u64 *= b.as_u64; return a;
+    case SVM_REG_DIV_U: a.as_u64 /= b.as_u64; return a;
+    case SVM_REG_ADD_F: a.as_f64 += b.as_f64; return a;
+    case SVM_REG_SUB_F: a.as_f64 -= b.as_f64; return a;
+    case SVM_REG_MULT_F: a.as_f64 *= b.as_f64; return a;
+    case SVM_REG_DIV_F: a.as_f64 /= b.as_f64; return a;
+
+    case SVM_REG_EQ: return SVM_VALUE_I64(a.as_ptr == b.as_ptr);
+    case SVM_REG_NOT_EQ: return SVM_VALUE_I64(a.as_ptr != b.as_ptr);
+    case SVM_REG_GT_I: return SVM_VALUE_I64(a.as_i64 > b.as_i64);
+    case SVM_REG_GT_EQ_I: return SVM_VALUE_I64(a.as_i64 >= b.as_i64);
+    case SVM_REG_LT_I: return SVM_VALUE_I64(a.as_i64 < b.as_i64);
+    case SVM_REG_LT_EQ_I: return SVM_VALUE_I64(a.as_i64 <= b.as_i64);
+    case SVM_REG_GT_U: return SVM_VALUE_I64(a.as_u64 > b.as_u64);
+    case SVM_REG_GT_EQ_U: return SVM_VALUE_I64(a.as_u64 >= b.as_u64);
+    case SVM_REG_LT_U: return SVM_VALUE_I64(a.as_u64 < b.as_u64);
+    case SVM_REG_LT_EQ_U: return SVM_VALUE_I64(a.as_u64 <= b.as_u64);
+    case SVM_REG_GT_F: return SVM_VALUE_I64(a.as_f64 > b.as_f64);
+    case SVM_REG_GT_EQ_F: return SVM_VALUE_I64(a.as_f64 >= b.as_f64);
+    case SVM_REG_LT_F: return SVM_VALUE_I64(a.as_f64 < b.as_f64);
+    case SVM_REG_LT_EQ_F: return SVM_VALUE_I64(a.as_f64 <= b.as_f64);
+
+    case SVM_REG_AND: a.as_u64 &= b.as_u64; return a;
+    case SVM_REG_OR: a.as_u64 |= b.as_u64; return a;
+    case SVM_REG_XOR: a.as_u64 ^= b.as_u64; return a;
+    case SVM_REG_SHL: a.as_u64 <<= b.as_u64 & 63; return a;
+    case SVM_REG_SHR: a.as_u64 >>= b.as_u64 & 63; return a;
+    case SVM_REG_SAR: a.as_i64 >>= b.as_u64 & 63; return a;
+    case SVM_REG_MOD_I: a.as_i64 %= b.as_i64; return a;
+    case SVM_REG_MOD_U: a.as_u64 %= b.as_u64; return a;
+    case SVM_REG_MULH_I: return SVM_VALUE_I64(svm_mulh_i64(a.as_i64, b.as_i64));
+    case SVM_REG_MULH_U: return SVM_VALUE_U64(svm_mulh_u64(a.as_u64, b.as_u64));
+  }
+  return a;
+}
+
+// Returns false, without a result, for the integer divisions that svm_exec_instruction fails with
+// SVM_ERR_ILLEGAL_DIVISION.
+static inline bool eval_op(svm_reg_opcode_t op, svm_value_t a, svm_value_t b, svm_value_t *result)
+{
+  if ((op == SVM_REG_DIV_I || op == SVM_REG_MOD_I) && !svm_div_i64_ok(a.as_i64, b.as_i64)) {
+    return false;
+  }
+  if ((op == SVM_REG_DIV_U || op == SVM_REG_MOD_U) && b.as_u64 == 0) {
+    return false;
+  }
+  *result = eval_value(op, a, b);
+  return true;
+}
+
+static svm_err_t interpret_block(svm_t *svm, const svm_reg_block_t *block)
+{
+  for (uint64_t i = block->start; i < block->end && !svm->halted; i++) {
+    svm_err_t err = svm_exec_instruction(svm);
+    if (err != SVM_ERR_OK) {
+      return err;
+    }
+  }
+  return SVM_ERR_OK;
+}
+
+svm_err_t svm_regvm_run(svm_t *svm)
+{
+  svm_regvm_t regvm;
+  svm_instruction_t *program = malloc(svm->program_size * sizeof(*program) + 1);
+  svm_program_unpack(svm, program);
+  svm_regvm_translate(&regvm, program, svm->program_size);
+  free(program);
+  // Temporaries, followed by room to stage the moves at the end of a block.
+  svm_value_t *temps = malloc((regvm.max_temps + 1) * sizeof(*temps));
+
+  svm_err_t err = SVM_ERR_OK;
+  while (!svm->halted) {
+    if (svm->ip >= svm->program_size || regvm.block_at[svm->ip] == regvm.num_blocks) {
+      // Not the start of a block, e.g. because the ip was set from outside.
+      err = svm_exec_instruction(svm);
+      if (err != SVM_ERR_OK) {
+        break;
+      }
+      continue;
+    }
+
+    svm_reg_block_t *block = &regvm.blocks[regvm.block_at[svm->ip]];
+    uint64_t stack_ptr = svm->stack_ptr;
+    if (stack_ptr < block->need || stack_ptr + block->max_height > svm->stack_limit) {
+      // The block would under or overflow the stack. Let the interpreter fail at the same instruction it normally would.
+      err = interpret_block(svm, block);
+      if (err != SVM_ERR_OK) {
+        break;
+      }
+      continue;
+    }
+
+    svm_value_t *base = &svm->stack[stack_ptr];
+    bool evaluated = true;
+    for (uint64_t i = 0; i < block->num_ops && evaluated; i++) {
+      svm_reg_op_t *op = &block->ops[i];
+      evaluated = eval_op(op->op, operand_value(&op->a, base, temps), operand_value(&op->b, base, temps),
+                          &temps[op->dst]);
+    }
+    if (!evaluated) {
+      // A division in the block fails. Nothing has been written to the stack yet, so the interpreter can run the block
+      // from the start and fail at that instruction.
+      err = interpret_block(svm, block);
+      if (err != SVM_ERR_OK) {
+        break;
+      }
+      continue;
+    }
+
+    bool taken = false;
+    if (block->has_tail && block->tail.type == SVM_INST_JNZ) {
+      taken = operand_value(&block->cond, base, temps).as_i64 != 0;
+    }
+
+    // Moves can read slots that other moves write, so read them all before writing any.
+    svm_value_t *staged = &temps[block->num_ops];
+    for (uint64_t i = 0; i < block->num_moves; i++) {
+      staged[i] = operand_value(&block->moves[i].src, base, temps);
+    }
+    for (uint64_t i = 0; i < block->num_moves; i++) {
+      base[block->moves[i].dst] = staged[i];
+    }
+    svm->stack_ptr = stack_ptr + block->height;
+    svm->ip = block->end;
+
+    if (!block->has_tail) {
+      continue;
+    }
+    if (block->tail.type == SVM_INST_JMP) {
+      svm->ip = block->tail.operand.as_u64;
+    } else if (block->tail.type == SVM_INST_JNZ) {
+      if (taken) {
+        svm->ip = block->tail.operand.as_u64;
+      }
+    } else if (block->tail.type == SVM_INST_HALT) {
+      svm->halted = true;
+    } else {
+      svm->ip = block->end - 1;
+      err = svm_exec_instruction(svm);
+      if (err != SVM_ERR_OK) {
+        break;
+      }
+    }
+  }
+
+  free(temps);
+  svm_regvm_free(&regvm);
+  return err;
+}
@@ -0,0 +1,172 @@
+#include "svm/stats.h"
+#include "svm/svm.h"
+#include "svm/symbols.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+bool svm_stats_init(svm_stats_t *stats, svm_t *svm)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->program_size = svm->program_size;
+  stats->sites = calloc(svm->program_size + 1, sizeof(*stats->sites));
+  if (stats->sites == NULL) {
+    return false;
+  }
+  svm->stats = stats;
+  return true;
+}
+
+void svm_stats_free(svm_stats_t *stats)
+{
+  free(stats->sites);
+  stats->sites = NULL;
+}
+
+static uint64_t block_slot(const void *addr)
+{
+  // malloc aligns blocks to at least 16 bytes, so the low bits say nothing.
+  uint64_t hash = ((uintptr_t)addr >> 4) * 0x9e3779b97f4a7c15ull;
+  return (hash >> 32) % SVM_STATS_BLOCKS_SIZE;
+}
+
+static uint64_t size_bucket(uint64_t size)
+{
+  uint64_t bucket = 0;
+  while (bucket < SVM_STATS_SIZE_BUCKETS - 1 && ((uint64_t)1 << bucket) < size) {
+    bucket++;
+  }
+  return bucket;
+}
+
+void svm_stats_alloc(svm_stats_t *stats, uint64_t site, void *addr, uint64_t size, uint64_t heap_addrs)
+{
+  if (heap_addrs > stats->max_heap_addrs) {
+    stats->max_heap_addrs = heap_addrs;
+  }
+  stats->allocs++;
+  stats->bytes += size;
+  stats->live_bytes += size;
+  if (stats->live_bytes > stats->peak_live_bytes) {
+    stats->peak_live_bytes = stats->live_bytes;
+  }
+  stats->size_histogram[size_bucket(size)]++;
+
+  if (site < stats->program_size) {
+    svm_stats_site_t *s = &stats->sites[site];
+    s->allocs++;
+    s->bytes += size;
+    s->live_bytes += size;
+    if (s->live_bytes > s->peak_live_bytes) {
+      s->peak_live_bytes = s->live_bytes;
+    }
+  }
+
+  uint64_t slot = block_slot(addr);
+  while (stats->blocks[slot].addr != NULL) {
+    slot = (slot + 1) % SVM_STATS_BLOCKS_SIZE;
+  }
+  stats->blocks[slot] = (svm_stats_block_t){.addr = addr, .site = site, .size = size, .born = stats->instructions};
+}
+
+void svm_stats_release(svm_stats_t *stats, void *addr)
+{
+  uint64_t slot = block_slot(addr);
+  while (stats->blocks[slot].addr != addr) {
+    if (stats->blocks[slot].addr == NULL) {
+      // Allocated before the statistics were started.
+      return;
+    }
+    slot = (slot + 1) % SVM_STATS_BLOCKS_SIZE;
+  }
+  svm_stats_block_t block = stats->blocks[slot];
+
+  stats->frees++;
+  stats->live_bytes -= block.size;
+  if (block.site < stats->program_size) {
+    svm_stats_site_t *s = &stats->sites[block.site];
+    uint64_t lifetime = stats->instructions - block.born;
+    s->frees++;
+    s->live_bytes -= block.size;
+    s->lifetime += lifetime;
+    if (lifetime > s->max_lifetime) {
+      s->max_lifetime = lifetime;
+    }
+  }
+
+  // Move later blocks of the same run back into the hole, so lookups don't stop there.
+  uint64_t hole = slot;
+  for (uint64_t next = (slot + 1) % SVM_STATS_BLOCKS_SIZE; stats->blocks[next].addr != NULL;
+       next = (next + 1) % SVM_STATS_BLOCKS_SIZE) {
+    uint64_t home = block_slot(stats->blocks[next].addr);
+    // The block can move into the hole if its home slot isn't cyclically in (hole, next].
+    bool stays = hole < next ? (home > hole && home <= next) : (home > hole || home <= next);
+    if (!stays) {
+      stats->blocks[hole] = stats->blocks[next];
+      hole = next;
+    }
+  }
+  stats->blocks[hole].addr = NULL;
+}
+
+typedef struct {
+  uint64_t site;
+  uint64_t key;
+} row_t;
+
+static int compare_rows(const void *a, const void *b)
+{
+  uint64_t key_a = ((const row_t *)a)->key;
+  uint64_t key_b = ((const row_t *)b)->key;
+  return key_a < key_b ? 1 : key_a > key_b ? -1 : 0;
+}
+
+void svm_stats_print(const svm_stats_t *stats, const svm_symbols_t *symbols, FILE *out)
+{
+  fprintf(out, "Memory statistics over %lu instructions:\n", stats->instructions);
+  fprintf(out, "  stack:          %lu of %d slots\n", stats->max_stack, SVM_STACK_SIZE);
+  fprintf(out, "  call stack:     %lu of %d calls\n", stats->max_call_stack, SVM_CALL_STACK_SIZE);
+  fprintf(out, "  heap addresses: %lu of %d\n", stats->max_heap_addrs, SVM_HEAP_ADDRS_SIZE);
+  fprintf(out, "  frame storage:  %lu of %d bytes\n", stats->max_frame_storage, SVM_FRAME_STORAGE_SIZE);
+  fprintf(out, "  heap: %lu allocs, %lu frees, %lu bytes allocated, %lu bytes live at most, %lu bytes still live\n",
+          stats->allocs, stats->frees, stats->bytes, stats->peak_live_bytes, stats->live_bytes);
+  if (stats->allocs == 0) {
+    return;
+  }
+
+  fprintf(out, "\nBlock sizes:\n");
+  for (uint64_t b = 0; b < SVM_STATS_SIZE_BUCKETS; b++) {
+    if (stats->size_histogram[b] != 0) {
+      fprintf(out, "  <= %-12lu %12lu\n", (uint64_t)1 << b, stats->size_histogram[b]);
+    }
+  }
+
+  row_t *rows = malloc(stats->program_size * sizeof(*rows) + 1);
+  uint64_t num_rows = 0;
+  for (uint64_t site = 0; site < stats->program_size; site++) {
+    if (stats->sites[site].allocs != 0) {
+      rows[num_rows++] = (row_t){.site = site, .key = stats->sites[site].bytes};
+    }
+  }
+  qsort(rows, num_rows, sizeof(*rows), compare_rows);
+
+  fprintf(out, "\nBy site, sorted by bytes allocated. Lifetimes are in instructions, over the freed blocks:\n");
+  fprintf(out, "  %-18s %10s %10s %12s %12s %12s %12s\n", "", "allocs", "frees", "bytes", "peak live", "avg life",
+          "max life");
+  for (uint64_t i = 0; i < num_rows; i++) {
+    const svm_stats_site_t *s = &stats->sites[rows[i].site];
+    char name[32];
+    uint64_t line = svm_symbols_line_at(symbols, rows[i].site);
+    if (line != 0) {
+      snprintf(name, sizeof(name), "%lu (line %lu)", rows[i].site, line);
+    } else {
+      snprintf(name, sizeof(name), "%lu", rows[i].site);
+    }
+    fprintf(out, "  %-18s %10lu %10lu %12lu %12lu %12.1f %12lu\n", name, s->allocs, s->frees, s->bytes,
+            s->peak_live_bytes, s->frees != 0 ? (double)s->lifetime / s->frees : 0.0, s->max_lifetime);
+  }
+  free(rows);
+}
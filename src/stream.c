@@ -0,0 +1,156 @@
+#include "svm/stream.h"
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/value.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+static svm_err_t run_record(svm_t *svm, svm_stream_stats_t *stats)
+{
+  // svm_reset frees what the record left allocated, so there is nothing to warn about, and the addresses would end up
+  // on stdout among the results.
+  svm_err_t err = svm_run_quiet(svm);
+  stats->records++;
+  if (err != SVM_ERR_OK) {
+    stats->failed++;
+  }
+  return err;
+}
+
+static bool parse_value(const char *str, svm_value_t *value)
+{
+  char *end;
+  if (strchr(str, '.') != NULL) {
+    *value = SVM_VALUE_F64(strtod(str, &end));
+  } else {
+    *value = SVM_VALUE_I64(strtoll(str, &end, 0));
+  }
+  return *str != '\0' && *end == '\0';
+}
+
+static char *trim(char *str)
+{
+  while (*str == ' ' || *str == '\t') {
+    str++;
+  }
+  char *end = str + strlen(str);
+  while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+    end--;
+  }
+  *end = '\0';
+  return str;
+}
+
+// Put the values of a CSV line on the stack of svm. Returns false if the line is malformed, and sets err to
+// SVM_ERR_STACK_OVERFLOW if there are more values than fit on the stack.
+static bool parse_line(svm_t *svm, char *line, uint64_t line_number, svm_err_t *err)
+{
+  *err = SVM_ERR_OK;
+  line = trim(line);
+  if (*line == '\0') {
+    return true;
+  }
+  char *save;
+  for (char *field = strtok_r(line, ",", &save); field != NULL; field = strtok_r(NULL, ",", &save)) {
+    field = trim(field);
+    svm_value_t value;
+    if (!parse_value(field, &value)) {
+      fprintf(stderr, "Error: Invalid value '%s' on line %lu.\n", field, line_number);
+      return false;
+    }
+    if (svm->stack_ptr >= SVM_STACK_SIZE) {
+      *err = SVM_ERR_STACK_OVERFLOW;
+      continue;
+    }
+    svm->stack[svm->stack_ptr++] = value;
+  }
+  return true;
+}
+
+static bool stream_csv(svm_t *svm, FILE *in, FILE *out, svm_stream_stats_t *stats)
+{
+  char *line = NULL;
+  size_t capacity = 0;
+  uint64_t line_number = 0;
+  bool ok = true;
+  while (getline(&line, &capacity, in) != -1) {
+    line_number++;
+    svm_reset(svm);
+    svm_err_t err;
+    if (!parse_line(svm, line, line_number, &err)) {
+      ok = false;
+      break;
+    }
+    if (err == SVM_ERR_OK) {
+      err = run_record(svm, stats);
+    } else {
+      stats->records++;
+      stats->failed++;
+    }
+
+    fprintf(out, "%d", err);
+    // Floats as well, since nothing says which slots hold them.
+    for (uint64_t i = 0; err == SVM_ERR_OK && i < svm->stack_ptr; i++) {
+      fprintf(out, ",%ld", svm->stack[i].as_i64);
+    }
+    if (fputc('\n', out) == EOF) {
+      ok = false;
+      break;
+    }
+  }
+  free(line);
+  return ok && !ferror(in);
+}
+
+static bool stream_binary(svm_t *svm, FILE *in, FILE *out, svm_stream_stats_t *stats)
+{
+  uint64_t count;
+  size_t got;
+  while ((got = fread(&count, 1, sizeof(count), in)) == sizeof(count)) {
+    svm_reset(svm);
+    uint64_t fits = count < SVM_STACK_SIZE ? count : SVM_STACK_SIZE;
+    if (fread(svm->stack, sizeof(*svm->stack), fits, in) != fits) {
+      fprintf(stderr, "Error: Truncated record %lu.\n", stats->records + 1);
+      return false;
+    }
+    svm_err_t err;
+    if (fits < count) {
+      // Skip the values that don't fit, to get to the next record.
+      for (uint64_t i = fits; i < count; i++) {
+        svm_value_t skipped;
+        if (fread(&skipped, sizeof(skipped), 1, in) != 1) {
+          fprintf(stderr, "Error: Truncated record %lu.\n", stats->records + 1);
+          return false;
+        }
+      }
+      err = SVM_ERR_STACK_OVERFLOW;
+      stats->records++;
+      stats->failed++;
+    } else {
+      svm->stack_ptr = count;
+      err = run_record(svm, stats);
+    }
+
+    uint64_t header[2] = {err, err == SVM_ERR_OK ? svm->stack_ptr : 0};
+    if (fwrite(header, sizeof(*header), 2, out) != 2 ||
+        fwrite(svm->stack, sizeof(*svm->stack), header[1], out) != header[1]) {
+      return false;
+    }
+  }
+  if (got != 0) {
+    fprintf(stderr, "Error: Truncated record %lu.\n", stats->records + 1);
+    return false;
+  }
+  return !ferror(in);
+}
+
+bool svm_stream_run(svm_t *svm, FILE *in, FILE *out, svm_stream_format_t format, svm_stream_stats_t *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  bool ok = format == SVM_STREAM_BINARY ? stream_binary(svm, in, out, stats) : stream_csv(svm, in, out, stats);
+  return fflush(out) == 0 && ok;
+}
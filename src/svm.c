@@ -1,514 +1,386 @@
 #include "svm/svm.h"
 #include "svm/err.h"
-#include "svm/value.h"
-#include "svm/instructions.h"
-
+#include "svm/perf.h"
+#include "svm/debug.h"
+#include "svm/profile.h"
+#include "svm/chan.h"
+#include "svm/memo.h"
+#include "svm/stream.h"
+#include "svm/symbols.h"
+#include "svm/trace.h"
+#include "svm/stats.h"
+#include "svm/io.h"
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
+
+#define DEFAULT_PROFILE_HZ 997
+#define DEFAULT_MEMO_SIZE 4096
 
 static void usage()
 {
-  fprintf(stderr, "Usage: svm [FILE]\n");
+  fprintf(stderr, "Usage: svm [OPTIONS] [FILE]\n");
   fprintf(stderr, "Run the given binary file on the SVM.\n");
+  fprintf(stderr, "With --stream, run it once for every record of initial stack values read from stdin, and write the\n");
+  fprintf(stderr, "result of each run to stdout.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --workers N      Run fibers on N worker threads (default: one per CPU).\n");
+  fprintf(stderr, "  --engine ENGINE  Run the program with the 'stack' (default) or 'reg' engine.\n");
+  fprintf(stderr, "  --no-quicken     Don't specialize instructions based on how they behave at run time.\n");
+  fprintf(stderr, "  --profile FILE   Sample where the program is and write the call stacks to FILE in folded\n");
+  fprintf(stderr, "                   format. Programs that spawn fibers aren't supported.\n");
+  fprintf(stderr, "  --profile-hz N   Take N samples per second of CPU time (default: %d).\n", DEFAULT_PROFILE_HZ);
+  fprintf(stderr, "  --trace-calls FILE\n");
+  fprintf(stderr, "                   Time every call and write them to FILE as Chrome trace events, then print the\n");
+  fprintf(stderr, "                   inclusive and exclusive time of every function. Programs that spawn fibers\n");
+  fprintf(stderr, "                   aren't supported, and the calls parfor makes aren't traced.\n");
+  fprintf(stderr, "  --memo-size N    Cache up to N results of memo functions (default: %d). 0 turns memo off.\n",
+          DEFAULT_MEMO_SIZE);
+  fprintf(stderr, "  --memo-stats     Print the hits, misses and evictions of the memo cache when done.\n");
+  fprintf(stderr, "  --heap-stats     Print how high the stacks got and what every alloc instruction allocated when\n");
+  fprintf(stderr, "                   done.\n");
+  fprintf(stderr, "  --no-io          Make the I/O instructions fail, so the program can't touch files.\n");
+  fprintf(stderr, "  --no-io-uring    Do io_submit requests on the spot, blocking, instead of through io_uring.\n");
+  fprintf(stderr, "  --io-stats       Print how many bytes the I/O instructions moved, in how many system calls, when\n");
+  fprintf(stderr, "                   done.\n");
+  fprintf(stderr, "  --stream         Run the program on a stream of records (see svm/stream.h for the formats).\n");
+  fprintf(stderr, "                   Can't be combined with --trace-calls, --profile, --debug or --perf-stat.\n");
+  fprintf(stderr, "  --stream-input FILE\n");
+  fprintf(stderr, "                   Read the records from FILE instead of stdin.\n");
+  fprintf(stderr, "  --stream-format FORMAT\n");
+  fprintf(stderr, "                   Read and write records as 'csv' (default) or 'binary'.\n");
+  fprintf(stderr, "  --debug          Run the program in an interactive debugger on the stack engine.\n");
+  fprintf(stderr, "  --perf-stat      Count cycles, instructions, branch misses and cache misses per opcode and per\n");
+  fprintf(stderr, "                   block, using the stack engine. Programs that spawn fibers aren't supported.\n");
 }
 
-static bool find_addr(svm_t *svm, void *addr, uint64_t *idx)
+int main (int argc, char *argv[])
 {
-  for (uint64_t i = 0; i < SVM_HEAP_ADDRS_SIZE; i++) {
-    // If we get to a NULL addr we can stop.
-    if (svm->heap_addrs[i] == NULL) {
-      return false;
-    }
-    if (svm->heap_addrs[i] == addr) {
-      *idx = i;
-      return true;
+  for (int i = 0; i < argc; i++) {
+    if (strncmp(argv[i], "--help", 6) == 0) {
+      usage();
+      return 0;
     }
   }
-  return false;
-}
-
-void svm_init(svm_t *svm)
-{
-  svm->halted = false;
-
-  memset(svm->stack, 0, sizeof(svm->stack));
-  svm->stack_ptr = 0;
-
-  memset(svm->program, 0, sizeof(svm->program));
-  svm->program_size = 0;
-  svm->ip = 0;
 
-  memset(svm->call_stack, 0, sizeof(svm->call_stack));
-  svm->call_stack_ptr = 0;
-
-  memset(svm->heap_addrs, 0, sizeof(svm->heap_addrs));
-  svm->heap_addrs_ptr = 0;
-}
-
-bool svm_load_program_from_array(svm_t *svm, svm_instruction_t *instructions, uint32_t program_size)
-{
-  if (program_size > SVM_MAX_PROGRAM_SIZE) {
-    return false;
+  const char *input_file = NULL;
+  uint32_t workers = 0;
+  svm_engine_t engine = SVM_ENGINE_STACK;
+  bool quicken = true;
+  bool perf_stat = false;
+  bool debug = false;
+  const char *profile_file = NULL;
+  const char *trace_file = NULL;
+  uint32_t profile_hz = DEFAULT_PROFILE_HZ;
+  uint64_t memo_size = DEFAULT_MEMO_SIZE;
+  bool memo_stats = false;
+  bool heap_stats = false;
+  bool io = true;
+  bool io_uring = true;
+  bool io_stats = false;
+  bool stream = false;
+  const char *stream_input = NULL;
+  svm_stream_format_t stream_format = SVM_STREAM_CSV;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--workers") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a number after '--workers'.\n");
+        usage();
+        return 1;
+      }
+      workers = strtoul(argv[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--no-quicken") == 0) {
+      quicken = false;
+      continue;
+    }
+    if (strcmp(argv[i], "--profile") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a file name after '--profile'.\n");
+        usage();
+        return 1;
+      }
+      profile_file = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--trace-calls") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a file name after '--trace-calls'.\n");
+        usage();
+        return 1;
+      }
+      trace_file = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--profile-hz") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a number after '--profile-hz'.\n");
+        usage();
+        return 1;
+      }
+      profile_hz = strtoul(argv[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--memo-size") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a number after '--memo-size'.\n");
+        usage();
+        return 1;
+      }
+      memo_size = strtoull(argv[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--memo-stats") == 0) {
+      memo_stats = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--heap-stats") == 0) {
+      heap_stats = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--no-io") == 0) {
+      io = false;
+      continue;
+    }
+    if (strcmp(argv[i], "--no-io-uring") == 0) {
+      io_uring = false;
+      continue;
+    }
+    if (strcmp(argv[i], "--io-stats") == 0) {
+      io_stats = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--stream-input") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a file name after '--stream-input'.\n");
+        usage();
+        return 1;
+      }
+      stream_input = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--stream-format") == 0) {
+      if (i + 1 < argc && strcmp(argv[i + 1], "csv") == 0) {
+        stream_format = SVM_STREAM_CSV;
+      } else if (i + 1 < argc && strcmp(argv[i + 1], "binary") == 0) {
+        stream_format = SVM_STREAM_BINARY;
+      } else {
+        fprintf(stderr, "Error: Expected 'csv' or 'binary' after '--stream-format'.\n");
+        usage();
+        return 1;
+      }
+      i++;
+      continue;
+    }
+    if (strcmp(argv[i], "--debug") == 0) {
+      debug = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--perf-stat") == 0) {
+      perf_stat = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--engine") == 0) {
+      if (i + 1 < argc && strcmp(argv[i + 1], "stack") == 0) {
+        engine = SVM_ENGINE_STACK;
+      } else if (i + 1 < argc && strcmp(argv[i + 1], "reg") == 0) {
+        engine = SVM_ENGINE_REG;
+      } else {
+        fprintf(stderr, "Error: Expected 'stack' or 'reg' after '--engine'.\n");
+        usage();
+        return 1;
+      }
+      i++;
+      continue;
+    }
+    if (input_file != NULL) {
+      fprintf(stderr, "Error: Too many arguments.\n");
+      usage();
+      return 1;
+    }
+    input_file = argv[i];
   }
 
-  svm->program_size = program_size;
-  memcpy(svm->program, instructions, program_size * sizeof(*instructions));
-  return true;
-}
-
-bool svm_load_program_from_file(svm_t *svm, const char *file_name)
-{
-  FILE *fd;
-
-  fd = fopen(file_name, "r");
-  if (fd == NULL) {
-    fprintf(stderr, "Error: Cannot open '%s'\n", file_name);
-    return false;
+  if (input_file == NULL) {
+    fprintf(stderr, "Error: No input file.\n");
+    usage();
+    return 1;
   }
-
-  uint64_t cnt = 0;
-  while (cnt < SVM_MAX_PROGRAM_SIZE) {
-    uint64_t type_value;
-    size_t num_read = fread(&type_value, 1, sizeof(type_value), fd);
-    if (num_read < 1) {
-      break;
-    }
-    svm_instruction_type_t type = (svm_instruction_type_t)type_value;
-
-    svm_value_t operand;
-    if (svm_instruction_type_needs_operand(type)) {
-      num_read = fread(&operand, 1, sizeof(operand), fd);
-      if (num_read < 1) {
-        break;
-      }
-    }
-
-    svm->program[cnt] = (svm_instruction_t){.type = type, .operand = operand};
-    cnt++;
+  // The stream runs the program on its own, so these would have nothing to look at.
+  if (stream && (trace_file != NULL || profile_file != NULL || debug || perf_stat)) {
+    fprintf(stderr, "Error: '--stream' can't be combined with '--trace-calls', '--profile', '--debug' or "
+                    "'--perf-stat'.\n");
+    usage();
+    return 1;
   }
-  svm->program_size = cnt;
-
-  fclose(fd);
-  return true;
-}
+  svm_t svm;
+  svm_init(&svm);
+  svm.sched_workers = workers;
+  svm.engine = engine;
+  svm.quicken = quicken;
 
-svm_err_t svm_exec_instruction(svm_t *svm)
-{
-  if (svm->ip >= svm->program_size) {
-    return SVM_ERR_IP_OVERFLOW;
+  if (!svm_load_program_from_file(&svm, input_file)) {
+    fprintf(stderr, "Error loading input file '%s'\n", input_file);
   }
-  svm_instruction_t instruction = svm->program[svm->ip];
-  svm->ip++;
-
-  switch (instruction.type) {
-    case  SVM_INST_NOP:
-      break;
-    case  SVM_INST_HALT:
-      svm->halted = true;
-      break;
-    case  SVM_INST_PUSH:
-      if (svm->stack_ptr >= SVM_STACK_SIZE) {
-        return SVM_ERR_STACK_OVERFLOW;
-      }
-      svm->stack[svm->stack_ptr++] = instruction.operand;
-      break;
-    case  SVM_INST_POP:
-      if (svm->stack_ptr == 0) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_COPY:
-      if (svm->stack_ptr >= SVM_STACK_SIZE) {
-        return SVM_ERR_STACK_OVERFLOW;
-      }
-      if (svm->stack_ptr < instruction.operand.as_u64) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      if (instruction.operand.as_u64 == 0) {
-        // stack_ptr points above the top of the stack so an offset of 0 is an overflow.
-        return SVM_ERR_STACK_OVERFLOW;
-      }
-      svm->stack[svm->stack_ptr] = svm->stack[svm->stack_ptr - instruction.operand.as_u64];
-      svm->stack_ptr++;
-      break;
-    case SVM_INST_SWAP:
-      if (svm->stack_ptr < instruction.operand.as_u64) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      if (instruction.operand.as_u64 == 0) {
-        // stack_ptr points above the top of the stack so an offset of 0 is an overflow.
-        return SVM_ERR_STACK_OVERFLOW;
-      }
-      svm_value_t tmp = svm->stack[svm->stack_ptr - 1];
-      svm->stack[svm->stack_ptr - 1] = svm->stack[svm->stack_ptr - instruction.operand.as_u64 - 1];
-      svm->stack[svm->stack_ptr - instruction.operand.as_u64 - 1] = tmp;
-      break;
-    case  SVM_INST_ADD_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_i64 += svm->stack[svm->stack_ptr - 1].as_i64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_SUB_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_i64 -= svm->stack[svm->stack_ptr - 1].as_i64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_MULT_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_i64 *= svm->stack[svm->stack_ptr - 1].as_i64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_DIV_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_i64 /= svm->stack[svm->stack_ptr - 1].as_i64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_ADD_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_u64 += svm->stack[svm->stack_ptr - 1].as_u64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_SUB_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_u64 -= svm->stack[svm->stack_ptr - 1].as_u64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_MULT_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_u64 *= svm->stack[svm->stack_ptr - 1].as_u64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_DIV_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_u64 /= svm->stack[svm->stack_ptr - 1].as_u64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_ADD_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_f64 += svm->stack[svm->stack_ptr - 1].as_f64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_SUB_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_f64 -= svm->stack[svm->stack_ptr - 1].as_f64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_MULT_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_f64 *= svm->stack[svm->stack_ptr - 1].as_f64;
-      svm->stack_ptr--;
-      break;
-    case  SVM_INST_DIV_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2].as_f64 /= svm->stack[svm->stack_ptr - 1].as_f64;
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_EQ:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_ptr == svm->stack[svm->stack_ptr - 1].as_ptr);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_NOT_EQ:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_ptr != svm->stack[svm->stack_ptr - 1].as_ptr);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_GT_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 > svm->stack[svm->stack_ptr - 1].as_i64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_GT_EQ_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 >= svm->stack[svm->stack_ptr - 1].as_i64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_LT_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 < svm->stack[svm->stack_ptr - 1].as_i64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_LT_EQ_I:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 <= svm->stack[svm->stack_ptr - 1].as_i64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_GT_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 > svm->stack[svm->stack_ptr - 1].as_u64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_GT_EQ_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 >= svm->stack[svm->stack_ptr - 1].as_u64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_LT_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 < svm->stack[svm->stack_ptr - 1].as_u64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_LT_EQ_U:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 <= svm->stack[svm->stack_ptr - 1].as_u64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_GT_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 > svm->stack[svm->stack_ptr - 1].as_f64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_GT_EQ_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 >= svm->stack[svm->stack_ptr - 1].as_f64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_LT_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 < svm->stack[svm->stack_ptr - 1].as_f64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_LT_EQ_F:
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 <= svm->stack[svm->stack_ptr - 1].as_f64);
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_JMP:
-      // Don't worry about checking bounds here because if the ip goes beyond the program size it will be caught in the
-      // next call to svm_exec_instruction.
-      svm->ip = instruction.operand.as_u64;
-      break;
-    case SVM_INST_JNZ:
-      if (svm->stack_ptr < 1) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      if (svm->stack[svm->stack_ptr - 1].as_i64 != 0) {
-        // See above note.
-        svm->ip = instruction.operand.as_u64;
-      }
-      svm->stack_ptr--;
-      break;
-    case SVM_INST_CALL:
-      if (svm->call_stack_ptr >= SVM_CALL_STACK_SIZE) {
-        return SVM_ERR_CALL_STACK_OVERFLOW;
-      }
-      svm->call_stack[svm->call_stack_ptr++] = svm->ip;
-      svm->ip = instruction.operand.as_u64;
-      break;
-    case SVM_INST_RET:
-      if (svm->call_stack_ptr < 1) {
-        return SVM_ERR_CALL_STACK_UNDERFLOW;
-      }
-      svm->ip = svm->call_stack[svm->call_stack_ptr - 1];
-      svm->call_stack_ptr--;
-      break;
-    case SVM_INST_ALLOC: {
-      if (svm->stack_ptr >= SVM_STACK_SIZE) {
-        return SVM_ERR_STACK_OVERFLOW;
-      }
-      if (svm->heap_addrs_ptr >= SVM_HEAP_ADDRS_SIZE) {
-        return SVM_ERR_ADDR_LIST_FULL;
-      }
-
-      // Allocate the address.
-      void* addr = malloc(instruction.operand.as_u64);
-      memset(addr, 0, instruction.operand.as_u64);
-      svm->heap_addrs[svm->heap_addrs_ptr++] = addr;
-
-      // Put the address on the stack.
-      svm->stack[svm->stack_ptr] = SVM_VALUE_PTR(addr);
-      svm->stack_ptr++;
-      break;
-    }
-    case SVM_INST_FREE: {
-      if (svm->stack_ptr < 1) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      // Find the address.
-      void* addr = svm->stack[svm->stack_ptr - 1].as_ptr;
-      if (addr == NULL) {
-        return SVM_ERR_ILLEGAL_ADDR;
-      }
-      uint64_t addr_idx;
-      bool found = find_addr(svm, addr, &addr_idx);
-      if (!found) {
-        return SVM_ERR_ILLEGAL_ADDR;
-      }
-
-      // Pop the addr from the stack and free it.
-      svm->stack_ptr--;
-      free(addr);
-
-      // Best case scenario is that the free'd addr was at the end.
-      if (addr_idx == svm->heap_addrs_ptr - 1) {
-        svm->heap_addrs_ptr--;
-        break;
-      }
-
-      // If it's not, we need to shift all the addrs that are past it down by one.
-      uint64_t remaining_addrs = svm->heap_addrs_ptr - 1 - addr_idx;
-      memmove(&svm->heap_addrs[addr_idx], &svm->heap_addrs[addr_idx + 1], remaining_addrs * sizeof(addr));
-      svm->heap_addrs_ptr--;
-      break;
-    }
-    case SVM_INST_READ: {
-      if (svm->stack_ptr < 1) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      void* addr = svm->stack[svm->stack_ptr - 1].as_ptr;
-      uint64_t addr_idx;
-      bool found = find_addr(svm, addr, &addr_idx);
-      if (!found) {
-        return SVM_ERR_ILLEGAL_ADDR;
-      }
-      memcpy(&svm->stack[svm->stack_ptr - 1], addr, sizeof(svm_value_t));
-      break;
+  // The signal handler reads the VM on the main thread, and fibers run on carriers on the worker threads.
+  if (profile_file != NULL && svm_spawns_fibers(&svm)) {
+    fprintf(stderr, "Error: Programs that spawn fibers can't be profiled.\n");
+    return 1;
+  }
+  // Like the profiler, the trace only sees the calls made on the VM itself.
+  if (trace_file != NULL && svm_spawns_fibers(&svm)) {
+    fprintf(stderr, "Error: Programs that spawn fibers can't be traced.\n");
+    return 1;
+  }
+  // Labels for the profile and the trace, if the program was assembled with svmasm -g.
+  svm_symbols_t symbols;
+  bool has_symbols = svm_symbols_read(input_file, &symbols);
+
+  svm_memo_t memo;
+  if (memo_size > 0) {
+    if (!svm_memo_init(&memo, memo_size)) {
+      fprintf(stderr, "Error: Failed to allocate the memo cache.\n");
+      return 1;
     }
-    case SVM_INST_WRITE: {
-      if (svm->stack_ptr < 2) {
-        return SVM_ERR_STACK_UNDERFLOW;
-      }
-      void* addr = svm->stack[svm->stack_ptr - 2].as_ptr;
-      memcpy(addr, &svm->stack[svm->stack_ptr - 1], sizeof(svm_value_t));
-      svm->stack_ptr -= 2;
-      break;
-    }
-    default:
-      return SVM_ERR_ILLEGAL_INSTRUCTION;
-      break;
+    svm.memo = &memo;
   }
 
-  return SVM_ERR_OK;
-}
-
-svm_err_t svm_run(svm_t *svm) {
-  while (!svm->halted) {
-    svm_err_t err = svm_exec_instruction(svm);
-    if (err != SVM_ERR_OK) {
-      return err;
+  // On the heap, since the table of live blocks is large.
+  svm_stats_t *mem_stats = NULL;
+  if (heap_stats) {
+    mem_stats = malloc(sizeof(*mem_stats));
+    if (mem_stats == NULL || !svm_stats_init(mem_stats, &svm)) {
+      fprintf(stderr, "Error: Failed to allocate the memory statistics.\n");
+      return 1;
     }
   }
-  if (svm->heap_addrs_ptr != 0) {
-    char* plural_char = svm->heap_addrs_ptr == 1 ? "" : "es";
-    fprintf(stderr, "WARNING: %li address%s leaked.\n", svm->heap_addrs_ptr, plural_char);
-    svm_print_addr_list(svm);
-  }
-  return SVM_ERR_OK;
-}
 
-void svm_print_stack(svm_t *svm)
-{
-  printf("Stack: \n");
-  if (svm->stack_ptr == 0) {
-    printf("  [empty]\n");
-  } else {
-    uint64_t cnt = svm->stack_ptr;
-    do {
-      cnt--;
-      svm_value_t value = svm->stack[cnt];
-      printf("  i64: %ld | u64: %lu | f64: %f | ptr: %p\n", value.as_i64, value.as_u64, value.as_f64, value.as_ptr);
-    } while (cnt != 0);
+  svm_io_t files;
+  if (io) {
+    svm_io_init(&files, &svm, io_uring);
   }
-}
 
-void svm_print_addr_list(svm_t *svm)
-{
-  printf("Addrs: \n");
-  if (svm->heap_addrs_ptr == 0) {
-    printf("  [empty]\n");
-  } else {
-    for (uint64_t i = 0; i < svm->heap_addrs_ptr; i++) {
-      printf("  %p\n", svm->heap_addrs[i]);
+  if (stream) {
+    FILE *in = stream_input != NULL ? fopen(stream_input, stream_format == SVM_STREAM_BINARY ? "rb" : "r") : stdin;
+    if (in == NULL) {
+      fprintf(stderr, "Error: Cannot open '%s': %s\n", stream_input, strerror(errno));
+      return 1;
     }
-  }
-}
-
-int main (int argc, char *argv[])
-{
-  for (int i = 0; i < argc; i++) {
-    if (strncmp(argv[i], "--help", 6) == 0) {
-      usage();
-      return 0;
+    svm_stream_stats_t stats;
+    bool ok = svm_stream_run(&svm, in, stdout, stream_format, &stats);
+    if (in != stdin) {
+      fclose(in);
+    }
+    if (stats.failed != 0) {
+      fprintf(stderr, "WARNING: %lu of %lu records failed.\n", stats.failed, stats.records);
+    }
+    svm_reset(&svm);
+    if (svm.io != NULL) {
+      svm_io_free(&files);
+      if (io_stats) {
+        svm_io_print(&files, stderr);
+      }
     }
+    if (mem_stats != NULL) {
+      svm_stats_print(mem_stats, has_symbols ? &symbols : NULL, stderr);
+      svm_stats_free(mem_stats);
+      free(mem_stats);
+    }
+    svm_chan_unbind_all(&svm);
+    if (svm.memo != NULL) {
+      if (memo_stats) {
+        svm_memo_print(&memo, stderr);
+      }
+      svm_memo_free(&memo);
+    }
+    return ok && stats.failed == 0 ? 0 : 1;
   }
 
-  if (argc < 2) {
-    fprintf(stderr, "Error: No input file.\n");
-    usage();
+  svm_trace_t trace;
+  if (trace_file != NULL && !svm_trace_start(&trace, &svm)) {
+    fprintf(stderr, "Error: Failed to start the call trace.\n");
     return 1;
   }
-  if (argc > 2) {
-    fprintf(stderr, "Error: Too many arguments.\n");
-    usage();
-    return 1;
-  }
-  svm_t svm;
-  svm_init(&svm);
 
-  if (!svm_load_program_from_file(&svm, argv[1])) {
-    fprintf(stderr, "Error loading input file '%s'\n", argv[1]);
+  svm_err_t result;
+  if (debug) {
+    svm_debugger_t dbg;
+    svm_debug_init(&dbg, &svm);
+    result = svm_debug_repl(&dbg, stdin, stdout);
+  } else if (perf_stat) {
+    svm_perf_t perf;
+    if (!svm_perf_open(&perf)) {
+      fprintf(stderr, "Error: Failed to open performance counters: %s\n", strerror(errno));
+      return 1;
+    }
+    result = svm_perf_run(&svm, &perf);
+    svm_perf_print(&perf, stderr);
+    svm_perf_close(&perf);
+  } else if (profile_file != NULL) {
+    svm_profile_t profile;
+    if (!svm_profile_start(&profile, &svm, profile_hz)) {
+      fprintf(stderr, "Error: Failed to start the profiler.\n");
+      return 1;
+    }
+    result = svm_run(&svm);
+    svm_profile_stop(&profile);
+    if (!svm_profile_write_folded(&profile, &svm, has_symbols ? symbols.labels : NULL, profile_file)) {
+      fprintf(stderr, "Error: Failed to write profile '%s'\n", profile_file);
+    }
+    if (profile.dropped != 0) {
+      fprintf(stderr, "WARNING: %lu of %lu samples dropped, too many distinct stacks.\n", profile.dropped,
+              profile.samples);
+    }
+    svm_profile_free(&profile);
+  } else {
+    result = svm_run(&svm);
   }
-
-  svm_err_t result = svm_run(&svm);
   if (result != SVM_ERR_OK) {
     fprintf(stderr, "Error: %s\n", svm_err_to_string(result));
   }
+  if (trace_file != NULL) {
+    svm_trace_stop(&trace, &svm);
+    if (!svm_trace_write_json(&trace, has_symbols ? &symbols : NULL, trace_file)) {
+      fprintf(stderr, "Error: Failed to write trace '%s'\n", trace_file);
+    }
+    svm_trace_print(&trace, has_symbols ? &symbols : NULL, stderr);
+    svm_trace_free(&trace);
+  }
+  if (mem_stats != NULL) {
+    // The state the program ended in.
+    svm_stats_sample(mem_stats, &svm);
+    svm_stats_print(mem_stats, has_symbols ? &symbols : NULL, stderr);
+    svm_stats_free(mem_stats);
+    free(mem_stats);
+  }
+  if (has_symbols) {
+    svm_symbols_free(&symbols);
+  }
+  // What the program wrote comes before the stack.
+  if (svm.io != NULL) {
+    svm_io_free(&files);
+    if (io_stats) {
+      svm_io_print(&files, stderr);
+    }
+  }
   svm_print_stack(&svm);
+  svm_chan_unbind_all(&svm);
+  if (svm.memo != NULL) {
+    if (memo_stats) {
+      svm_memo_print(&memo, stderr);
+    }
+    svm_memo_free(&memo);
+  }
 
   return result;
 }
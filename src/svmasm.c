@@ -1,5 +1,6 @@
 #include "svm/svm.h"
 #include "svm/label_list.h"
+#include "svm/symbols.h"
 #include "svm/instructions.h"
 
 #include <errno.h>
@@ -7,17 +8,34 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <libgen.h>
 
+// Long enough for the labels of a big jump table.
+#define LINE_SIZE 4096
+
 static void usage()
 {
-  fprintf(stderr, "Usage: svmasm [FILE]\n");
+  fprintf(stderr, "Usage: svmasm [OPTIONS] [FILE]\n");
   fprintf(stderr, "Compile the given svm assembly file into an svm binary.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -g, --symbols  Add a symbol section with the labels and the source line of every instruction.\n");
+}
+
+// Record that the next instruction comes from line lineno.
+static void add_line(svm_symbols_t *symbols, uint64_t *capacity, uint64_t lineno)
+{
+  if (symbols->num_lines == *capacity) {
+    *capacity = *capacity == 0 ? 256 : *capacity * 2;
+    symbols->lines = realloc(symbols->lines, *capacity * sizeof(*symbols->lines));
+  }
+  symbols->lines[symbols->num_lines++] = lineno;
 }
 
 static svm_label_list_t *translate_labels(FILE *in_fd)
 {
-  char line[256];
+  char line[LINE_SIZE];
   svm_label_list_t* list = NULL;
   uint64_t instruction_cnt = 0;
   uint64_t num_labels = 0;
@@ -49,6 +67,14 @@ static svm_label_list_t *translate_labels(FILE *in_fd)
       continue;
     }
     instruction_cnt++;
+
+    // A jump table is followed by one entry per label.
+    svm_instruction_type_t type;
+    if (svm_instruction_type_from_string(token, &type) && type == SVM_INST_JTAB) {
+      while ((token = strtok(NULL, " \n")) != NULL && token[0] != ';') {
+        instruction_cnt++;
+      }
+    }
   }
   rewind(in_fd);
 
@@ -121,18 +147,25 @@ int main (int argc, char *argv[])
     }
   }
 
-  if (argc < 2) {
-    fprintf(stderr, "Error: No input file.\n");
-    usage();
-    return 1;
+  char *input_file = NULL;
+  bool emit_symbols = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--symbols") == 0) {
+      emit_symbols = true;
+      continue;
+    }
+    if (input_file != NULL) {
+      fprintf(stderr, "Error: Too many arguments.\n");
+      usage();
+      return 1;
+    }
+    input_file = argv[i];
   }
-  if (argc > 2) {
-    fprintf(stderr, "Error: Too many arguments.\n");
+  if (input_file == NULL) {
+    fprintf(stderr, "Error: No input file.\n");
     usage();
     return 1;
   }
-
-  char *input_file = argv[1];
   char output_file[256] = {0};
 
   // Copy the input file name so we can strip the extension off.
@@ -162,9 +195,14 @@ int main (int argc, char *argv[])
   }
 
   svm_label_list_t *labels = translate_labels(in_fd);
+  svm_symbols_t symbols = {.labels = labels};
+  uint64_t lines_capacity = 0;
+  // The targets of the jump table being assembled, grown as its labels are read.
+  uint64_t *targets = NULL;
+  uint64_t targets_capacity = 0;
 
   int exitcode = 0;
-  char line[256];
+  char line[LINE_SIZE];
   uint64_t lineno = 0;
   while (fgets(line, sizeof(line), in_fd)) {
     lineno++;
@@ -200,7 +238,62 @@ int main (int argc, char *argv[])
       goto cleanup;
     }
 
+    // An arithmetic or comparison instruction followed by an operand uses its immediate form.
+    token = strtok(NULL, " \n");
+    if (token != NULL && token[0] != ';') {
+      svm_instruction_type_t imm_type;
+      if (svm_instruction_type_to_immediate(type, &imm_type)) {
+        type = imm_type;
+      }
+    }
+
+    // jtab DEFAULT LABEL... is written as jtab n followed by an entry for the default label and one for each of the n
+    // labels after it.
+    if (type == SVM_INST_JTAB) {
+      if (token == NULL || token[0] == ';') {
+        fprintf(stderr, "Error: %s:%lu\n", input_file, lineno);
+        fprintf(stderr, "  Expected a default label after '%s' instruction.\n", svm_instruction_type_to_string(type));
+        exitcode = 1;
+        goto cleanup;
+      }
+      uint64_t num_targets = 0;
+      while (token != NULL && token[0] != ';') {
+        svm_label_list_t *label = svm_label_list_find(labels, token);
+        if (label == NULL) {
+          fprintf(stderr, "Error: %s:%lu\n", input_file, lineno);
+          fprintf(stderr, "  Unknown label '%s'\n", token);
+          exitcode = 1;
+          goto cleanup;
+        }
+        if (num_targets == targets_capacity) {
+          targets_capacity = targets_capacity == 0 ? 16 : targets_capacity * 2;
+          targets = realloc(targets, targets_capacity * sizeof(*targets));
+        }
+        targets[num_targets++] = label->address;
+        token = strtok(NULL, " \n");
+      }
+
+      for (uint64_t i = 0; i <= num_targets; i++) {
+        add_line(&symbols, &lines_capacity, lineno);
+      }
+      uint64_t words[2] = {(uint64_t)SVM_INST_JTAB, num_targets - 1};
+      bool written = fwrite(words, sizeof(words), 1, out_fd) != 0;
+      for (uint64_t i = 0; i < num_targets && written; i++) {
+        words[0] = (uint64_t)SVM_INST_JTAB_ENTRY;
+        words[1] = targets[i];
+        written = fwrite(words, sizeof(words), 1, out_fd) != 0;
+      }
+      if (!written) {
+        fprintf(stderr, "Error: %s:%lu\n", input_file, lineno);
+        fprintf(stderr, "  Cannot write jump table to output file.\n");
+        exitcode = 1;
+        goto cleanup;
+      }
+      continue;
+    }
+
     // Write the instruction to the output.
+    add_line(&symbols, &lines_capacity, lineno);
     uint64_t type_value = (uint64_t)type;
     if (fwrite(&type_value, sizeof(type_value), 1, out_fd) == 0) {
       fprintf(stderr, "Error: %s:%lu\n", input_file, lineno);
@@ -214,8 +307,7 @@ int main (int argc, char *argv[])
       continue;
     }
 
-    token = strtok(NULL, " \n");
-    if (token == NULL) {
+    if (token == NULL || token[0] == ';') {
       fprintf(stderr, "Error: %s:%lu\n", input_file, lineno);
       fprintf(stderr, "  Expected an operand after '%s' instruction.\n", svm_instruction_type_to_string(type));
       exitcode = 1;
@@ -236,6 +328,14 @@ int main (int argc, char *argv[])
       }
 
       value.as_u64 = label->address;
+    } else if (svm_instruction_type_operand(type) == SVM_OPERAND_F64) {
+      // The type of the instruction already says the operand is an f64, so the 'f' is optional.
+      if (!parse_f64(token, &value.as_f64)) {
+        fprintf(stderr, "Error: %s:%lu\n", input_file, lineno);
+        fprintf(stderr, "  Cannot parse f64 '%s'\n", token);
+        exitcode = 1;
+        goto cleanup;
+      }
     } else {
       // If its not a label then use the letter after the number to work out what kind of number it is.
       switch (token[strlen(token) - 1]) {
@@ -275,8 +375,17 @@ int main (int argc, char *argv[])
     }
   }
 
+  if (emit_symbols) {
+    symbols.source = strdup(input_file);
+    if (!svm_symbols_write(out_fd, &symbols)) {
+      fprintf(stderr, "Error: Cannot write symbols to output file '%s'\n", output_file);
+      exitcode = 1;
+    }
+  }
+
 cleanup:
-  svm_label_list_free(labels);
+  free(targets);
+  svm_symbols_free(&symbols);
   fclose(in_fd);
   fclose(out_fd);
 
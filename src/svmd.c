@@ -0,0 +1,556 @@
+#include "svm/svm.h"
+#include "svm/err.h"
+#include "svm/value.h"
+#include "svm/object.h"
+#include "svm/instructions.h"
+#include "svm/chan.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Requests and replies are sequences of native endian u64 words, sent over a Unix domain socket. A connection can
+ * carry any number of requests, each answered before the next is read.
+ *
+ *   load: SVMD_OP_LOAD, byte count, object file bytes (padded with zeroes to a multiple of 8)
+ *         -> status, program id
+ *   run:  SVMD_OP_RUN, program id, stack size, stack values from the bottom up
+ *         -> status, svm_err_t, stack size, stack values from the bottom up
+ *
+ * The program id is a hash of the object file, or the next id up that no other cached program has if the hash
+ * collides, so loading the same program again is answered from the cache.
+ *
+ * Every run is limited to a number of instructions, and ends with SVM_ERR_OUT_OF_FUEL when it runs out, so that a
+ * program that doesn't halt can't take a worker for good. Fibers and parfor calls run outside that budget, so
+ * programs that spawn or parfor are refused.
+ */
+
+#define DEFAULT_WORKERS 4
+#define DEFAULT_MAX_INSTRUCTIONS 100000000
+// Programs kept decoded and verified. Loading another one evicts the one that was used least recently.
+#define CACHE_SIZE 64
+#define MAX_OBJECT_SIZE (SVM_MAX_PROGRAM_SIZE * 2 * sizeof(uint64_t))
+
+typedef enum {
+  SVMD_OP_LOAD = 1,
+  SVMD_OP_RUN = 2,
+} svmd_op_t;
+
+typedef enum {
+  SVMD_OK = 0,
+  SVMD_BAD_REQUEST = 1,
+  SVMD_INVALID_PROGRAM = 2,
+  SVMD_UNKNOWN_PROGRAM = 3,
+  SVMD_UNSUPPORTED_PROGRAM = 4,
+} svmd_status_t;
+
+typedef struct {
+  bool used;
+  uint64_t id;
+  uint64_t last_used;
+  // The object file, to tell programs whose hashes collide apart.
+  uint64_t object_size;
+  uint8_t object[MAX_OBJECT_SIZE];
+  uint64_t size;
+  svm_instruction_t program[SVM_MAX_PROGRAM_SIZE];
+} cache_entry_t;
+
+static struct {
+  pthread_mutex_t lock;
+  uint64_t clock;
+  cache_entry_t entries[CACHE_SIZE];
+} cache = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int listen_fd;
+static uint64_t max_instructions = DEFAULT_MAX_INSTRUCTIONS;
+
+static void usage()
+{
+  fprintf(stderr, "Usage: svmd [OPTIONS] SOCKET\n");
+  fprintf(stderr, "       svmd --run SOCKET FILE [VALUE...]\n");
+  fprintf(stderr, "Serve requests to run programs on the SVM from the Unix domain socket SOCKET.\n");
+  fprintf(stderr, "With --run, load FILE into the server at SOCKET, run it with the given values on the stack\n");
+  fprintf(stderr, "(bottom first, integers or floats with a '.') and print the final stack.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --workers N      Serve up to N connections at the same time (default: %d).\n", DEFAULT_WORKERS);
+  fprintf(stderr, "  --max-instructions N\n");
+  fprintf(stderr, "                   Stop runs after N instructions with SVM_ERR_OUT_OF_FUEL (default: %d).\n",
+          DEFAULT_MAX_INSTRUCTIONS);
+}
+
+static uint64_t object_hash(const uint8_t *data, uint64_t length)
+{
+  // FNV-1a.
+  uint64_t hash = 14695981039346656037ull;
+  for (uint64_t i = 0; i < length; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+static bool read_full(int fd, void *buf, size_t length)
+{
+  uint8_t *p = buf;
+  while (length > 0) {
+    ssize_t n = read(fd, p, length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t length)
+{
+  const uint8_t *p = buf;
+  while (length > 0) {
+    // Don't die of SIGPIPE when the other side went away.
+    ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool read_word(int fd, uint64_t *word)
+{
+  return read_full(fd, word, sizeof(*word));
+}
+
+static bool write_words(int fd, const uint64_t *words, size_t count)
+{
+  return write_full(fd, words, count * sizeof(*words));
+}
+
+// Must be called with the cache locked.
+static cache_entry_t *cache_find(uint64_t id)
+{
+  for (uint64_t i = 0; i < CACHE_SIZE; i++) {
+    if (cache.entries[i].used && cache.entries[i].id == id) {
+      cache.entries[i].last_used = ++cache.clock;
+      return &cache.entries[i];
+    }
+  }
+  return NULL;
+}
+
+// Must be called with the cache locked. Find the program loaded from the object file data, and set id to its id, or to
+// the id it gets if it isn't cached.
+static cache_entry_t *cache_find_object(const uint8_t *data, uint64_t length, uint64_t *id)
+{
+  *id = object_hash(data, length);
+  while (true) {
+    cache_entry_t *entry = cache_find(*id);
+    if (entry == NULL) {
+      return NULL;
+    }
+    if (entry->object_size == length && memcmp(entry->object, data, length) == 0) {
+      return entry;
+    }
+    // Another program with the same hash. There are at most CACHE_SIZE of them, so this ends.
+    (*id)++;
+  }
+}
+
+// Must be called with the cache locked.
+static void cache_insert(uint64_t id, const uint8_t *data, uint64_t length, const svm_instruction_t *program,
+                         uint64_t size)
+{
+  cache_entry_t *victim = &cache.entries[0];
+  for (uint64_t i = 0; i < CACHE_SIZE; i++) {
+    cache_entry_t *entry = &cache.entries[i];
+    if (!entry->used) {
+      victim = entry;
+      break;
+    }
+    if (entry->last_used < victim->last_used) {
+      victim = entry;
+    }
+  }
+  victim->used = true;
+  victim->id = id;
+  victim->last_used = ++cache.clock;
+  victim->object_size = length;
+  memcpy(victim->object, data, length);
+  victim->size = size;
+  memcpy(victim->program, program, size * sizeof(*program));
+}
+
+// Whether all of the program runs on the VM itself, and so counts against the instruction budget of svm_run_for.
+// Channels are fine: the VM binds none, so every channel is one the program made, and a send or recv on it that can't
+// go ahead fails with SVM_ERR_DEADLOCK instead of blocking the worker.
+static bool within_budget(const svm_instruction_t *program, uint64_t size)
+{
+  for (uint64_t i = 0; i < size; i++) {
+    if (program[i].type == SVM_INST_SPAWN || program[i].type == SVM_INST_PARFOR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool serve_load(int fd)
+{
+  uint64_t length;
+  if (!read_word(fd, &length)) {
+    return false;
+  }
+  if (length > MAX_OBJECT_SIZE) {
+    uint64_t reply[2] = {SVMD_BAD_REQUEST, 0};
+    write_words(fd, reply, 2);
+    // The rest of the request can't be skipped reliably, so give up on the connection.
+    return false;
+  }
+  uint64_t padded = (length + sizeof(uint64_t) - 1) & ~(uint64_t)(sizeof(uint64_t) - 1);
+  uint8_t *data = malloc(padded > 0 ? padded : 1);
+  if (!read_full(fd, data, padded)) {
+    free(data);
+    return false;
+  }
+
+  uint64_t id;
+  pthread_mutex_lock(&cache.lock);
+  bool cached = cache_find_object(data, length, &id) != NULL;
+  pthread_mutex_unlock(&cache.lock);
+
+  svmd_status_t status = SVMD_OK;
+  if (!cached) {
+    svm_instruction_t *program = malloc(SVM_MAX_PROGRAM_SIZE * sizeof(*program));
+    uint64_t size;
+    if (!svm_object_decode(data, length, program, SVM_MAX_PROGRAM_SIZE, &size) || !svm_object_verify(program, size)) {
+      status = SVMD_INVALID_PROGRAM;
+    } else if (!within_budget(program, size)) {
+      status = SVMD_UNSUPPORTED_PROGRAM;
+    } else {
+      // Another connection may have loaded it, or taken the id, in the meantime.
+      pthread_mutex_lock(&cache.lock);
+      if (cache_find_object(data, length, &id) == NULL) {
+        cache_insert(id, data, length, program, size);
+      }
+      pthread_mutex_unlock(&cache.lock);
+    }
+    free(program);
+  }
+  free(data);
+
+  uint64_t reply[2] = {status, status == SVMD_OK ? id : 0};
+  return write_words(fd, reply, 2);
+}
+
+static bool serve_run(int fd, svm_t *svm)
+{
+  uint64_t header[2];
+  if (!read_word(fd, &header[0]) || !read_word(fd, &header[1])) {
+    return false;
+  }
+  uint64_t id = header[0];
+  uint64_t stack_size = header[1];
+  if (stack_size > SVM_STACK_SIZE) {
+    uint64_t reply[3] = {SVMD_BAD_REQUEST, SVM_ERR_OK, 0};
+    write_words(fd, reply, 3);
+    return false;
+  }
+
+  svm_init(svm);
+  if (!read_full(fd, svm->stack, stack_size * sizeof(*svm->stack))) {
+    return false;
+  }
+  svm->stack_ptr = stack_size;
+
+  pthread_mutex_lock(&cache.lock);
+  cache_entry_t *entry = cache_find(id);
+  if (entry != NULL) {
+    svm_load_program_from_array(svm, entry->program, entry->size);
+  }
+  pthread_mutex_unlock(&cache.lock);
+  if (entry == NULL) {
+    uint64_t reply[3] = {SVMD_UNKNOWN_PROGRAM, SVM_ERR_OK, 0};
+    return write_words(fd, reply, 3);
+  }
+
+  svm_err_t err = svm_run_for(svm, max_instructions);
+
+  // The VM is reused for the next request, so nothing the program left behind may outlive it.
+  for (uint64_t i = 0; i < svm->heap_addrs_ptr; i++) {
+    free(svm->heap_addrs[i]);
+  }
+  svm->heap_addrs_ptr = 0;
+  svm_chan_unbind_all(svm);
+
+  uint64_t reply[3] = {SVMD_OK, err, svm->stack_ptr};
+  return write_words(fd, reply, 3) && write_full(fd, svm->stack, svm->stack_ptr * sizeof(*svm->stack));
+}
+
+static void serve_connection(int fd, svm_t *svm)
+{
+  while (true) {
+    uint64_t op;
+    if (!read_word(fd, &op)) {
+      return;
+    }
+    bool ok;
+    if (op == SVMD_OP_LOAD) {
+      ok = serve_load(fd);
+    } else if (op == SVMD_OP_RUN) {
+      ok = serve_run(fd, svm);
+    } else {
+      uint64_t reply = SVMD_BAD_REQUEST;
+      write_words(fd, &reply, 1);
+      ok = false;
+    }
+    if (!ok) {
+      return;
+    }
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  (void)arg;
+  svm_t *svm = malloc(sizeof(*svm));
+  while (true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+      break;
+    }
+    serve_connection(fd, svm);
+    close(fd);
+  }
+  free(svm);
+  return NULL;
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr)
+{
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Error: Socket path '%s' is too long.\n", path);
+    return false;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+static int serve(const char *path, uint32_t workers)
+{
+  struct sockaddr_un addr;
+  if (!socket_address(path, &addr)) {
+    return 1;
+  }
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    fprintf(stderr, "Error: Cannot create socket: %s\n", strerror(errno));
+    return 1;
+  }
+  // Remove the socket a previous server left behind.
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+    fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+    close(listen_fd);
+    return 1;
+  }
+
+  pthread_t threads[workers];
+  uint32_t started = 0;
+  for (; started < workers; started++) {
+    if (pthread_create(&threads[started], NULL, worker_main, NULL) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    fprintf(stderr, "Error: Cannot start worker threads.\n");
+    close(listen_fd);
+    return 1;
+  }
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  close(listen_fd);
+  unlink(path);
+  return 1;
+}
+
+static bool parse_value(const char *str, svm_value_t *value)
+{
+  char *end;
+  if (strchr(str, '.') != NULL) {
+    *value = SVM_VALUE_F64(strtod(str, &end));
+  } else {
+    *value = SVM_VALUE_I64(strtoll(str, &end, 0));
+  }
+  return *str != '\0' && *end == '\0';
+}
+
+static int run_client(const char *path, const char *file_name, int num_values, char *values[])
+{
+  if (num_values > SVM_STACK_SIZE) {
+    fprintf(stderr, "Error: Too many values.\n");
+    return 1;
+  }
+  svm_value_t stack[SVM_STACK_SIZE];
+  for (int i = 0; i < num_values; i++) {
+    if (!parse_value(values[i], &stack[i])) {
+      fprintf(stderr, "Error: Invalid value '%s'\n", values[i]);
+      return 1;
+    }
+  }
+
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error: Cannot open '%s'\n", file_name);
+    return 1;
+  }
+  // Room for one byte more than the server takes, to notice files that are too big.
+  uint8_t *data = calloc(1, MAX_OBJECT_SIZE + sizeof(uint64_t));
+  uint64_t length = fread(data, 1, MAX_OBJECT_SIZE + 1, file);
+  fclose(file);
+  if (length > MAX_OBJECT_SIZE) {
+    fprintf(stderr, "Error: '%s' is too big.\n", file_name);
+    free(data);
+    return 1;
+  }
+
+  struct sockaddr_un addr;
+  if (!socket_address(path, &addr)) {
+    free(data);
+    return 1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Error: Cannot connect to '%s': %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(data);
+    return 1;
+  }
+
+  uint64_t padded = (length + sizeof(uint64_t) - 1) & ~(uint64_t)(sizeof(uint64_t) - 1);
+  uint64_t load[2] = {SVMD_OP_LOAD, length};
+  uint64_t load_reply[2];
+  bool ok = write_words(fd, load, 2) && write_full(fd, data, padded) && read_word(fd, &load_reply[0]) &&
+            read_word(fd, &load_reply[1]);
+  free(data);
+  if (!ok) {
+    fprintf(stderr, "Error: Lost the connection to '%s'\n", path);
+    close(fd);
+    return 1;
+  }
+  if (load_reply[0] != SVMD_OK) {
+    fprintf(stderr, "Error: The server rejected '%s' (status %lu)\n", file_name, load_reply[0]);
+    close(fd);
+    return 1;
+  }
+
+  uint64_t run[3] = {SVMD_OP_RUN, load_reply[1], (uint64_t)num_values};
+  uint64_t run_reply[3];
+  svm_t *svm = malloc(sizeof(*svm));
+  svm_init(svm);
+  ok = write_words(fd, run, 3) && write_full(fd, stack, num_values * sizeof(*stack)) &&
+       read_word(fd, &run_reply[0]) && read_word(fd, &run_reply[1]) && read_word(fd, &run_reply[2]) &&
+       run_reply[2] <= SVM_STACK_SIZE && read_full(fd, svm->stack, run_reply[2] * sizeof(*svm->stack));
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, "Error: Lost the connection to '%s'\n", path);
+    free(svm);
+    return 1;
+  }
+  if (run_reply[0] != SVMD_OK) {
+    fprintf(stderr, "Error: The server rejected the run (status %lu)\n", run_reply[0]);
+    free(svm);
+    return 1;
+  }
+
+  svm_err_t result = (svm_err_t)run_reply[1];
+  if (result != SVM_ERR_OK) {
+    fprintf(stderr, "Error: %s\n", svm_err_to_string(result));
+  }
+  svm->stack_ptr = run_reply[2];
+  svm_print_stack(svm);
+  free(svm);
+  return result;
+}
+
+int main (int argc, char *argv[])
+{
+  for (int i = 0; i < argc; i++) {
+    if (strncmp(argv[i], "--help", 6) == 0) {
+      usage();
+      return 0;
+    }
+  }
+
+  const char *socket_path = NULL;
+  uint32_t workers = DEFAULT_WORKERS;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--workers") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a number after '--workers'.\n");
+        usage();
+        return 1;
+      }
+      workers = strtoul(argv[++i], NULL, 10);
+      if (workers == 0) {
+        workers = 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--max-instructions") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a number after '--max-instructions'.\n");
+        usage();
+        return 1;
+      }
+      max_instructions = strtoull(argv[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--run") == 0) {
+      if (i + 2 >= argc) {
+        fprintf(stderr, "Error: Expected a socket and a file name after '--run'.\n");
+        usage();
+        return 1;
+      }
+      return run_client(argv[i + 1], argv[i + 2], argc - i - 3, argv + i + 3);
+    }
+    if (socket_path != NULL) {
+      fprintf(stderr, "Error: Too many arguments.\n");
+      usage();
+      return 1;
+    }
+    socket_path = argv[i];
+  }
+
+  if (socket_path == NULL) {
+    fprintf(stderr, "Error: No socket.\n");
+    usage();
+    return 1;
+  }
+  return serve(socket_path, workers);
+}
@@ -0,0 +1,96 @@
+#include "svm/svm.h"
+#include "svm/opt.h"
+#include "svm/object.h"
+#include "svm/instructions.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DEFAULT_INLINE_BUDGET 16
+
+static void usage()
+{
+  fprintf(stderr, "Usage: svmopt [OPTIONS] [FILE] [OUTPUT]\n");
+  fprintf(stderr, "Optimize the given svm binary file. The result is written to OUTPUT, or back to FILE if no OUTPUT is\n");
+  fprintf(stderr, "given.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --inline N  Inline functions of at most N instructions (default: %d, 0 disables inlining).\n", DEFAULT_INLINE_BUDGET);
+}
+
+int main (int argc, char *argv[])
+{
+  for (int i = 0; i < argc; i++) {
+    if (strncmp(argv[i], "--help", 6) == 0) {
+      usage();
+      return 0;
+    }
+  }
+
+  char *input_file = NULL;
+  char *output_file = NULL;
+  uint64_t inline_budget = DEFAULT_INLINE_BUDGET;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--inline") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected a number after '--inline'.\n");
+        usage();
+        return 1;
+      }
+      inline_budget = strtoul(argv[++i], NULL, 10);
+      continue;
+    }
+    if (input_file == NULL) {
+      input_file = argv[i];
+    } else if (output_file == NULL) {
+      output_file = argv[i];
+    } else {
+      fprintf(stderr, "Error: Too many arguments.\n");
+      usage();
+      return 1;
+    }
+  }
+
+  if (input_file == NULL) {
+    fprintf(stderr, "Error: No input file.\n");
+    usage();
+    return 1;
+  }
+  if (output_file == NULL) {
+    output_file = input_file;
+  }
+
+  svm_instruction_t *program = malloc(SVM_MAX_PROGRAM_SIZE * sizeof(*program));
+  uint64_t size;
+  if (!svm_object_read(input_file, program, SVM_MAX_PROGRAM_SIZE, &size)) {
+    fprintf(stderr, "Error: Failed to read input file '%s'\n", input_file);
+    free(program);
+    return 1;
+  }
+
+  // Before inlining, which turns the rets that end the life of frame blocks into jumps.
+  size = svm_opt_frame_allocs(program, size);
+  size = svm_opt_inline(program, size, SVM_MAX_PROGRAM_SIZE, inline_budget);
+
+  // Folding can make code unreachable, and removing code can line up more jumps to fold.
+  uint64_t prev_size;
+  do {
+    prev_size = size;
+    size = svm_opt_fold_constants(program, size);
+    size = svm_opt_remove_unreachable(program, size);
+  } while (size != prev_size);
+
+  // Last, so that folding sees the original arithmetic.
+  size = svm_opt_strength_reduce(program, size, SVM_MAX_PROGRAM_SIZE);
+
+  int exitcode = 0;
+  if (!svm_object_write(output_file, program, size)) {
+    fprintf(stderr, "Error: Failed to write output file '%s'\n", output_file);
+    exitcode = 1;
+  }
+
+  free(program);
+  return exitcode;
+}
@@ -0,0 +1,162 @@
+#include "svm/symbols.h"
+#include "svm/svm.h"
+#include "svm/object.h"
+#include "svm/label_list.h"
+#include "svm/instructions.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Anything longer is taken to be a corrupt file.
+#define MAX_NAME_LENGTH 4096
+
+static bool read_word(FILE *in, uint64_t *word)
+{
+  return fread(word, sizeof(*word), 1, in) == 1;
+}
+
+static bool write_word(FILE *out, uint64_t word)
+{
+  return fwrite(&word, sizeof(word), 1, out) == 1;
+}
+
+static char *read_name(FILE *in)
+{
+  uint64_t length;
+  if (!read_word(in, &length) || length > MAX_NAME_LENGTH) {
+    return NULL;
+  }
+  uint64_t padded = (length + 7) & ~(uint64_t)7;
+  char *name = calloc(padded + 1, 1);
+  if (fread(name, 1, padded, in) != padded) {
+    free(name);
+    return NULL;
+  }
+  name[length] = '\0';
+  return name;
+}
+
+static bool write_name(FILE *out, const char *name)
+{
+  uint64_t length = strlen(name);
+  uint64_t padding = ((length + 7) & ~(uint64_t)7) - length;
+  static const char zeros[8] = {0};
+  return write_word(out, length) && fwrite(name, 1, length, out) == length &&
+         fwrite(zeros, 1, padding, out) == padding;
+}
+
+// Skip the instructions of the program and the magic in front of the symbols.
+static bool find_section(FILE *in)
+{
+  uint64_t type_value;
+  while (read_word(in, &type_value)) {
+    if (type_value == SVM_OBJECT_SYMBOLS_MAGIC) {
+      return true;
+    }
+    if (type_value < SVM_INST_TYPE_COUNT && svm_instruction_type_needs_operand((svm_instruction_type_t)type_value)) {
+      uint64_t operand;
+      if (!read_word(in, &operand)) {
+        return false;
+      }
+    }
+  }
+  return false;
+}
+
+static bool read_section(FILE *in, svm_symbols_t *symbols)
+{
+  uint64_t num_labels;
+  if (!read_word(in, &num_labels)) {
+    return false;
+  }
+  svm_label_list_t *last = NULL;
+  for (uint64_t i = 0; i < num_labels; i++) {
+    uint64_t address;
+    char *name;
+    if (!read_word(in, &address) || (name = read_name(in)) == NULL) {
+      return false;
+    }
+    svm_label_list_t *node = svm_label_list_new(name, address);
+    free(name);
+    if (last == NULL) {
+      symbols->labels = node;
+    } else {
+      last->next = node;
+    }
+    last = node;
+  }
+
+  if (!read_word(in, &symbols->num_lines) || symbols->num_lines > SVM_MAX_PROGRAM_SIZE) {
+    return false;
+  }
+  symbols->lines = malloc(symbols->num_lines * sizeof(*symbols->lines) + 1);
+  if (fread(symbols->lines, sizeof(*symbols->lines), symbols->num_lines, in) != symbols->num_lines) {
+    return false;
+  }
+
+  symbols->source = read_name(in);
+  return symbols->source != NULL;
+}
+
+bool svm_symbols_read(const char *file_name, svm_symbols_t *symbols)
+{
+  memset(symbols, 0, sizeof(*symbols));
+  FILE *in = fopen(file_name, "rb");
+  if (in == NULL) {
+    return false;
+  }
+  bool ok = find_section(in) && read_section(in, symbols);
+  fclose(in);
+  if (!ok) {
+    svm_symbols_free(symbols);
+  }
+  return ok;
+}
+
+bool svm_symbols_write(FILE *out, const svm_symbols_t *symbols)
+{
+  uint64_t num_labels = 0;
+  for (svm_label_list_t *label = symbols->labels; label != NULL; label = label->next) {
+    num_labels++;
+  }
+
+  bool ok = write_word(out, SVM_OBJECT_SYMBOLS_MAGIC) && write_word(out, num_labels);
+  for (svm_label_list_t *label = symbols->labels; label != NULL && ok; label = label->next) {
+    ok = write_word(out, label->address) && write_name(out, label->label);
+  }
+  ok = ok && write_word(out, symbols->num_lines) &&
+       fwrite(symbols->lines, sizeof(*symbols->lines), symbols->num_lines, out) == symbols->num_lines;
+  return ok && write_name(out, symbols->source != NULL ? symbols->source : "");
+}
+
+void svm_symbols_free(svm_symbols_t *symbols)
+{
+  svm_label_list_free(symbols->labels);
+  free(symbols->lines);
+  free(symbols->source);
+  memset(symbols, 0, sizeof(*symbols));
+}
+
+const char *svm_symbols_label_at(const svm_symbols_t *symbols, uint64_t address)
+{
+  if (symbols == NULL) {
+    return NULL;
+  }
+  for (svm_label_list_t *label = symbols->labels; label != NULL; label = label->next) {
+    if (label->address == address) {
+      return label->label;
+    }
+  }
+  return NULL;
+}
+
+uint64_t svm_symbols_line_at(const svm_symbols_t *symbols, uint64_t address)
+{
+  if (symbols == NULL || address >= symbols->num_lines) {
+    return 0;
+  }
+  return symbols->lines[address];
+}
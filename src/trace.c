@@ -0,0 +1,227 @@
+#include "svm/trace.h"
+#include "svm/svm.h"
+#include "svm/symbols.h"
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+bool svm_trace_start(svm_trace_t *trace, svm_t *svm)
+{
+  memset(trace, 0, sizeof(*trace));
+  trace->program_size = svm->program_size;
+  trace->functions = calloc(svm->program_size + 1, sizeof(*trace->functions));
+  if (trace->functions == NULL) {
+    return false;
+  }
+  trace->origin_ns = now_ns();
+  trace->frames[0] = (svm_trace_frame_t){.entry = svm->ip};
+  if (svm->ip < trace->program_size) {
+    trace->functions[svm->ip].calls = 1;
+    trace->functions[svm->ip].active = 1;
+  }
+  svm->trace = trace;
+  return true;
+}
+
+void svm_trace_enter(svm_trace_t *trace, uint64_t entry)
+{
+  if (trace->depth == SVM_CALL_STACK_SIZE) {
+    return;
+  }
+  trace->frames[++trace->depth] = (svm_trace_frame_t){.entry = entry, .start_ns = now_ns() - trace->origin_ns};
+  if (entry < trace->program_size) {
+    trace->functions[entry].calls++;
+    trace->functions[entry].active++;
+  }
+}
+
+// End the innermost frame at now, relative to origin_ns.
+static void end_frame(svm_trace_t *trace, uint64_t now)
+{
+  svm_trace_frame_t *frame = &trace->frames[trace->depth];
+  uint64_t duration = now - frame->start_ns;
+  uint64_t exclusive = duration - frame->child_ns;
+  if (frame->entry < trace->program_size) {
+    svm_trace_function_t *function = &trace->functions[frame->entry];
+    function->exclusive_ns += exclusive;
+    // Only the outermost of the recursive calls of a function counts towards its inclusive time.
+    if (--function->active == 0) {
+      function->inclusive_ns += duration;
+    }
+  }
+
+  if (trace->num_events == trace->events_cap && trace->events_cap < SVM_TRACE_MAX_EVENTS) {
+    uint64_t cap = trace->events_cap == 0 ? 1024 : trace->events_cap * 2;
+    svm_trace_event_t *events = realloc(trace->events, cap * sizeof(*events));
+    if (events != NULL) {
+      trace->events = events;
+      trace->events_cap = cap;
+    }
+  }
+  if (trace->num_events < trace->events_cap) {
+    trace->events[trace->num_events++] = (svm_trace_event_t){
+      .entry = frame->entry,
+      .depth = trace->depth,
+      .start_ns = frame->start_ns,
+      .duration_ns = duration,
+      .exclusive_ns = exclusive,
+    };
+  } else {
+    trace->dropped++;
+  }
+
+  if (trace->depth > 0) {
+    trace->frames[trace->depth - 1].child_ns += duration;
+  }
+}
+
+void svm_trace_leave(svm_trace_t *trace)
+{
+  // A return with nothing traced to return from, when the trace started inside a call.
+  if (trace->depth == 0) {
+    return;
+  }
+  end_frame(trace, now_ns() - trace->origin_ns);
+  trace->depth--;
+}
+
+void svm_trace_stop(svm_trace_t *trace, svm_t *svm)
+{
+  if (svm->trace != trace) {
+    return;
+  }
+  svm->trace = NULL;
+  uint64_t now = now_ns() - trace->origin_ns;
+  for (;;) {
+    end_frame(trace, now);
+    if (trace->depth == 0) {
+      break;
+    }
+    trace->depth--;
+  }
+}
+
+void svm_trace_free(svm_trace_t *trace)
+{
+  free(trace->functions);
+  free(trace->events);
+  trace->functions = NULL;
+  trace->events = NULL;
+}
+
+static void write_name(FILE *out, const svm_symbols_t *symbols, uint64_t entry)
+{
+  const char *label = svm_symbols_label_at(symbols, entry);
+  if (label == NULL) {
+    fprintf(out, "%lu", entry);
+    return;
+  }
+  for (const char *c = label; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*c, out);
+  }
+}
+
+bool svm_trace_write_json(const svm_trace_t *trace, const svm_symbols_t *symbols, const char *file_name)
+{
+  FILE *out = fopen(file_name, "w");
+  if (out == NULL) {
+    return false;
+  }
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (uint64_t i = 0; i < trace->num_events; i++) {
+    const svm_trace_event_t *event = &trace->events[i];
+    fprintf(out, "{\"name\":\"");
+    write_name(out, symbols, event->entry);
+    // Timestamps are in microseconds.
+    fprintf(out, "\",\"cat\":\"call\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,", event->start_ns / 1e3,
+            event->duration_ns / 1e3);
+    fprintf(out, "\"args\":{\"entry\":%lu,\"depth\":%lu,\"exclusive_us\":%.3f", event->entry, event->depth,
+            event->exclusive_ns / 1e3);
+    uint64_t line = svm_symbols_line_at(symbols, event->entry);
+    if (line != 0) {
+      fprintf(out, ",\"line\":%lu", line);
+    }
+    fprintf(out, "}}%s\n", i + 1 < trace->num_events ? "," : "");
+  }
+
+  fprintf(out, "],\"svmFunctions\":[\n");
+  bool first = true;
+  for (uint64_t entry = 0; entry < trace->program_size; entry++) {
+    const svm_trace_function_t *function = &trace->functions[entry];
+    if (function->calls == 0) {
+      continue;
+    }
+    fprintf(out, "%s{\"name\":\"", first ? "" : ",\n");
+    write_name(out, symbols, entry);
+    fprintf(out, "\",\"entry\":%lu,\"calls\":%lu,\"inclusive_us\":%.3f,\"exclusive_us\":%.3f}", entry, function->calls,
+            function->inclusive_ns / 1e3, function->exclusive_ns / 1e3);
+    first = false;
+  }
+  fprintf(out, "\n],\"droppedEvents\":%lu}\n", trace->dropped);
+
+  bool ok = ferror(out) == 0;
+  if (fclose(out) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+typedef struct {
+  uint64_t entry;
+  uint64_t key;
+} row_t;
+
+static int compare_rows(const void *a, const void *b)
+{
+  uint64_t key_a = ((const row_t *)a)->key;
+  uint64_t key_b = ((const row_t *)b)->key;
+  return key_a < key_b ? 1 : key_a > key_b ? -1 : 0;
+}
+
+void svm_trace_print(const svm_trace_t *trace, const svm_symbols_t *symbols, FILE *out)
+{
+  row_t *rows = malloc(trace->program_size * sizeof(*rows) + 1);
+  uint64_t num_rows = 0;
+  uint64_t total_ns = 0;
+  for (uint64_t entry = 0; entry < trace->program_size; entry++) {
+    if (trace->functions[entry].calls != 0) {
+      rows[num_rows++] = (row_t){.entry = entry, .key = trace->functions[entry].exclusive_ns};
+      total_ns += trace->functions[entry].exclusive_ns;
+    }
+  }
+  qsort(rows, num_rows, sizeof(*rows), compare_rows);
+
+  fprintf(out, "Calls traced, sorted by exclusive time:\n");
+  fprintf(out, "  %-28s %12s %14s %14s %8s\n", "", "calls", "inclusive us", "exclusive us", "excl %");
+  for (uint64_t i = 0; i < num_rows; i++) {
+    const svm_trace_function_t *function = &trace->functions[rows[i].entry];
+    char name[64];
+    const char *label = svm_symbols_label_at(symbols, rows[i].entry);
+    if (label != NULL) {
+      snprintf(name, sizeof(name), "%s", label);
+    } else {
+      snprintf(name, sizeof(name), "%lu", rows[i].entry);
+    }
+    fprintf(out, "  %-28s %12lu %14.1f %14.1f %7.1f%%\n", name, function->calls, function->inclusive_ns / 1e3,
+            function->exclusive_ns / 1e3, total_ns != 0 ? 100.0 * function->exclusive_ns / total_ns : 0.0);
+  }
+  if (trace->dropped != 0) {
+    fprintf(out, "WARNING: %lu calls had no room for an event and are only in the totals.\n", trace->dropped);
+  }
+  free(rows);
+}
@@ -0,0 +1,1598 @@
+#include "svm/svm.h"
+#include "svm/fiber.h"
+#include "svm/object.h"
+#include "svm/regvm.h"
+#include "svm/parfor.h"
+#include "svm/chan.h"
+#include "svm/memo.h"
+#include "svm/trace.h"
+#include "svm/stats.h"
+#include "svm/io.h"
+#include "svm/vec.h"
+#include "svm/err.h"
+#include "svm/value.h"
+#include "svm/instructions.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Get the VM whose heap the heap instructions should use, locking it if it is shared.
+static svm_t *heap_acquire(svm_t *svm)
+{
+  if (svm->heap_vm == NULL) {
+    return svm;
+  }
+  pthread_mutex_lock(svm->heap_lock);
+  return svm->heap_vm;
+}
+
+static void heap_release(svm_t *svm)
+{
+  if (svm->heap_vm != NULL) {
+    pthread_mutex_unlock(svm->heap_lock);
+  }
+}
+
+static bool find_addr(svm_t *svm, void *addr, uint64_t *idx)
+{
+  // free doesn't clear the slots it leaves behind, so only the ones below heap_addrs_ptr count.
+  for (uint64_t i = 0; i < svm->heap_addrs_ptr; i++) {
+    if (svm->heap_addrs[i] == addr) {
+      *idx = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the size bytes at addr lie in blocks of the frame storage of svm that are still allocated.
+static bool in_frame(svm_t *svm, void *addr, uint64_t size)
+{
+  uintptr_t start = (uintptr_t)svm->frame_storage;
+  uintptr_t end = start + svm->frame_top;
+  return (uintptr_t)addr >= start && (uintptr_t)addr < end && size <= end - (uintptr_t)addr;
+}
+
+// Find the size of the frame block of svm that starts at addr. Returns false if addr isn't the start of one.
+static bool find_frame_block(svm_t *svm, void *addr, uint64_t *size)
+{
+  if (!in_frame(svm, addr, 1)) {
+    return false;
+  }
+  uint64_t offset = (uint8_t *)addr - svm->frame_storage;
+  // The blocks are laid out back to back from every call's mark, so start from the innermost mark at or below addr.
+  uint64_t block = 0;
+  for (uint64_t i = svm->call_stack_ptr; i > 0; i--) {
+    if (svm->frame_marks[i - 1] <= offset) {
+      block = svm->frame_marks[i - 1];
+      break;
+    }
+  }
+  while (block + sizeof(*size) <= offset) {
+    memcpy(size, &svm->frame_storage[block], sizeof(*size));
+    if (block + sizeof(*size) == offset) {
+      return true;
+    }
+    block += sizeof(*size) + *size;
+  }
+  return false;
+}
+
+// Like addr_room, with heap already acquired.
+static uint64_t addr_room_locked(svm_t *svm, svm_t *heap, void *addr)
+{
+  uint64_t size;
+  if (find_frame_block(svm, addr, &size)) {
+    return size;
+  }
+  uint64_t addr_idx;
+  return find_addr(heap, addr, &addr_idx) ? heap->heap_sizes[addr_idx] : 0;
+}
+
+// How many bytes from addr the heap instructions may use, which take addresses returned by alloc and falloc. 0 if
+// addr isn't one of them.
+static uint64_t addr_room(svm_t *svm, void *addr)
+{
+  svm_t *heap = heap_acquire(svm);
+  uint64_t room = addr_room_locked(svm, heap, addr);
+  heap_release(svm);
+  return room;
+}
+
+// Check a buffer of size bytes at addr for the heap instructions.
+static bool valid_addr(svm_t *svm, void *addr, uint64_t size)
+{
+  uint64_t room = addr_room(svm, addr);
+  return room > 0 && size <= room;
+}
+
+// Check the vector at index, in values, of the block at base for vload and vstore.
+static bool valid_vector(svm_t *svm, svm_value_t *base, uint64_t index)
+{
+  if (index > UINT64_MAX / sizeof(svm_value_t) - SVM_VEC_LANES) {
+    return false;
+  }
+  return valid_addr(svm, base, (index + SVM_VEC_LANES) * sizeof(svm_value_t));
+}
+
+static svm_err_t heap_alloc(svm_t *svm, uint64_t inst_addr, uint64_t size)
+{
+  if (svm->stack_ptr >= svm->stack_limit) {
+    return SVM_ERR_STACK_OVERFLOW;
+  }
+  svm_t *heap = heap_acquire(svm);
+  if (heap->heap_addrs_ptr >= SVM_HEAP_ADDRS_SIZE) {
+    heap_release(svm);
+    return SVM_ERR_ADDR_LIST_FULL;
+  }
+
+  // Allocate the address.
+  void* addr = malloc(size);
+  memset(addr, 0, size);
+  heap->heap_addrs[heap->heap_addrs_ptr] = addr;
+  heap->heap_sizes[heap->heap_addrs_ptr] = size;
+  heap->heap_addrs_ptr++;
+  if (heap->stats != NULL) {
+    svm_stats_alloc(heap->stats, inst_addr, addr, size, heap->heap_addrs_ptr);
+  }
+  heap_release(svm);
+
+  // Put the address on the stack.
+  svm->stack[svm->stack_ptr] = SVM_VALUE_PTR(addr);
+  svm->stack_ptr++;
+  return SVM_ERR_OK;
+}
+
+// Count which way a generic jnz goes, and replace it with a version specialized for that direction once it has gone
+// the same way often enough.
+static void profile_branch(svm_t *svm, uint64_t inst_addr, bool taken)
+{
+  int8_t *bias = &svm->branch_bias[inst_addr];
+  *bias += taken ? 1 : -1;
+  if (*bias >= SVM_QUICKEN_THRESHOLD) {
+    svm->opcodes[inst_addr] = SVM_INST_JNZ_TAKEN;
+    *bias = 0;
+  } else if (*bias <= -SVM_QUICKEN_THRESHOLD) {
+    svm->opcodes[inst_addr] = SVM_INST_JNZ_NOT_TAKEN;
+    *bias = 0;
+  }
+}
+
+// Channels live in the table of the VM that owns the heap.
+static svm_chan_t *find_channel(svm_t *svm, uint64_t index)
+{
+  svm_t *owner = heap_acquire(svm);
+  svm_chan_t *chan = index < SVM_MAX_CHANNELS ? owner->channels[index] : NULL;
+  heap_release(svm);
+  return chan;
+}
+
+// Whether channel index was made by chan_new, rather than bound by the host, which other threads may also use.
+static bool made_channel(svm_t *svm, uint64_t index)
+{
+  svm_t *owner = heap_acquire(svm);
+  bool made = (owner->made_channels >> index) & 1;
+  heap_release(svm);
+  return made;
+}
+
+// Whether a send or recv on channel index can only wait forever when it doesn't go ahead right away. That is the case
+// for the channels the program made, on a VM that runs neither fibers nor a parfor body, as nothing else can use them.
+static bool sole_user(svm_t *svm, uint64_t index)
+{
+  return svm->sched == NULL && svm->heap_vm == NULL && made_channel(svm, index);
+}
+
+// A send or recv on channel index of a fiber couldn't go ahead. Switch the fiber out and park it on the channel, to
+// run the instruction again once the channel changes.
+static void wait_on_channel(svm_t *svm, uint64_t inst_addr, uint64_t index, svm_chan_t *chan, uint64_t changes)
+{
+  svm->fiber->chan = chan;
+  svm->fiber->chan_changes = changes;
+  svm->fiber->chan_external = !made_channel(svm, index);
+  svm->ip = inst_addr;
+  svm->parked = true;
+}
+
+// The guard of a quickened instruction failed. Put the generic instruction back and run that instead.
+static svm_err_t deoptimize(svm_t *svm, svm_instruction_type_t generic)
+{
+  svm->ip--;
+  svm->opcodes[svm->ip] = generic;
+  return svm_exec_instruction(svm);
+}
+
+void svm_init(svm_t *svm)
+{
+  svm->halted = false;
+  svm->engine = SVM_ENGINE_STACK;
+
+  memset(svm->stack, 0, sizeof(svm->stack));
+  svm->stack_ptr = 0;
+  svm->stack_limit = SVM_STACK_SIZE;
+
+  memset(svm->opcodes, 0, sizeof(svm->opcodes));
+  memset(svm->operand_index, 0, sizeof(svm->operand_index));
+  memset(svm->operands, 0, sizeof(svm->operands));
+  svm->num_operands = 0;
+  svm->program_size = 0;
+  svm->ip = 0;
+  svm->quicken = true;
+  memset(svm->branch_bias, 0, sizeof(svm->branch_bias));
+
+  memset(svm->call_stack, 0, sizeof(svm->call_stack));
+  svm->call_stack_ptr = 0;
+  svm->call_stack_limit = SVM_CALL_STACK_SIZE;
+
+  memset(svm->heap_addrs, 0, sizeof(svm->heap_addrs));
+  svm->heap_addrs_ptr = 0;
+  svm->heap_vm = NULL;
+  svm->heap_lock = NULL;
+
+  // Only the storage below frame_top is ever read, and falloc clears its blocks, so frame_storage is left as is.
+  svm->frame_top = 0;
+
+  svm->sched_workers = 0;
+  svm->sched = NULL;
+  svm->fiber = NULL;
+  svm->yielded = false;
+  svm->parked = false;
+
+  memset(svm->channels, 0, sizeof(svm->channels));
+  svm->made_channels = 0;
+
+  svm->memo = NULL;
+  svm->trace = NULL;
+  svm->stats = NULL;
+  svm->io = NULL;
+}
+
+void svm_reset(svm_t *svm)
+{
+  svm->halted = false;
+  // Slots above stack_ptr are always written before they are read, so there is no need to clear them.
+  svm->stack_ptr = 0;
+  svm->ip = 0;
+  svm->call_stack_ptr = 0;
+
+  // Requests in flight may be reading into the blocks, and the next run can't wait for them.
+  if (svm->io != NULL) {
+    svm_io_reset(svm->io);
+  }
+  for (uint64_t i = 0; i < svm->heap_addrs_ptr; i++) {
+    if (svm->stats != NULL) {
+      svm_stats_release(svm->stats, svm->heap_addrs[i]);
+    }
+    free(svm->heap_addrs[i]);
+    svm->heap_addrs[i] = NULL;
+  }
+  svm->heap_addrs_ptr = 0;
+  svm->frame_top = 0;
+
+  for (uint64_t i = 0; i < SVM_MAX_CHANNELS; i++) {
+    if (svm->made_channels & ((uint64_t)1 << i)) {
+      svm_chan_bind(svm, i, NULL);
+    }
+  }
+
+  svm->yielded = false;
+  svm->parked = false;
+
+  if (svm->memo != NULL) {
+    svm->memo->num_pending = 0;
+  }
+}
+
+_Static_assert(SVM_INST_TYPE_COUNT <= UINT8_MAX, "Opcodes must fit in a byte, with UINT8_MAX left over.");
+_Static_assert(SVM_MAX_PROGRAM_SIZE - 1 <= UINT16_MAX, "Operand indices must fit in operand_index.");
+_Static_assert(SVM_MAX_CHANNELS <= 64, "Every channel needs a bit in made_channels.");
+_Static_assert(SVM_VEC_LANES == 4, "The stack effects of the vector instructions in svm/instructions.h are for 4 lanes.");
+
+// Whether an instruction of this type gets a slot in operands. Quickened instructions keep the slot of the generic
+// instruction they came from, so read gets one for read_cached to use.
+static bool has_operand_slot(svm_instruction_type_t type)
+{
+  // Using if instead of switch because we have -Wswitch-enum on.
+  if (svm_instruction_type_needs_operand(type)) return true;
+  if (type == SVM_INST_COPY_1) return true;
+  if (type == SVM_INST_SWAP_1) return true;
+  if (type == SVM_INST_JNZ_TAKEN) return true;
+  if (type == SVM_INST_JNZ_NOT_TAKEN) return true;
+  if (type == SVM_INST_READ) return true;
+  if (type == SVM_INST_READ_CACHED) return true;
+
+  return false;
+}
+
+bool svm_load_program_from_array(svm_t *svm, svm_instruction_t *instructions, uint32_t program_size)
+{
+  if (program_size > SVM_MAX_PROGRAM_SIZE) {
+    return false;
+  }
+
+  svm->program_size = program_size;
+  svm->num_operands = 0;
+  for (uint64_t i = 0; i < program_size; i++) {
+    svm_instruction_type_t type = instructions[i].type;
+    // Types that don't fit in an opcode byte become an opcode that isn't an instruction, to fail when executed.
+    svm->opcodes[i] = (uint64_t)type < SVM_INST_TYPE_COUNT ? type : UINT8_MAX;
+    if (has_operand_slot(type)) {
+      svm->operand_index[i] = svm->num_operands;
+      svm->operands[svm->num_operands++] = instructions[i].operand;
+    } else {
+      // Point at a neighbouring operand, which is likely to be in the cache already.
+      svm->operand_index[i] = svm->num_operands > 0 ? svm->num_operands - 1 : 0;
+    }
+  }
+  return true;
+}
+
+bool svm_load_program_from_file(svm_t *svm, const char *file_name)
+{
+  svm_instruction_t *program = malloc(SVM_MAX_PROGRAM_SIZE * sizeof(*program));
+  uint64_t size;
+  bool ok = svm_object_read(file_name, program, SVM_MAX_PROGRAM_SIZE, &size) &&
+            svm_load_program_from_array(svm, program, size);
+  free(program);
+  return ok;
+}
+
+void svm_load_program_from_vm(svm_t *svm, const svm_t *src)
+{
+  memcpy(svm->opcodes, src->opcodes, src->program_size * sizeof(*src->opcodes));
+  memcpy(svm->operand_index, src->operand_index, src->program_size * sizeof(*src->operand_index));
+  memcpy(svm->operands, src->operands, src->num_operands * sizeof(*src->operands));
+  svm->num_operands = src->num_operands;
+  svm->program_size = src->program_size;
+}
+
+svm_instruction_t svm_program_get(const svm_t *svm, uint64_t addr)
+{
+  svm_instruction_t instruction = {.type = svm->opcodes[addr], .operand = SVM_VALUE_U64(0)};
+  if (has_operand_slot(instruction.type)) {
+    instruction.operand = svm->operands[svm->operand_index[addr]];
+  }
+  return instruction;
+}
+
+void svm_program_unpack(const svm_t *svm, svm_instruction_t *program)
+{
+  for (uint64_t i = 0; i < svm->program_size; i++) {
+    program[i] = svm_program_get(svm, i);
+  }
+}
+
+svm_err_t svm_exec_instruction(svm_t *svm)
+{
+  if (svm->ip >= svm->program_size) {
+    return SVM_ERR_IP_OVERFLOW;
+  }
+  uint64_t inst_addr = svm->ip;
+  if (svm->stats != NULL) {
+    svm->stats->instructions++;
+    svm_stats_sample(svm->stats, svm);
+  }
+  svm_instruction_type_t type = svm->opcodes[inst_addr];
+  // Garbage for instructions without an operand, which don't look at it.
+  svm_value_t operand = svm->operands[svm->operand_index[inst_addr]];
+  svm->ip++;
+
+  switch (type) {
+    case  SVM_INST_NOP:
+      break;
+    case  SVM_INST_HALT:
+      svm->halted = true;
+      break;
+    case  SVM_INST_PUSH:
+      if (svm->stack_ptr >= svm->stack_limit) {
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      svm->stack[svm->stack_ptr++] = operand;
+      break;
+    case  SVM_INST_POP:
+      if (svm->stack_ptr == 0) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_COPY:
+      if (svm->stack_ptr >= svm->stack_limit) {
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      if (svm->stack_ptr < operand.as_u64) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (operand.as_u64 == 0) {
+        // stack_ptr points above the top of the stack so an offset of 0 is an overflow.
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      svm->stack[svm->stack_ptr] = svm->stack[svm->stack_ptr - operand.as_u64];
+      svm->stack_ptr++;
+      if (svm->quicken && operand.as_u64 == 1) {
+        svm->opcodes[inst_addr] = SVM_INST_COPY_1;
+      }
+      break;
+    case SVM_INST_SWAP:
+      if (svm->stack_ptr < operand.as_u64) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (operand.as_u64 == 0) {
+        // stack_ptr points above the top of the stack so an offset of 0 is an overflow.
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      if (svm->stack_ptr == operand.as_u64) {
+        // The item to swap with would be below the bottom of the stack.
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm_value_t tmp = svm->stack[svm->stack_ptr - 1];
+      svm->stack[svm->stack_ptr - 1] = svm->stack[svm->stack_ptr - operand.as_u64 - 1];
+      svm->stack[svm->stack_ptr - operand.as_u64 - 1] = tmp;
+      if (svm->quicken && operand.as_u64 == 1) {
+        svm->opcodes[inst_addr] = SVM_INST_SWAP_1;
+      }
+      break;
+    case  SVM_INST_ADD_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_i64 += svm->stack[svm->stack_ptr - 1].as_i64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_SUB_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_i64 -= svm->stack[svm->stack_ptr - 1].as_i64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_MULT_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_i64 *= svm->stack[svm->stack_ptr - 1].as_i64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_DIV_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (!svm_div_i64_ok(svm->stack[svm->stack_ptr - 2].as_i64, svm->stack[svm->stack_ptr - 1].as_i64)) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 2].as_i64 /= svm->stack[svm->stack_ptr - 1].as_i64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_ADD_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 += svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_SUB_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 -= svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_MULT_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 *= svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_DIV_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (svm->stack[svm->stack_ptr - 1].as_u64 == 0) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 /= svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_ADD_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_f64 += svm->stack[svm->stack_ptr - 1].as_f64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_SUB_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_f64 -= svm->stack[svm->stack_ptr - 1].as_f64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_MULT_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_f64 *= svm->stack[svm->stack_ptr - 1].as_f64;
+      svm->stack_ptr--;
+      break;
+    case  SVM_INST_DIV_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_f64 /= svm->stack[svm->stack_ptr - 1].as_f64;
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_EQ:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_ptr == svm->stack[svm->stack_ptr - 1].as_ptr);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_NOT_EQ:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_ptr != svm->stack[svm->stack_ptr - 1].as_ptr);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_GT_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 > svm->stack[svm->stack_ptr - 1].as_i64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_GT_EQ_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 >= svm->stack[svm->stack_ptr - 1].as_i64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_LT_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 < svm->stack[svm->stack_ptr - 1].as_i64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_LT_EQ_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_i64 <= svm->stack[svm->stack_ptr - 1].as_i64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_GT_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 > svm->stack[svm->stack_ptr - 1].as_u64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_GT_EQ_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 >= svm->stack[svm->stack_ptr - 1].as_u64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_LT_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 < svm->stack[svm->stack_ptr - 1].as_u64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_LT_EQ_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_u64 <= svm->stack[svm->stack_ptr - 1].as_u64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_GT_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 > svm->stack[svm->stack_ptr - 1].as_f64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_GT_EQ_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 >= svm->stack[svm->stack_ptr - 1].as_f64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_LT_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 < svm->stack[svm->stack_ptr - 1].as_f64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_LT_EQ_F:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 2].as_f64 <= svm->stack[svm->stack_ptr - 1].as_f64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_JMP:
+      // Don't worry about checking bounds here because if the ip goes beyond the program size it will be caught in the
+      // next call to svm_exec_instruction.
+      svm->ip = operand.as_u64;
+      break;
+    case SVM_INST_JNZ: {
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      bool taken = svm->stack[svm->stack_ptr - 1].as_i64 != 0;
+      if (taken) {
+        // See above note.
+        svm->ip = operand.as_u64;
+      }
+      svm->stack_ptr--;
+      if (svm->quicken) {
+        profile_branch(svm, inst_addr, taken);
+      }
+      break;
+    }
+    case SVM_INST_CALL:
+      if (svm->call_stack_ptr >= svm->call_stack_limit) {
+        return SVM_ERR_CALL_STACK_OVERFLOW;
+      }
+      svm->frame_marks[svm->call_stack_ptr] = svm->frame_top;
+      svm->call_stack[svm->call_stack_ptr++] = svm->ip;
+      svm->ip = operand.as_u64;
+      if (svm->trace != NULL) {
+        svm_trace_enter(svm->trace, svm->ip);
+      }
+      break;
+    case SVM_INST_RET:
+      if (svm->call_stack_ptr < 1) {
+        return SVM_ERR_CALL_STACK_UNDERFLOW;
+      }
+      if (svm->memo != NULL) {
+        svm_memo_leave(svm->memo, svm);
+      }
+      svm->ip = svm->call_stack[svm->call_stack_ptr - 1];
+      svm->call_stack_ptr--;
+      // Release the frame storage of the call. Fibers never use it, and their calls may have been made on another
+      // carrier.
+      if (svm->fiber == NULL) {
+        svm->frame_top = svm->frame_marks[svm->call_stack_ptr];
+      }
+      if (svm->trace != NULL) {
+        svm_trace_leave(svm->trace);
+      }
+      break;
+    case SVM_INST_ALLOC:
+      return heap_alloc(svm, inst_addr, operand.as_u64);
+    case SVM_INST_FALLOC: {
+      // Fibers share the frame storage of their carrier, so they get their blocks from the heap instead.
+      if (svm->fiber != NULL || operand.as_u64 > SVM_FRAME_STORAGE_SIZE) {
+        return heap_alloc(svm, inst_addr, operand.as_u64);
+      }
+      uint64_t size = (operand.as_u64 + 7) & ~(uint64_t)7;
+      if (sizeof(size) + size > SVM_FRAME_STORAGE_SIZE - svm->frame_top) {
+        return heap_alloc(svm, inst_addr, operand.as_u64);
+      }
+      if (svm->stack_ptr >= svm->stack_limit) {
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      memcpy(&svm->frame_storage[svm->frame_top], &size, sizeof(size));
+      uint8_t *addr = &svm->frame_storage[svm->frame_top + sizeof(size)];
+      memset(addr, 0, size);
+      svm->frame_top += sizeof(size) + size;
+      svm->stack[svm->stack_ptr++] = SVM_VALUE_PTR(addr);
+      break;
+    }
+    case SVM_INST_FREE: {
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      // Find the address.
+      void* addr = svm->stack[svm->stack_ptr - 1].as_ptr;
+      if (addr == NULL) {
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      if (in_frame(svm, addr, 1)) {
+        uint64_t size;
+        if (!find_frame_block(svm, addr, &size)) {
+          return SVM_ERR_ILLEGAL_ADDR;
+        }
+        // Only the last block can go right away, the others go when the function returns. It has to be one of this
+        // call's, or the ret of the call would bring it back over the blocks allocated after it.
+        uint64_t offset = (uint8_t *)addr - svm->frame_storage;
+        uint64_t mark = svm->call_stack_ptr > 0 ? svm->frame_marks[svm->call_stack_ptr - 1] : 0;
+        if (offset + size == svm->frame_top && offset - sizeof(size) >= mark) {
+          svm->frame_top = offset - sizeof(size);
+        }
+        svm->stack_ptr--;
+        break;
+      }
+      uint64_t addr_idx;
+      svm_t *heap = heap_acquire(svm);
+      bool found = find_addr(heap, addr, &addr_idx);
+      if (!found) {
+        heap_release(svm);
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+
+      // Pop the addr from the stack and free it, once no request in flight can be using it.
+      svm->stack_ptr--;
+      if (heap->io != NULL) {
+        svm_io_drain(heap->io);
+      }
+      if (heap->stats != NULL) {
+        svm_stats_release(heap->stats, addr);
+      }
+      free(addr);
+
+      // Best case scenario is that the free'd addr was at the end.
+      if (addr_idx == heap->heap_addrs_ptr - 1) {
+        heap->heap_addrs_ptr--;
+        heap_release(svm);
+        break;
+      }
+
+      // If it's not, we need to shift all the addrs that are past it down by one.
+      uint64_t remaining_addrs = heap->heap_addrs_ptr - 1 - addr_idx;
+      memmove(&heap->heap_addrs[addr_idx], &heap->heap_addrs[addr_idx + 1], remaining_addrs * sizeof(addr));
+      memmove(&heap->heap_sizes[addr_idx], &heap->heap_sizes[addr_idx + 1], remaining_addrs * sizeof(uint64_t));
+      heap->heap_addrs_ptr--;
+      heap_release(svm);
+      break;
+    }
+    case SVM_INST_READ: {
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      void* addr = svm->stack[svm->stack_ptr - 1].as_ptr;
+      if (in_frame(svm, addr, sizeof(svm_value_t))) {
+        // Frame blocks come and go with calls, so there is no index to remember.
+        memcpy(&svm->stack[svm->stack_ptr - 1], addr, sizeof(svm_value_t));
+        break;
+      }
+      uint64_t addr_idx;
+      bool found = find_addr(heap_acquire(svm), addr, &addr_idx);
+      if (!found) {
+        heap_release(svm);
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      // Under the lock, so another fiber can't free the block in the meantime.
+      memcpy(&svm->stack[svm->stack_ptr - 1], addr, sizeof(svm_value_t));
+      heap_release(svm);
+      if (svm->quicken) {
+        // Remember where the address was so the next read can skip the search.
+        svm->opcodes[inst_addr] = SVM_INST_READ_CACHED;
+        svm->operands[svm->operand_index[inst_addr]] = SVM_VALUE_U64(addr_idx);
+      }
+      break;
+    }
+    case SVM_INST_WRITE: {
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      void* addr = svm->stack[svm->stack_ptr - 2].as_ptr;
+      memcpy(addr, &svm->stack[svm->stack_ptr - 1], sizeof(svm_value_t));
+      svm->stack_ptr -= 2;
+      break;
+    }
+    case SVM_INST_SPAWN: {
+      if (svm->sched == NULL) {
+        return SVM_ERR_NO_SCHEDULER;
+      }
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      uint64_t id;
+      svm_err_t err = svm_sched_spawn(svm->sched, svm->fiber, operand.as_u64, svm->stack[svm->stack_ptr - 1], &id);
+      if (err != SVM_ERR_OK) {
+        return err;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_U64(id);
+      break;
+    }
+    case SVM_INST_YIELD:
+      // Without a scheduler there is nothing else to run.
+      if (svm->sched != NULL) {
+        svm->yielded = true;
+      }
+      break;
+    case SVM_INST_JOIN: {
+      if (svm->sched == NULL) {
+        return SVM_ERR_NO_SCHEDULER;
+      }
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      bool done;
+      svm_value_t result;
+      svm_err_t err = svm_sched_try_join(svm->sched, svm->stack[svm->stack_ptr - 1].as_u64, &done, &result);
+      if (err != SVM_ERR_OK) {
+        return err;
+      }
+      if (done) {
+        svm->stack[svm->stack_ptr - 1] = result;
+        break;
+      }
+      // Park the fiber and run the join again once the other fiber is done.
+      svm->ip--;
+      svm->parked = true;
+      break;
+    }
+    case SVM_INST_ADD_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_i64 += operand.as_i64;
+      break;
+    case SVM_INST_SUB_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_i64 -= operand.as_i64;
+      break;
+    case SVM_INST_MULT_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_i64 *= operand.as_i64;
+      break;
+    case SVM_INST_DIV_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (!svm_div_i64_ok(svm->stack[svm->stack_ptr - 1].as_i64, operand.as_i64)) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 1].as_i64 /= operand.as_i64;
+      break;
+    case SVM_INST_ADD_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 += operand.as_u64;
+      break;
+    case SVM_INST_SUB_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 -= operand.as_u64;
+      break;
+    case SVM_INST_MULT_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 *= operand.as_u64;
+      break;
+    case SVM_INST_DIV_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (operand.as_u64 == 0) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 /= operand.as_u64;
+      break;
+    case SVM_INST_ADD_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_f64 += operand.as_f64;
+      break;
+    case SVM_INST_SUB_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_f64 -= operand.as_f64;
+      break;
+    case SVM_INST_MULT_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_f64 *= operand.as_f64;
+      break;
+    case SVM_INST_DIV_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_f64 /= operand.as_f64;
+      break;
+    case SVM_INST_EQ_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_ptr == operand.as_ptr);
+      break;
+    case SVM_INST_NOT_EQ_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_ptr != operand.as_ptr);
+      break;
+    case SVM_INST_GT_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_i64 > operand.as_i64);
+      break;
+    case SVM_INST_GT_EQ_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_i64 >= operand.as_i64);
+      break;
+    case SVM_INST_LT_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_i64 < operand.as_i64);
+      break;
+    case SVM_INST_LT_EQ_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_i64 <= operand.as_i64);
+      break;
+    case SVM_INST_GT_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_u64 > operand.as_u64);
+      break;
+    case SVM_INST_GT_EQ_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_u64 >= operand.as_u64);
+      break;
+    case SVM_INST_LT_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_u64 < operand.as_u64);
+      break;
+    case SVM_INST_LT_EQ_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_u64 <= operand.as_u64);
+      break;
+    case SVM_INST_GT_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_f64 > operand.as_f64);
+      break;
+    case SVM_INST_GT_EQ_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_f64 >= operand.as_f64);
+      break;
+    case SVM_INST_LT_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_f64 < operand.as_f64);
+      break;
+    case SVM_INST_LT_EQ_F_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(svm->stack[svm->stack_ptr - 1].as_f64 <= operand.as_f64);
+      break;
+    case SVM_INST_PARFOR: {
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      int64_t n = svm->stack[svm->stack_ptr - 1].as_i64;
+      svm->stack_ptr--;
+      if (n > 0) {
+        svm_err_t err = svm_parfor_run(svm, operand.as_u64, n);
+        if (err != SVM_ERR_OK) {
+          return err;
+        }
+      }
+      break;
+    }
+    case SVM_INST_CAS: {
+      if (svm->stack_ptr < 3) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      void* addr = svm->stack[svm->stack_ptr - 3].as_ptr;
+      if (!valid_addr(svm, addr, sizeof(uint64_t))) {
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      uint64_t expected = svm->stack[svm->stack_ptr - 2].as_u64;
+      bool swapped = atomic_compare_exchange_strong((_Atomic uint64_t *)addr, &expected, svm->stack[svm->stack_ptr - 1].as_u64);
+      svm->stack[svm->stack_ptr - 3] = SVM_VALUE_I64(swapped);
+      svm->stack_ptr -= 2;
+      break;
+    }
+    case SVM_INST_FETCH_ADD: {
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      void* addr = svm->stack[svm->stack_ptr - 2].as_ptr;
+      if (!valid_addr(svm, addr, sizeof(uint64_t))) {
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      uint64_t old = atomic_fetch_add((_Atomic uint64_t *)addr, svm->stack[svm->stack_ptr - 1].as_u64);
+      svm->stack[svm->stack_ptr - 2] = SVM_VALUE_U64(old);
+      svm->stack_ptr--;
+      break;
+    }
+    case SVM_INST_CHAN_NEW: {
+      if (svm->stack_ptr >= svm->stack_limit) {
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      svm_chan_t *chan = svm_chan_new(operand.as_u64);
+      if (chan == NULL) {
+        return SVM_ERR_CHANNEL_TOO_LARGE;
+      }
+      uint64_t index;
+      svm_t *owner = heap_acquire(svm);
+      bool bound = svm_chan_bind_free(owner, chan, &index);
+      if (bound) {
+        owner->made_channels |= (uint64_t)1 << index;
+      }
+      heap_release(svm);
+      // The table holds on to the channel from here on.
+      svm_chan_release(chan);
+      if (!bound) {
+        return SVM_ERR_CHANNEL_LIST_FULL;
+      }
+      svm->stack[svm->stack_ptr++] = SVM_VALUE_U64(index);
+      break;
+    }
+    case SVM_INST_SEND: {
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      uint64_t index = svm->stack[svm->stack_ptr - 2].as_u64;
+      svm_chan_t *chan = find_channel(svm, index);
+      if (chan == NULL) {
+        return SVM_ERR_ILLEGAL_CHANNEL;
+      }
+      svm_value_t value = svm->stack[svm->stack_ptr - 1];
+      if (svm->sched != NULL) {
+        // Let the other fibers run until there is room instead of blocking the worker.
+        uint64_t changes = svm_chan_changes(chan);
+        if (!svm_chan_try_send(chan, value)) {
+          wait_on_channel(svm, inst_addr, index, chan, changes);
+          break;
+        }
+      } else if (sole_user(svm, index)) {
+        if (!svm_chan_try_send(chan, value)) {
+          return SVM_ERR_DEADLOCK;
+        }
+      } else {
+        svm_chan_send(chan, value);
+      }
+      svm->stack_ptr -= 2;
+      break;
+    }
+    case SVM_INST_RECV: {
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      uint64_t index = svm->stack[svm->stack_ptr - 1].as_u64;
+      svm_chan_t *chan = find_channel(svm, index);
+      if (chan == NULL) {
+        return SVM_ERR_ILLEGAL_CHANNEL;
+      }
+      if (svm->sched != NULL) {
+        uint64_t changes = svm_chan_changes(chan);
+        if (!svm_chan_try_recv(chan, &svm->stack[svm->stack_ptr - 1])) {
+          wait_on_channel(svm, inst_addr, index, chan, changes);
+          break;
+        }
+      } else if (sole_user(svm, index)) {
+        if (!svm_chan_try_recv(chan, &svm->stack[svm->stack_ptr - 1])) {
+          return SVM_ERR_DEADLOCK;
+        }
+      } else {
+        svm->stack[svm->stack_ptr - 1] = svm_chan_recv(chan);
+      }
+      break;
+    }
+    case SVM_INST_AND:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 = svm->stack[svm->stack_ptr - 2].as_u64 & svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_OR:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 = svm->stack[svm->stack_ptr - 2].as_u64 | svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_XOR:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 = svm->stack[svm->stack_ptr - 2].as_u64 ^ svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_SHL:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 = svm->stack[svm->stack_ptr - 2].as_u64 << (svm->stack[svm->stack_ptr - 1].as_u64 & 63);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_SHR:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 = svm->stack[svm->stack_ptr - 2].as_u64 >> (svm->stack[svm->stack_ptr - 1].as_u64 & 63);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_SAR:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_i64 = svm->stack[svm->stack_ptr - 2].as_i64 >> (svm->stack[svm->stack_ptr - 1].as_u64 & 63);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_NOT:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = ~svm->stack[svm->stack_ptr - 1].as_u64;
+      break;
+    case SVM_INST_MOD_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (!svm_div_i64_ok(svm->stack[svm->stack_ptr - 2].as_i64, svm->stack[svm->stack_ptr - 1].as_i64)) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 2].as_i64 = svm->stack[svm->stack_ptr - 2].as_i64 % svm->stack[svm->stack_ptr - 1].as_i64;
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_MOD_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (svm->stack[svm->stack_ptr - 1].as_u64 == 0) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 = svm->stack[svm->stack_ptr - 2].as_u64 % svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_MULH_I:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_i64 = svm_mulh_i64(svm->stack[svm->stack_ptr - 2].as_i64, svm->stack[svm->stack_ptr - 1].as_i64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_MULH_U:
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 2].as_u64 = svm_mulh_u64(svm->stack[svm->stack_ptr - 2].as_u64, svm->stack[svm->stack_ptr - 1].as_u64);
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_AND_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = svm->stack[svm->stack_ptr - 1].as_u64 & operand.as_u64;
+      break;
+    case SVM_INST_OR_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = svm->stack[svm->stack_ptr - 1].as_u64 | operand.as_u64;
+      break;
+    case SVM_INST_XOR_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = svm->stack[svm->stack_ptr - 1].as_u64 ^ operand.as_u64;
+      break;
+    case SVM_INST_SHL_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = svm->stack[svm->stack_ptr - 1].as_u64 << (operand.as_u64 & 63);
+      break;
+    case SVM_INST_SHR_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = svm->stack[svm->stack_ptr - 1].as_u64 >> (operand.as_u64 & 63);
+      break;
+    case SVM_INST_SAR_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_i64 = svm->stack[svm->stack_ptr - 1].as_i64 >> (operand.as_u64 & 63);
+      break;
+    case SVM_INST_MOD_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (!svm_div_i64_ok(svm->stack[svm->stack_ptr - 1].as_i64, operand.as_i64)) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 1].as_i64 = svm->stack[svm->stack_ptr - 1].as_i64 % operand.as_i64;
+      break;
+    case SVM_INST_MOD_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (operand.as_u64 == 0) {
+        return SVM_ERR_ILLEGAL_DIVISION;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = svm->stack[svm->stack_ptr - 1].as_u64 % operand.as_u64;
+      break;
+    case SVM_INST_MULH_I_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_i64 = svm_mulh_i64(svm->stack[svm->stack_ptr - 1].as_i64, operand.as_i64);
+      break;
+    case SVM_INST_MULH_U_IMM:
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack[svm->stack_ptr - 1].as_u64 = svm_mulh_u64(svm->stack[svm->stack_ptr - 1].as_u64, operand.as_u64);
+      break;
+    case SVM_INST_JTAB: {
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      uint64_t index = svm->stack[svm->stack_ptr - 1].as_u64;
+      svm->stack_ptr--;
+      // Negative indices are out of range too, as u64. Entry 0 is the default target.
+      uint64_t entry = inst_addr + 1;
+      if (index < operand.as_u64 && operand.as_u64 < svm->program_size) {
+        entry += index + 1;
+      }
+      if (entry >= svm->program_size || svm->opcodes[entry] != SVM_INST_JTAB_ENTRY) {
+        return SVM_ERR_ILLEGAL_INSTRUCTION;
+      }
+      svm->ip = svm->operands[svm->operand_index[entry]].as_u64;
+      break;
+    }
+    case SVM_INST_JTAB_ENTRY:
+      // Running into a jump table.
+      return SVM_ERR_ILLEGAL_INSTRUCTION;
+    case SVM_INST_MEMO:
+      if (svm->memo == NULL) {
+        break;
+      }
+      if (svm->stack_ptr < operand.as_u64) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (svm_memo_enter(svm->memo, svm, inst_addr, operand.as_u64) && svm->trace != NULL) {
+        svm_trace_leave(svm->trace);
+      }
+      break;
+    case SVM_INST_VLOAD: {
+      if (svm->stack_ptr < 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (svm->stack_ptr + SVM_VEC_LANES - 2 > svm->stack_limit) {
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      svm_value_t *base = svm->stack[svm->stack_ptr - 2].as_ptr;
+      uint64_t index = svm->stack[svm->stack_ptr - 1].as_u64;
+      if (!valid_vector(svm, base, index)) {
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      svm->stack_ptr -= 2;
+      memcpy(&svm->stack[svm->stack_ptr], base + index, SVM_VEC_LANES * sizeof(svm_value_t));
+      svm->stack_ptr += SVM_VEC_LANES;
+      break;
+    }
+    case SVM_INST_VSTORE: {
+      if (svm->stack_ptr < SVM_VEC_LANES + 2) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm_value_t *base = svm->stack[svm->stack_ptr - SVM_VEC_LANES - 2].as_ptr;
+      uint64_t index = svm->stack[svm->stack_ptr - SVM_VEC_LANES - 1].as_u64;
+      if (!valid_vector(svm, base, index)) {
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      memcpy(base + index, &svm->stack[svm->stack_ptr - SVM_VEC_LANES], SVM_VEC_LANES * sizeof(svm_value_t));
+      svm->stack_ptr -= SVM_VEC_LANES + 2;
+      break;
+    }
+    case SVM_INST_VSPLAT: {
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      if (svm->stack_ptr + SVM_VEC_LANES - 1 > svm->stack_limit) {
+        return SVM_ERR_STACK_OVERFLOW;
+      }
+      svm_value_t value = svm->stack[svm->stack_ptr - 1];
+      for (int i = 1; i < SVM_VEC_LANES; i++) {
+        svm->stack[svm->stack_ptr++] = value;
+      }
+      break;
+    }
+    case SVM_INST_VADD_F:
+      if (svm->stack_ptr < 2 * SVM_VEC_LANES) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack_ptr -= SVM_VEC_LANES;
+      svm_vec_add_f64(&svm->stack[svm->stack_ptr - SVM_VEC_LANES], &svm->stack[svm->stack_ptr - SVM_VEC_LANES],
+                      &svm->stack[svm->stack_ptr]);
+      break;
+    case SVM_INST_VMUL_F:
+      if (svm->stack_ptr < 2 * SVM_VEC_LANES) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack_ptr -= SVM_VEC_LANES;
+      svm_vec_mul_f64(&svm->stack[svm->stack_ptr - SVM_VEC_LANES], &svm->stack[svm->stack_ptr - SVM_VEC_LANES],
+                      &svm->stack[svm->stack_ptr]);
+      break;
+    case SVM_INST_VFMA:
+      if (svm->stack_ptr < 3 * SVM_VEC_LANES) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      // The accumulator is the deepest operand, so a running sum can stay where it is.
+      svm->stack_ptr -= 2 * SVM_VEC_LANES;
+      svm_vec_fma_f64(&svm->stack[svm->stack_ptr - SVM_VEC_LANES], &svm->stack[svm->stack_ptr],
+                      &svm->stack[svm->stack_ptr + SVM_VEC_LANES], &svm->stack[svm->stack_ptr - SVM_VEC_LANES]);
+      break;
+    case SVM_INST_VADD_I:
+      if (svm->stack_ptr < 2 * SVM_VEC_LANES) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack_ptr -= SVM_VEC_LANES;
+      svm_vec_add_i64(&svm->stack[svm->stack_ptr - SVM_VEC_LANES], &svm->stack[svm->stack_ptr - SVM_VEC_LANES],
+                      &svm->stack[svm->stack_ptr]);
+      break;
+    case SVM_INST_VREDUCE_F:
+      if (svm->stack_ptr < SVM_VEC_LANES) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack_ptr -= SVM_VEC_LANES - 1;
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_F64(svm_vec_reduce_f64(&svm->stack[svm->stack_ptr - 1]));
+      break;
+    case SVM_INST_VREDUCE_I:
+      if (svm->stack_ptr < SVM_VEC_LANES) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      svm->stack_ptr -= SVM_VEC_LANES - 1;
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_U64(svm_vec_reduce_i64(&svm->stack[svm->stack_ptr - 1]));
+      break;
+    case SVM_INST_IO_OPEN: {
+      if (svm->io == NULL) {
+        return SVM_ERR_NO_IO;
+      }
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      const char *path = svm->stack[svm->stack_ptr - 1].as_ptr;
+      // Fibers share the I/O of the root VM, which is only used under the heap lock, as it isn't thread safe. That
+      // also keeps other fibers from freeing the buffers while the I/O uses them.
+      svm_t *heap = heap_acquire(svm);
+      uint64_t room = addr_room_locked(svm, heap, (void *)path);
+      if (room == 0) {
+        heap_release(svm);
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      int64_t result = svm_io_open(svm->io, path, room, operand.as_u64);
+      heap_release(svm);
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(result);
+      break;
+    }
+    case SVM_INST_IO_CLOSE:
+    case SVM_INST_IO_FLUSH:
+    case SVM_INST_IO_WAIT: {
+      if (svm->io == NULL) {
+        return SVM_ERR_NO_IO;
+      }
+      if (svm->stack_ptr < 1) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      uint64_t arg = svm->stack[svm->stack_ptr - 1].as_u64;
+      int64_t result;
+      heap_acquire(svm);
+      if (type == SVM_INST_IO_CLOSE) {
+        result = svm_io_close(svm->io, arg);
+      } else if (type == SVM_INST_IO_FLUSH) {
+        result = svm_io_flush(svm->io, arg);
+      } else {
+        result = svm_io_wait(svm->io, arg);
+      }
+      heap_release(svm);
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(result);
+      break;
+    }
+    case SVM_INST_IO_READ:
+    case SVM_INST_IO_WRITE:
+    case SVM_INST_IO_SUBMIT: {
+      if (svm->io == NULL) {
+        return SVM_ERR_NO_IO;
+      }
+      if (svm->stack_ptr < 3) {
+        return SVM_ERR_STACK_UNDERFLOW;
+      }
+      uint64_t handle = svm->stack[svm->stack_ptr - 3].as_u64;
+      void *buf = svm->stack[svm->stack_ptr - 2].as_ptr;
+      uint64_t size = svm->stack[svm->stack_ptr - 1].as_u64;
+      svm_t *heap = heap_acquire(svm);
+      if (size > 0 && size > addr_room_locked(svm, heap, buf)) {
+        heap_release(svm);
+        return SVM_ERR_ILLEGAL_ADDR;
+      }
+      int64_t result;
+      if (type == SVM_INST_IO_READ) {
+        result = svm_io_read(svm->io, handle, buf, size);
+      } else if (type == SVM_INST_IO_WRITE) {
+        result = svm_io_write(svm->io, handle, buf, size);
+      } else {
+        result = svm_io_submit(svm->io, operand.as_u64, handle, buf, size);
+      }
+      heap_release(svm);
+      svm->stack_ptr -= 2;
+      svm->stack[svm->stack_ptr - 1] = SVM_VALUE_I64(result);
+      break;
+    }
+    case SVM_INST_BREAK:
+      // Stay on the instruction so it runs once the debugger has put it back.
+      svm->ip = inst_addr;
+      return SVM_ERR_BREAKPOINT;
+    case SVM_INST_COPY_1:
+      if (svm->stack_ptr < 1 || svm->stack_ptr >= svm->stack_limit) {
+        return deoptimize(svm, SVM_INST_COPY);
+      }
+      svm->stack[svm->stack_ptr] = svm->stack[svm->stack_ptr - 1];
+      svm->stack_ptr++;
+      break;
+    case SVM_INST_SWAP_1: {
+      if (svm->stack_ptr < 2) {
+        return deoptimize(svm, SVM_INST_SWAP);
+      }
+      svm_value_t tmp = svm->stack[svm->stack_ptr - 1];
+      svm->stack[svm->stack_ptr - 1] = svm->stack[svm->stack_ptr - 2];
+      svm->stack[svm->stack_ptr - 2] = tmp;
+      break;
+    }
+    case SVM_INST_JNZ_TAKEN:
+      if (svm->stack_ptr < 1 || svm->stack[svm->stack_ptr - 1].as_i64 == 0) {
+        return deoptimize(svm, SVM_INST_JNZ);
+      }
+      svm->ip = operand.as_u64;
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_JNZ_NOT_TAKEN:
+      if (svm->stack_ptr < 1 || svm->stack[svm->stack_ptr - 1].as_i64 != 0) {
+        return deoptimize(svm, SVM_INST_JNZ);
+      }
+      svm->stack_ptr--;
+      break;
+    case SVM_INST_READ_CACHED: {
+      if (svm->stack_ptr < 1) {
+        return deoptimize(svm, SVM_INST_READ);
+      }
+      void* addr = svm->stack[svm->stack_ptr - 1].as_ptr;
+      uint64_t addr_idx = operand.as_u64;
+      svm_t *heap = heap_acquire(svm);
+      bool hit = addr_idx < heap->heap_addrs_ptr && heap->heap_addrs[addr_idx] == addr;
+      if (!hit) {
+        heap_release(svm);
+        return deoptimize(svm, SVM_INST_READ);
+      }
+      // Under the lock, so another fiber can't free the block in the meantime.
+      memcpy(&svm->stack[svm->stack_ptr - 1], addr, sizeof(svm_value_t));
+      heap_release(svm);
+      break;
+    }
+    default:
+      return SVM_ERR_ILLEGAL_INSTRUCTION;
+      break;
+  }
+
+  return SVM_ERR_OK;
+}
+
+bool svm_spawns_fibers(const svm_t *svm)
+{
+  for (uint64_t i = 0; i < svm->program_size; i++) {
+    if (svm->opcodes[i] == SVM_INST_SPAWN) {
+      return true;
+    }
+  }
+  return false;
+}
+
+svm_err_t svm_run_quiet(svm_t *svm)
+{
+  if (svm_spawns_fibers(svm)) {
+    svm_err_t err = svm_sched_run(svm, svm->sched_workers);
+    if (err != SVM_ERR_OK) {
+      return err;
+    }
+  } else if (svm->engine == SVM_ENGINE_REG) {
+    svm_err_t err = svm_regvm_run(svm);
+    if (err != SVM_ERR_OK) {
+      return err;
+    }
+  }
+  while (!svm->halted) {
+    svm_err_t err = svm_exec_instruction(svm);
+    if (err != SVM_ERR_OK) {
+      return err;
+    }
+  }
+  return SVM_ERR_OK;
+}
+
+svm_err_t svm_run(svm_t *svm) {
+  svm_err_t err = svm_run_quiet(svm);
+  if (err != SVM_ERR_OK) {
+    return err;
+  }
+  if (svm->heap_addrs_ptr != 0) {
+    char* plural_char = svm->heap_addrs_ptr == 1 ? "" : "es";
+    fprintf(stderr, "WARNING: %li address%s leaked.\n", svm->heap_addrs_ptr, plural_char);
+    svm_print_addr_list(svm);
+  }
+  return SVM_ERR_OK;
+}
+
+svm_err_t svm_run_for(svm_t *svm, uint64_t max_instructions)
+{
+  svm->yielded = false;
+  svm->parked = false;
+  for (uint64_t i = 0; i < max_instructions; i++) {
+    if (svm->halted || svm->yielded || svm->parked) {
+      return SVM_ERR_OK;
+    }
+    svm_err_t err = svm_exec_instruction(svm);
+    if (err != SVM_ERR_OK) {
+      return err;
+    }
+  }
+  if (svm->halted || svm->yielded || svm->parked) {
+    return SVM_ERR_OK;
+  }
+  return SVM_ERR_OUT_OF_FUEL;
+}
+
+void svm_print_stack(svm_t *svm)
+{
+  printf("Stack: \n");
+  if (svm->stack_ptr == 0) {
+    printf("  [empty]\n");
+  } else {
+    uint64_t cnt = svm->stack_ptr;
+    do {
+      cnt--;
+      svm_value_t value = svm->stack[cnt];
+      printf("  i64: %ld | u64: %lu | f64: %f | ptr: %p\n", value.as_i64, value.as_u64, value.as_f64, value.as_ptr);
+    } while (cnt != 0);
+  }
+}
+
+void svm_print_addr_list(svm_t *svm)
+{
+  printf("Addrs: \n");
+  if (svm->heap_addrs_ptr == 0) {
+    printf("  [empty]\n");
+  } else {
+    for (uint64_t i = 0; i < svm->heap_addrs_ptr; i++) {
+      printf("  %p\n", svm->heap_addrs[i]);
+    }
+  }
+}